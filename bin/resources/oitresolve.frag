@@ -0,0 +1,13 @@
+#version 330
+
+uniform sampler2D accumMap;
+uniform sampler2D revealageMap;
+in vec2 vTexCoord;
+out vec4 fragColor;
+
+void main(void)
+{
+	vec4 accum = texture(accumMap, vTexCoord);
+	float revealage = exp(-texture(revealageMap, vTexCoord).r);
+	fragColor = vec4(accum.rgb / clamp(accum.a, 1e-4, 5e4), revealage);
+}
\ No newline at end of file
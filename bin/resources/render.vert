@@ -1,7 +1,14 @@
 #version 330
 
-uniform mat4 mvpMatrix;
-uniform mat3 normalMatrix;
+// Per-frame camera data shared by the programs
+layout (std140) uniform Camera
+{
+	mat4 projectionMatrix;
+	mat4 mvMatrix;
+	mat4 mvpMatrix;
+	mat4 normalMatrix;
+	vec4 viewport;		// (width, height, 0, 0)
+};
 
 in vec3 position;
 in vec3 normal;
@@ -9,6 +16,6 @@ out vec3 vNormal;
 
 void main(void)
 {
-	vNormal = normalMatrix * normal;
+	vNormal = mat3(normalMatrix) * normal;
 	gl_Position = mvpMatrix * vec4(position, 1.0);
 }
\ No newline at end of file
@@ -8,7 +8,8 @@ uniform sampler2DArray brushMap;
 
 void main()
 {
+	// The brush layers are swizzled to (grey, grey, grey, coverage)
 	vec4 texcolor = texture(brushMap, texcoord);
-	fragColor = color * vec4(1.0 - texcolor.xyz, texcolor.a);
+	fragColor = color * vec4(vec3(1.0 - texcolor.r), texcolor.a);
 	//fragColor = color;
 }
\ No newline at end of file
@@ -0,0 +1,32 @@
+#version 330 core
+
+// Per instance attributes
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec4 particleColor;
+layout (location = 2) in int id;
+layout (location = 3) in float size;
+
+// Per vertex attribute: corner of the quad in [-1, 1]
+layout (location = 4) in vec2 corner;
+
+out vec4 color;
+out vec3 texcoord;
+
+// Per-frame camera data shared by the programs
+layout (std140) uniform Camera
+{
+	mat4 projectionMatrix;
+	mat4 mvMatrix;
+	mat4 mvpMatrix;
+	mat4 normalMatrix;
+	vec4 viewport;		// (width, height, 0, 0)
+};
+
+void main()
+{
+	vec4 eyePos = mvMatrix * vec4(position, 1.0);
+	eyePos.xy += corner * size * 0.5;
+	gl_Position = projectionMatrix * eyePos;
+	color = particleColor;
+	texcoord = vec3(corner * 0.5 + 0.5, id);
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+in vec4 color;
+in vec3 texcoord;
+layout (location = 0) out vec4 accumColor;
+layout (location = 1) out vec4 revealage;
+
+uniform sampler2DArray brushMap;
+
+// Weighted blended order-independent transparency
+// [McGuire and Bavoil 2013, Weighted Blended Order-Independent Transparency]
+void main()
+{
+	vec4 texcolor = texture(brushMap, texcoord);
+	vec4 c = color * vec4(vec3(1.0 - texcolor.r), texcolor.a);
+	float alpha = min(c.a, 0.999);
+
+	// Depth weight (eq. 9 of the paper) scaled to the canvas units.
+	// Eye space depth is recovered from gl_FragCoord.w = 1 / w_clip.
+	float z = 1.0 / gl_FragCoord.w;
+	float weight = alpha * clamp(10.0 / (1e-5 + pow(z / 200.0, 2.0) + pow(z / 8000.0, 6.0)), 1e-2, 3e3);
+	accumColor = vec4(c.rgb * alpha, alpha) * weight;
+
+	// The product of (1 - alpha) is accumulated as the sum of the logarithms,
+	// so that both targets can share the same additive blending.
+	revealage = vec4(-log(1.0 - alpha));
+}
\ No newline at end of file
@@ -1,12 +1,15 @@
-#version 330
-
-uniform sampler2D colorMap;
-uniform vec3 color;
+#version 330 core
 
+in vec4 vColor;
+flat in int vId;
 out vec4 fragColor;
 
+uniform sampler2DArray brushMap;
+
 void main(void)
 {
-	vec4 texcolor = texture(colorMap, gl_PointCoord);
-	fragColor = vec4(color * (1.0 - texcolor.xyz), texcolor.a);
-}
\ No newline at end of file
+	// gl_PointCoord has the upper left origin
+	vec3 texcoord = vec3(gl_PointCoord.x, 1.0 - gl_PointCoord.y, vId);
+	vec4 texcolor = texture(brushMap, texcoord);
+	fragColor = vColor * vec4(vec3(1.0 - texcolor.r), texcolor.a);
+}
@@ -1,20 +1,32 @@
-#version 330
+#version 330 core
 
-uniform mat4 mvMatrix;
-uniform mat4 projectionMatrix;
-uniform float screenWidth;
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec4 color;
+layout (location = 2) in int id;
+layout (location = 3) in float size;
 
-in vec3 position;
-in float pointSize;
-in float opacity;
+out vec4 vColor;
+flat out int vId;
+
+// Per-frame camera data shared by the programs
+layout (std140) uniform Camera
+{
+	mat4 projectionMatrix;
+	mat4 mvMatrix;
+	mat4 mvpMatrix;
+	mat4 normalMatrix;
+	vec4 viewport;		// (width, height, 0, 0)
+};
 
 void main(void)
 {
 	vec4 eyePos = mvMatrix * vec4(position, 1.0);
-	vec4 projCorner = projectionMatrix * vec4(pointSize * 0.5, pointSize * 0.5, eyePos.z, eyePos.w);
+	vec4 projCorner = projectionMatrix * vec4(size * 0.5, size * 0.5, eyePos.z, eyePos.w);
 	
 	// in the NDC, screen width is in [-1, 1]
-	// so actual pixel size is screenWidth * (2 * projCorner.x in NDC) / 2
-	gl_PointSize = screenWidth * projCorner.x / projCorner.w;
+	// so actual pixel size is viewport.x * (2 * projCorner.x in NDC) / 2
+	gl_PointSize = viewport.x * projCorner.x / projCorner.w;
 	gl_Position = projectionMatrix * eyePos;
+	vColor = color;
+	vId = id;
 }
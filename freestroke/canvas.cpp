@@ -3,11 +3,78 @@
 #include "timer.h"
 #include "gllib.h"
 #include "util.h"
+#include "particlesorter.h"
+#include "depthkey.h"
+#include "culling.h"
+#include "strokestore.h"
+#include "profiler.h"
 #include <QGraphicsScene>
 #include <QGLWidget>
+#include <QtConcurrentRun>
+#include <QFutureWatcher>
 #include <lbfgs.h>
 
+PackedStrokePoint::PackedStrokePoint( const StrokePoint& p )
+	: position(p.position)
+	, id((unsigned short)p.id)
+	, size(FloatToHalf(p.size))
+{
+	for (int i = 0; i < 4; i++)
+	{
+		color[i] = (unsigned char)(glm::clamp(p.color[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+// ------------------------------------------------------------
+
+namespace
+{
+
+	// Camera uniform block in the std140 layout.
+	// The declaration must match the Camera block in the shaders.
+	struct CameraBlock
+	{
+		glm::mat4 projectionMatrix;
+		glm::mat4 mvMatrix;
+		glm::mat4 mvpMatrix;
+		glm::mat4 normalMatrix;
+		glm::vec4 viewport;
+	};
+
+	const GLuint cameraBlockBinding = 0;
+
+	// Decodes the background image into the GL layout on a worker thread.
+	// Returns the null image on failure.
+	QImage DecodeBackgroundImage(QString path)
+	{
+		QImage image;
+		if (!image.load(path))
+		{
+			return QImage();
+		}
+		return QGLWidget::convertToGLFormat(image);
+	}
+
+}
+
+/*!
+	Uniform handles.
+	Uniforms set in the frame loop which are not the camera data.
+*/
+struct Canvas::Uniforms
+{
+
+	GlslUniform<glm::mat4> flatMvpMatrix;
+	GlslUniform<glm::vec4> flatColor;
+	GlslUniform<glm::mat4> flatTexMvpMatrix;
+	GlslUniform<glm::mat4> oitResolveMvpMatrix;
+
+};
+
+// ------------------------------------------------------------
+
 Canvas::Canvas()
+	: strokeStore(new StrokeStore)
 {
 	// The default constructor is used for the boost serializer.
 	// After calling the constructor, the initialize function must be called.
@@ -17,6 +84,7 @@ Canvas::Canvas(std::string proxyGeometryPath, int width, int height)
 	: proxyGeometryPath(proxyGeometryPath)
 	, canvasWidth(width)
 	, canvasHeight(height)
+	, strokeStore(new StrokeStore)
 {
 	Initialize();
 }
@@ -28,12 +96,59 @@ void Canvas::Initialize()
 	scale = 1.0f;
 	trans = glm::vec3(0.0f);
 	backgroundTexture = NULL;
+	pendingBackgroundTexture = NULL;
+	backgroundUploadBuffer = NULL;
+	brushUploadBuffer = NULL;
+	renderMode = RENDER_SORTED;
+	oitFrameBuffer = NULL;
+	oitAccumTexture = NULL;
+	oitRevealageTexture = NULL;
+	oitWidth = oitHeight = 0;
+	enableOcclusionCulling = false;
+	particleBackend = PARTICLE_GEOMETRY_SHADER;
+	benchmarkRequested = false;
+	particleIdNum = 0;
 
 	// ------------------------------------------------------------
 
 	// Load model
 	proxyModel = new ObjModel(proxyGeometryPath, 100.0f);
 	quad = new QuadMesh;
+	backgroundWatcher = new QFutureWatcher<QImage>;
+	connect(backgroundWatcher, SIGNAL(finished()), this, SLOT(OnBackgroundImageDecoded()));
+
+	// Grid lines in the static vertex buffer.
+	// The vertices [0, 80) are the grid, [80, 82) the x axis and [82, 84) the z axis.
+	gridLines = new VertexStream;
+	gridLines->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
+	gridLines->Reserve(84, 0);
+	gridLines->Begin();
+	for (int i = -10; i <= 10; i++)
+	{
+		if (i == 0) continue;
+		float v = (float)i * 10.0f;
+		gridLines->AddVertex(VertexStream::POSITION, glm::vec3(-100.0f, 0.0f, v));
+		gridLines->AddVertex(VertexStream::POSITION, glm::vec3(100.0f, 0.0f, v));
+		gridLines->AddVertex(VertexStream::POSITION, glm::vec3(v, 0.0f, -100.0f));
+		gridLines->AddVertex(VertexStream::POSITION, glm::vec3(v, 0.0f, 100.0f));
+	}
+	gridLines->AddVertex(VertexStream::POSITION, glm::vec3(-100.0f, 0.0f, 0.0f));
+	gridLines->AddVertex(VertexStream::POSITION, glm::vec3(100.0f, 0.0f, 0.0f));
+	gridLines->AddVertex(VertexStream::POSITION, glm::vec3(0.0f, 0.0f, -100.0f));
+	gridLines->AddVertex(VertexStream::POSITION, glm::vec3(0.0f, 0.0f, 100.0f));
+	gridLines->End(GL_STATIC_DRAW, true);
+
+	// Dynamic line buffers of the strokes
+	strokeLines = new VertexStream;
+	strokeLines->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
+	strokeLines->Begin();
+	strokeLines->End(GL_DYNAMIC_DRAW, true);
+	strokeLineRevision = -1;
+	currentStrokeLine = new VertexStream;
+	currentStrokeLine->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
+	currentStrokeLine->Begin();
+	currentStrokeLine->End(GL_DYNAMIC_DRAW, true);
+	currentStrokeLineNum = 0;
 
 	// Create shaders
 	renderShader = new GlslShader;
@@ -66,9 +181,95 @@ void Canvas::Initialize()
 	strokePointShader->BindAttribute(3, "size");
 	strokePointShader->Initialize();
 
+	strokePointOITShader = new GlslShader;
+	strokePointOITShader->AddShader(GlslShader::VERTEX_SHADER, "./resources/strokepoint.vert");
+	strokePointOITShader->AddShader(GlslShader::GEOMETRY_SHADER, "./resources/strokepoint.geom");
+	strokePointOITShader->AddShader(GlslShader::FRAGMENT_SHADER, "./resources/strokepoint_oit.frag");
+	strokePointOITShader->BindAttribute(0, "position");
+	strokePointOITShader->BindAttribute(1, "color");
+	strokePointOITShader->BindAttribute(2, "id");
+	strokePointOITShader->BindAttribute(3, "size");
+	strokePointOITShader->Initialize();
+
+	strokePointSpriteShader = new GlslShader;
+	strokePointSpriteShader->AddShader(GlslShader::VERTEX_SHADER, "./resources/strokepoint_ps.vert");
+	strokePointSpriteShader->AddShader(GlslShader::FRAGMENT_SHADER, "./resources/strokepoint_ps.frag");
+	strokePointSpriteShader->BindAttribute(0, "position");
+	strokePointSpriteShader->BindAttribute(1, "color");
+	strokePointSpriteShader->BindAttribute(2, "id");
+	strokePointSpriteShader->BindAttribute(3, "size");
+	strokePointSpriteShader->Initialize();
+
+	strokePointInstancedShader = new GlslShader;
+	strokePointInstancedShader->AddShader(GlslShader::VERTEX_SHADER, "./resources/strokepoint_inst.vert");
+	strokePointInstancedShader->AddShader(GlslShader::FRAGMENT_SHADER, "./resources/strokepoint.frag");
+	strokePointInstancedShader->BindAttribute(0, "position");
+	strokePointInstancedShader->BindAttribute(1, "particleColor");
+	strokePointInstancedShader->BindAttribute(2, "id");
+	strokePointInstancedShader->BindAttribute(3, "size");
+	strokePointInstancedShader->BindAttribute(4, "corner");
+	strokePointInstancedShader->Initialize();
+
+	oitResolveShader = new GlslShader;
+	oitResolveShader->AddShader(GlslShader::VERTEX_SHADER, "./resources/flattex.vert");
+	oitResolveShader->AddShader(GlslShader::FRAGMENT_SHADER, "./resources/oitresolve.frag");
+	oitResolveShader->BindAttribute(VertexStream::POSITION, "position");
+	oitResolveShader->BindAttribute(VertexStream::TEXCOORD0, "texcoord");
+	oitResolveShader->Initialize();
+
+	// Uniform handles
+	uniforms = new Uniforms;
+	uniforms->flatMvpMatrix = flatShader->GetUniform<glm::mat4>("mvpMatrix");
+	uniforms->flatColor = flatShader->GetUniform<glm::vec4>("color");
+	uniforms->flatTexMvpMatrix = flatTexShader->GetUniform<glm::mat4>("mvpMatrix");
+	uniforms->oitResolveMvpMatrix = oitResolveShader->GetUniform<glm::mat4>("mvpMatrix");
+
+	// The uniforms which never change are set only once
+	renderShader->Begin();
+	renderShader->GetUniform<glm::vec4>("diffuseColor").Set(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+	renderShader->GetUniform<glm::vec4>("emissionColor").Set(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+	renderShader->GetUniform<glm::vec4>("lightDir").Set(glm::vec4(0.2f, 0.4f, 0.6f, 0.0f));
+	renderShader->End();
+
+	flatTexShader->Begin();
+	flatTexShader->GetUniform<int>("colorMap").Set(0);
+	flatTexShader->End();
+
+	oitResolveShader->Begin();
+	oitResolveShader->GetUniform<int>("accumMap").Set(0);
+	oitResolveShader->GetUniform<int>("revealageMap").Set(1);
+	oitResolveShader->End();
+
+	// Camera uniform block shared by the programs
+	cameraBuffer = new UniformBuffer(sizeof(CameraBlock));
+	GlslShader* cameraShaders[] =
+	{
+		renderShader,
+		strokePointShader,
+		strokePointOITShader,
+		strokePointSpriteShader,
+		strokePointInstancedShader
+	};
+
+	for (int i = 0; i < sizeof(cameraShaders) / sizeof(cameraShaders[0]); i++)
+	{
+		cameraShaders[i]->BindUniformBlock("Camera", cameraBlockBinding);
+		cameraShaders[i]->Begin();
+		cameraShaders[i]->GetUniform<int>("brushMap").Set(0);
+		cameraShaders[i]->End();
+	}
+
 	// Load brush textures
 	LoadBrushTexture();
 
+	// Particle sorter
+	particleSorter = new ParticleSorter;
+	strokeHierarchy = new StrokeHierarchy;
+	occlusionBuffer = new OcclusionBuffer;
+
+	// Profiler
+	profiler = new Profiler;
+
 	// Camera params
 	fov = 45.0f;
 	nearClip = 0.01f;
@@ -78,38 +279,73 @@ void Canvas::Initialize()
 Canvas::~Canvas()
 {
 	SAFE_DELETE(brushTextures);
-	for (int i = 0; i < strokeList.size(); i++)
-	{
-		SAFE_DELETE(strokeList[i]);
-	}
+	SAFE_DELETE(brushUploadBuffer);
+	SAFE_DELETE(strokeStore);
 	SAFE_DELETE(renderShader);
 	SAFE_DELETE(flatShader);
 	SAFE_DELETE(quad);
+	SAFE_DELETE(gridLines);
+	SAFE_DELETE(strokeLines);
+	SAFE_DELETE(currentStrokeLine);
 	SAFE_DELETE(proxyModel);
+	SAFE_DELETE(particleSorter);
+	SAFE_DELETE(strokeHierarchy);
+	SAFE_DELETE(occlusionBuffer);
+	SAFE_DELETE(profiler);
+	SAFE_DELETE(strokePointOITShader);
+	SAFE_DELETE(strokePointSpriteShader);
+	SAFE_DELETE(strokePointInstancedShader);
+	SAFE_DELETE(oitResolveShader);
+	SAFE_DELETE(uniforms);
+	SAFE_DELETE(cameraBuffer);
+	SAFE_DELETE(oitFrameBuffer);
+	SAFE_DELETE(oitAccumTexture);
+	SAFE_DELETE(oitRevealageTexture);
+
+	// The worker may still decode the image
+	backgroundWatcher->waitForFinished();
+	SAFE_DELETE(backgroundWatcher);
+	SAFE_DELETE(backgroundTexture);
+	SAFE_DELETE(pendingBackgroundTexture);
+	SAFE_DELETE(backgroundUploadBuffer);
 }
 
 void Canvas::LoadBrushTexture()
 {
 	float size = Util::Get()->GetBrushSize();
 	int n = Util::Get()->GetBrushNum();
-	brushTextures = new Texture2DArray(size, size, n, GL_RGBA8, GL_RGBA, GL_REPEAT, GL_LINEAR, GL_LINEAR);
-	for (int i = 0; i < n; i++)
-	{
-		QString path = Util::Get()->GetBrushPath(i);
-		QImage image;
-		if (!image.load(path))
-		{
-			THROW_EXCEPTION(Exception::FileError,
-				("Failed to load brush image: " + path).toStdString());
-		}
 
-		QImage image2(image.width(), image.height(), QImage::Format_ARGB32);
-		image2.fill(Qt::transparent);
-		QPainter painter(&image2);
-		painter.drawImage(0, 0, image);
+	// The brushes are grey masks stored in one or two channels.
+	// The swizzle maps them to the grey level in rgb and the coverage in a.
+	bool alphaOnly = Util::Get()->GetBrushChannels() == 1;
+	GLenum format = alphaOnly ? GL_RED : GL_RG;
+	brushTextures = new Texture2DArray(size, size, n, alphaOnly ? GL_R8 : GL_RG8, format,
+		GL_REPEAT, GL_LINEAR, GL_LINEAR_MIPMAP_LINEAR);
+	if (alphaOnly)
+	{
+		brushTextures->SetSwizzle(GL_ZERO, GL_ZERO, GL_ZERO, GL_RED);
+	}
+	else
+	{
+		brushTextures->SetSwizzle(GL_RED, GL_RED, GL_RED, GL_GREEN);
+	}
 
-		QImage glimage = QGLWidget::convertToGLFormat(image2);
-		brushTextures->Substitute(i, GL_RGBA, glimage.bits());
+	// The brushes are already converted and packed by the loader,
+	// so all layers are streamed at once through the pixel buffer.
+	// The particles mostly cover a few pixels, so the mipmaps are generated for the minification.
+	// The buffer is released when the fence is signaled (see UpdatePendingTextures).
+	if (n > 0)
+	{
+		int layerSize = (int)size * (int)size * Util::Get()->GetBrushChannels();
+		brushUploadBuffer = new PixelUploadBuffer(layerSize * n);
+		memcpy(brushUploadBuffer->Map(), Util::Get()->GetBrushData(), layerSize * n);
+		brushUploadBuffer->Unmap();
+
+		brushUploadBuffer->Bind();
+		brushTextures->Substitute(0, n, format, NULL);
+		brushUploadBuffer->Unbind();
+		brushTextures->GenerateMipmap();
+		brushUploadBuffer->Fence();
 	}
 }
 
@@ -133,13 +369,14 @@ void Canvas::OnMouseMoved( QGraphicsSceneMouseEvent* event )
 			currentStrokePoints.push_back(StrokePoint(
 				glm::vec3((float)event->scenePos().x(), canvasHeight - (float)event->scenePos().y(), 0.0f),
 				glm::vec4(brushColor, brushOpacity),
-				brushID, brushSize, strokeList.size()));
+				brushID, brushSize, strokeStore->GetStrokeNum()));
 		}
 		else
 		{
 			currentStrokeSteps++;
 		}
 		event->accept();
+		emit RedrawRequested();
 	}
 	else if (state == STATE_ROTATING)
 	{
@@ -153,6 +390,7 @@ void Canvas::OnMouseMoved( QGraphicsSceneMouseEvent* event )
 		glm::normalize(axis);
 		currentQuat = glm::cross(glm::rotate(glm::quat(), rot, axis), startQuat);
 		event->accept();
+		emit RedrawRequested();
 	}
 	else if (state == STATE_TRANSLATING)
 	{
@@ -160,6 +398,7 @@ void Canvas::OnMouseMoved( QGraphicsSceneMouseEvent* event )
 		float deltay = (float)(event->scenePos().y() - event->lastScenePos().y()) / canvasHeight * 50.0f;
 		trans += glm::vec3(deltax, -deltay, 0.0f);
 		event->accept();
+		emit RedrawRequested();
 	}
 	else
 	{
@@ -213,15 +452,13 @@ void Canvas::OnMouseReleased( QGraphicsSceneMouseEvent* event )
 		{
 			if (currentStrokePoints.size() >= 2)
 			{
-				Stroke* stroke = new Stroke(this, brushSpacing);
-				if (stroke->Embed(currentStrokePoints))
+				Stroke stroke(this, brushSpacing);
+				if (stroke.Embed(currentStrokePoints))
 				{
-					strokeList.push_back(stroke);
+					strokeStore->Add(stroke.strokePoints, brushSpacing);
+					strokeHierarchy->Invalidate();
 					SetModified(true);
-				}
-				else
-				{
-					SAFE_DELETE(stroke);
+					emit StrokeAdded();
 				}
 			}
 			else
@@ -229,6 +466,7 @@ void Canvas::OnMouseReleased( QGraphicsSceneMouseEvent* event )
 				Util::Get()->ShowStatusMessage("Number of stroke points must be larger than 1");
 			}
 			currentStrokePoints.clear();
+			currentStrokeLineNum = 0;
 			ChangeState(STATE_IDLE);
 			event->accept();
 			return;
@@ -262,6 +500,7 @@ void Canvas::OnWheelEvent( QGraphicsSceneWheelEvent* event )
 		scale += event->delta() / 360.0f / 10.0f;
 		if (scale < 0.001f) scale = 0.001f;
 		event->accept();
+		emit RedrawRequested();
 	}
 	event->ignore();
 }
@@ -270,10 +509,18 @@ void Canvas::ChangeState( State nextState )
 {
 	state = nextState;
 	emit StateChanged((unsigned int)nextState);
+
+	// The view changes continuously while the canvas is manipulated,
+	// and the frame after the manipulation is drawn on demand.
+	emit ContinuousRedrawChanged(nextState != STATE_IDLE);
+	emit RedrawRequested();
 }
 
 void Canvas::OnDraw()
 {
+	profiler->BeginFrame();
+	UpdatePendingTextures();
+
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 
@@ -303,22 +550,56 @@ void Canvas::OnDraw()
 	camWorldV = glm::vec3(mvMatrixInv3 * glm::vec3(0.0f, 1.0f, 0.0f));
 	camWorldW = glm::vec3(mvMatrixInv3 * glm::vec3(0.0f, 0.0f, 1.0f));
 
+	// Upload the camera data once for all programs
+	CameraBlock cameraBlock;
+	cameraBlock.projectionMatrix = projectionMatrix;
+	cameraBlock.mvMatrix = mvMatrix;
+	cameraBlock.mvpMatrix = mvpMatrix;
+	cameraBlock.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(mvMatrix))));
+	cameraBlock.viewport = glm::vec4((float)canvasWidth, (float)canvasHeight, 0.0f, 0.0f);
+	cameraBuffer->Update(&cameraBlock);
+	cameraBuffer->BindBase(cameraBlockBinding);
+
 	// ------------------------------------------------------------
 
 	//
 	// Rendering
 	//
 
-	DrawBackground();
-	DrawGrid(mvpMatrix);
-	DrawProxyObject();
+	{
+		ScopedProfile profile(profiler, "Background");
+		DrawBackground();
+	}
+	{
+		ScopedProfile profile(profiler, "Grid");
+		DrawGrid(mvpMatrix);
+	}
+	{
+		ScopedProfile profile(profiler, "Proxy object");
+		DrawProxyObject();
+	}
+
 	DrawStrokes();
-	DrawCurrentStroke();
+
+	{
+		ScopedProfile profile(profiler, "Current stroke");
+		DrawCurrentStroke();
+	}
 
 	// ------------------------------------------------------------
 
 	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_CULL_FACE);
+
+	// The errors of the GL calls made directly in the canvas are reported at the end of the frame
+	CHECK_GL_ERRORS();
+
+	profiler->EndFrame();
+	if (profiler->IsEnabled())
+	{
+		emit ProfileUpdated(QString::fromStdString(profiler->GetSummary()));
+		emit GpuFrameTimeUpdated((float)profiler->GetGpuFrameTime());
+	}
 }
 
 void Canvas::DrawGrid(const glm::mat4& mvpMatrix)
@@ -326,32 +607,15 @@ void Canvas::DrawGrid(const glm::mat4& mvpMatrix)
 	if (!enableGrid) return;
 
 	flatShader->Begin();
-	flatShader->SetUniformMatrix4f("mvpMatrix", mvpMatrix);
-	flatShader->SetUniform4f("color", glm::vec4(0.8f, 0.8f, 0.8f, 1.0f));
+	uniforms->flatMvpMatrix.Set(mvpMatrix);
+	uniforms->flatColor.Set(glm::vec4(0.8f, 0.8f, 0.8f, 1.0f));
+	gridLines->Draw(GL_LINES, 0, 80);
 
-	glBegin(GL_LINES);
-	for (int i = -10; i <= 10; i++)
-	{
-		if (i == 0) continue;
-		float v = (float)i * 10.0f;
-		glVertex3f(-100.0f, 0.0f, v);
-		glVertex3f(100.0f, 0.0f, v);
-		glVertex3f(v, 0.0f, -100.0f);
-		glVertex3f(v, 0.0f, 100.0f);
-	}
-	glEnd();
+	uniforms->flatColor.Set(glm::vec4(1.0f, 0.3f, 0.3f, 1.0f));
+	gridLines->Draw(GL_LINES, 80, 2);
 
-	flatShader->SetUniform4f("color", glm::vec4(1.0f, 0.3f, 0.3f, 1.0f));
-	glBegin(GL_LINES);
-	glVertex3f(-100.0f, 0.0f, 0.0f);
-	glVertex3f(100.0f, 0.0f, 0.0f);
-	glEnd();
-
-	flatShader->SetUniform4f("color", glm::vec4(0.3f, 0.3f, 1.0f, 1.0f));
-	glBegin(GL_LINES);
-	glVertex3f(0.0f, 0.0f, -100.0f);
-	glVertex3f(0.0f, 0.0f, 100.0f);
-	glEnd();
+	uniforms->flatColor.Set(glm::vec4(0.3f, 0.3f, 1.0f, 1.0f));
+	gridLines->Draw(GL_LINES, 82, 2);
 
 	flatShader->End();
 }
@@ -362,8 +626,7 @@ void Canvas::DrawBackground()
 	{
 		glDisable(GL_DEPTH_TEST);
 		flatTexShader->Begin();
-		flatTexShader->SetUniformMatrix4f("mvpMatrix", glm::ortho(-1.0f, 1.0f, -1.0f, 1.0f));
-		flatTexShader->SetUniformTexture("colorMap", 0);
+		uniforms->flatTexMvpMatrix.Set(glm::ortho(-1.0f, 1.0f, -1.0f, 1.0f));
 		backgroundTexture->Bind();
 		quad->Draw();
 		flatTexShader->End();
@@ -371,126 +634,544 @@ void Canvas::DrawBackground()
 	}
 }
 
+void Canvas::UpdatePendingTextures()
+{
+	if (brushUploadBuffer && brushUploadBuffer->IsComplete())
+	{
+		SAFE_DELETE(brushUploadBuffer);
+	}
+
+	// ------------------------------------------------------------
+
+	// Start streaming the decoded background image.
+	// The texture storage is allocated without the data and filled from the pixel buffer,
+	// so the call returns without waiting for the transfer.
+	if (!decodedBackgroundImage.isNull())
+	{
+		SAFE_DELETE(pendingBackgroundTexture);
+		SAFE_DELETE(backgroundUploadBuffer);
+
+		int w = decodedBackgroundImage.width();
+		int h = decodedBackgroundImage.height();
+		pendingBackgroundTexture = new Texture2D(w, h, GL_RGBA8, GL_RGBA, GL_CLAMP, GL_LINEAR, GL_LINEAR);
+		backgroundUploadBuffer = new PixelUploadBuffer(decodedBackgroundImage.byteCount());
+		memcpy(backgroundUploadBuffer->Map(), decodedBackgroundImage.constBits(), decodedBackgroundImage.byteCount());
+		backgroundUploadBuffer->Unmap();
+
+		backgroundUploadBuffer->Bind();
+		pendingBackgroundTexture->Substitute(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		backgroundUploadBuffer->Unbind();
+		backgroundUploadBuffer->Fence();
+
+		decodedBackgroundImage = QImage();
+	}
+
+	// Replace the background once the transfer is done.
+	// Until then the current background is drawn and the frames are requested to poll the fence.
+	if (pendingBackgroundTexture)
+	{
+		if (backgroundUploadBuffer->IsComplete())
+		{
+			SAFE_DELETE(backgroundTexture);
+			SAFE_DELETE(backgroundUploadBuffer);
+			backgroundTexture = pendingBackgroundTexture;
+			pendingBackgroundTexture = NULL;
+			Util::Get()->ShowStatusMessage("Loaded background image " + backgroundImagePath);
+		}
+		else
+		{
+			QTimer::singleShot(5, this, SIGNAL(RedrawRequested()));
+		}
+	}
+}
+
 void Canvas::DrawStrokes()
 {
-	if (strokeList.size() == 0)
+	if (strokeStore->GetStrokeNum() == 0)
 	{
 		emit StrokeStateChanged(0, 0);
 		return;
 	}
 
+	int strokeNum = strokeStore->GetStrokeNum();
+
+	// Culling and the particle generation
+	profiler->BeginStage("Particle build");
+
+	// ------------------------------------------------------------
+
+	//
+	// Culling
+	//
+
+	// Strokes outside of the view frustum are rejected with the bounding sphere hierarchy
+	Frustum frustum(mvpMatrix);
+	strokeHierarchy->Update(*strokeStore);
+	strokeHierarchy->Cull(*strokeStore, frustum, strokeCullResults);
+
+	// Occluders are rasterized from the simplified proxy mesh into the low resolution depth buffer
+	const int occlusionBufferScale = 4;
+	bool occlusionCulling = enableOcclusionCulling && proxyModel;
+	if (occlusionCulling)
+	{
+		occlusionBuffer->Resize(canvasWidth / occlusionBufferScale, canvasHeight / occlusionBufferScale);
+		occlusionBuffer->Render(proxyModel->GetOccluderVertices(), proxyModel->GetOccluderFaces(),
+			proxyModel->GetOccluderError(), mvpMatrix);
+	}
+
 	// ------------------------------------------------------------
 
 	//
 	// Create vertex array for rendering
 	//
-	
-	std::vector<StrokePoint> vertices;
-	for (int i = 0; i < strokeList.size(); i++)
+
+	// Each stroke writes its particles to its own region of the particle array,
+	// so the particles can be generated in parallel.
+	std::vector<int> particleOffsets(strokeNum + 1);
+	particleOffsets[0] = 0;
+
+	// The level of detail of each stroke is selected from the projected particle spacing.
+	// pixelScale converts the world space length at the unit depth to pixels.
+	float pixelScale = projectionMatrix[1][1] * (float)canvasHeight * 0.5f;
+	strokeParticleLevels.resize(strokeNum);
+
+#pragma omp parallel for
+	for (int i = 0; i < strokeNum; i++)
 	{
-		Stroke* stroke = strokeList[i];
-		for (int j = 0, k = 1; k < stroke->strokePoints.size(); j=k++)
+		if (strokeCullResults[i] == Frustum::OUTSIDE)
+		{
+			particleOffsets[i+1] = 0;
+		}
+		else
+		{
+			strokeParticleLevels[i] = strokeStore->SelectParticleLevel(i, camWorldPos, pixelScale, nearClip);
+			particleOffsets[i+1] = strokeStore->GetParticleNum(i, strokeParticleLevels[i]);
+		}
+	}
+
+	for (int i = 0; i < strokeNum; i++)
+	{
+		particleOffsets[i+1] += particleOffsets[i];
+	}
+
+	// Each particle has the stable ID for the sorter, which is its index in the finest level
+	// of all strokes. The IDs do not change with the level of detail and the culling,
+	// and the strokes are added or removed only at the back.
+	std::vector<unsigned int> particleIdBases(strokeNum + 1);
+	particleIdBases[0] = 0;
+	for (int i = 0; i < strokeNum; i++)
+	{
+		particleIdBases[i+1] = particleIdBases[i] + strokeStore->GetAttribute(i).particleNum;
+	}
+	particleIdNum = particleIdBases[strokeNum];
+
+	particles.resize(particleOffsets[strokeNum]);
+	particlePositionX.resize(particleOffsets[strokeNum]);
+	particlePositionY.resize(particleOffsets[strokeNum]);
+	particlePositionZ.resize(particleOffsets[strokeNum]);
+	particleGuids.resize(particleOffsets[strokeNum]);
+	particleIds.resize(particleOffsets[strokeNum]);
+	strokeParticleNums.resize(strokeNum);
+
+	// The particles are culled and written in the packed format for GL,
+	// together with the positions and GUIDs in the SoA form for the depth key kernel.
+#pragma omp parallel
+	{
+		// Particles of a stroke before the culling
+		std::vector<StrokePoint> strokeParticles;
+
+#pragma omp for schedule(dynamic, 16)
+		for (int i = 0; i < strokeNum; i++)
 		{
-			StrokePoint& sp1 = stroke->strokePoints[j];
-			StrokePoint& sp2 = stroke->strokePoints[k];
-			float dist2 = glm::distance2(sp1.position, sp2.position);
-			float sp = stroke->brushSpacing;
-			if (sp * sp < dist2)
+			int begin = particleOffsets[i];
+			int end = particleOffsets[i+1];
+			if (begin == end)
 			{
-				int div = (int)ceilf(glm::sqrt(dist2) / sp);
-				float step = 1.0f / ((float)div + 1.0f);
-				for (int l = 1; l < div; l++)
-				{
-					float t = step * (float)l;
-					vertices.push_back(StrokePoint(
-						glm::mix(sp1.position, sp2.position, t),
-						glm::mix(sp1.color, sp2.color, t),
-						sp1.id,
-						glm::mix(sp1.size, sp1.size, t),
-						sp1.guid));
-				}
+				strokeParticleNums[i] = 0;
+				continue;
+			}
+
+			strokeParticles.resize(end - begin);
+			strokeStore->GenerateParticles(i, strokeParticleLevels[i], &strokeParticles[0]);
+
+			// Particles of the partially visible strokes are tested individually,
+			// and the remaining particles are packed to the front of the region.
+			bool frustumCulling = strokeCullResults[i] == Frustum::INTERSECT;
+			int num = begin;
+			for (int j = 0; j < end - begin; j++)
+			{
+				const StrokePoint& p = strokeParticles[j];
+				float radius = p.size * 0.7072f;
+				if (frustumCulling && !frustum.Intersects(p.position, radius)) continue;
+				if (occlusionCulling && occlusionBuffer->IsOccluded(p.position, radius)) continue;
+
+				particles[num] = PackedStrokePoint(p);
+				particlePositionX[num] = p.position.x;
+				particlePositionY[num] = p.position.y;
+				particlePositionZ[num] = p.position.z;
+				particleGuids[num] = (float)p.guid;
+				particleIds[num] = particleIdBases[i] + (j << strokeParticleLevels[i]);
+				num++;
 			}
-			vertices.push_back(sp1);
-			vertices.push_back(sp2);
+
+			strokeParticleNums[i] = num - begin;
 		}
 	}
 
-	emit StrokeStateChanged(strokeList.size(), vertices.size());
+	// Close the gaps between the regions left by the culled particles
+	int particleNum = 0;
+	for (int i = 0; i < strokeNum; i++)
+	{
+		int begin = particleOffsets[i];
+		int end = begin + strokeParticleNums[i];
+		if (particleNum != begin)
+		{
+			std::copy(particles.begin() + begin, particles.begin() + end, particles.begin() + particleNum);
+			std::copy(particlePositionX.begin() + begin, particlePositionX.begin() + end, particlePositionX.begin() + particleNum);
+			std::copy(particlePositionY.begin() + begin, particlePositionY.begin() + end, particlePositionY.begin() + particleNum);
+			std::copy(particlePositionZ.begin() + begin, particlePositionZ.begin() + end, particlePositionZ.begin() + particleNum);
+			std::copy(particleGuids.begin() + begin, particleGuids.begin() + end, particleGuids.begin() + particleNum);
+			std::copy(particleIds.begin() + begin, particleIds.begin() + end, particleIds.begin() + particleNum);
+		}
+		particleNum += strokeParticleNums[i];
+	}
+
+	particles.resize(particleNum);
+	particlePositionX.resize(particleNum);
+	particlePositionY.resize(particleNum);
+	particlePositionZ.resize(particleNum);
+	particleGuids.resize(particleNum);
+	particleIds.resize(particleNum);
+
+	profiler->EndStage();
+
+	emit StrokeStateChanged(strokeNum, particleNum);
 
 	// ------------------------------------------------------------
 
 	//
-	// Sort vertices
+	// Render
 	//
 
-	std::vector<std::pair<float, int> > modifiedDepthList;
-	for (int i = 0; i < vertices.size(); i++)
+	if (enableParticle && particleNum > 0)
+	{
+		if (renderMode == RENDER_WEIGHTED_OIT)
+		{
+			DrawParticlesWeightedOIT();
+		}
+		else
+		{
+			DrawParticlesSorted();
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	//
+	// Stroke line
+	//
+	
+	if (enableStrokeLine)
+	{
+		ScopedProfile profile(profiler, "Stroke lines");
+		DrawStrokeLines();
+	}
+}
+
+void Canvas::DrawStrokeLines()
+{
+	// The vertex buffer is rebuilt only when the strokes are modified.
+	// The points of each stroke are contiguous in the buffer as in the stroke store,
+	// so all polylines are drawn in a single call.
+	if (strokeLineRevision != strokeStore->GetRevision())
+	{
+		int strokeNum = strokeStore->GetStrokeNum();
+		std::vector<glm::vec3> vertices(strokeStore->GetPointNum());
+		strokeLineFirsts.resize(strokeNum);
+		strokeLineCounts.resize(strokeNum);
+		for (int i = 0; i < strokeNum; i++)
+		{
+			const StrokeAttribute& attr = strokeStore->GetAttribute(i);
+			strokeLineFirsts[i] = attr.pointBegin;
+			strokeLineCounts[i] = attr.pointNum;
+			for (int j = 0; j < attr.pointNum; j++)
+			{
+				vertices[attr.pointBegin + j] = strokeStore->GetPosition(i, j);
+			}
+		}
+
+		strokeLines->Resize(vertices.size());
+		strokeLines->UpdateVertices(0, vertices.size(), vertices.empty() ? NULL : &vertices[0]);
+		strokeLineRevision = strokeStore->GetRevision();
+	}
+
+	flatShader->Begin();
+	uniforms->flatMvpMatrix.Set(mvpMatrix);
+	uniforms->flatColor.Set(glm::vec4(0.5f, 0.5f, 1.0f, 1.0f));
+	strokeLines->MultiDraw(GL_LINE_STRIP, strokeLineFirsts, strokeLineCounts);
+	glPointSize(2.0);
+	strokeLines->Draw(GL_POINTS);
+	flatShader->End();
+}
+
+void Canvas::SortParticles()
+{
+	int particleNum = particles.size();
+
+	// Depth keys are computed with the SIMD kernel in the blocks of the particles.
+	const int depthKeyBlockSize = 4096;
+	int depthKeyBlockNum = (particleNum + depthKeyBlockSize - 1) / depthKeyBlockSize;
+	particleDepths.resize(particleNum);
+
+#pragma omp parallel for
+	for (int block = 0; block < depthKeyBlockNum; block++)
 	{
-		int guid = vertices[i].guid;
-		glm::vec3& pi = vertices[i].position;
-		glm::vec3 di = glm::normalize(pi - camWorldPos);
+		int begin = block * depthKeyBlockSize;
+		int n = glm::min(depthKeyBlockSize, particleNum - begin);
+		DepthKeyKernel::Compute(
+			&particlePositionX[begin], &particlePositionY[begin], &particlePositionZ[begin], &particleGuids[begin], n,
+			camWorldPos, strokeOrderOffset, &particleDepths[begin]);
+	}
+
+	// The permutation of the previous frame is reused if the order is almost unchanged,
+	// e.g. while rotating the camera. The particles are matched by the IDs,
+	// since the culling and the level of detail change the particle set.
+	particleSorter->Sort(particleDepths, particleIds, particleIdNum);
+}
+
+void Canvas::EnableParticleAttributes( const PackedStrokePoint* data )
+{
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	GLsizei stride = sizeof(PackedStrokePoint);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, &data->position);
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, data->color);
+	glVertexAttribIPointer(2, 1, GL_UNSIGNED_SHORT, stride, &data->id);
+	glVertexAttribPointer(3, 1, GL_HALF_FLOAT, GL_FALSE, stride, &data->size);
+}
+
+void Canvas::DisableParticleAttributes()
+{
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(2);
+	glDisableVertexAttribArray(3);
+}
+
+void Canvas::DrawParticlesSorted()
+{
+	//
+	// Sort vertices
+	//
 
-		// Distance from the current camera position.
-		float depth = glm::distance2(pi - strokeOrderOffset * (float)guid * di, camWorldPos);
-		modifiedDepthList.push_back(std::make_pair(depth, i));
+	{
+		ScopedProfile profile(profiler, "Sort");
+		SortParticles();
 	}
-	std::sort(modifiedDepthList.begin(), modifiedDepthList.end());
+	const std::vector<unsigned int>& indexList = particleSorter->GetIndices();
 
-	std::vector<unsigned int> indexList;
-	for (int i = modifiedDepthList.size() - 1; i >= 0; i--)
+	// The particle data is transferred to GL from the client arrays in the draw call,
+	// so only the gathering for the instanced backend is measured separately.
+	if (particleBackend == PARTICLE_INSTANCED_QUAD)
 	{
-		indexList.push_back(modifiedDepthList[i].second);
+		ScopedProfile profile(profiler, "Upload");
+		GatherSortedParticles(indexList);
 	}
 
 	// ------------------------------------------------------------
 
 	//
-	// Render
+	// Render in back-to-front order
 	//
 
-	if (enableParticle) 
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	if (benchmarkRequested)
+	{
+		benchmarkRequested = false;
+		BenchmarkParticleBackends(indexList);
+	}
+
+	{
+		ScopedProfile profile(profiler, "Draw");
+		DrawSortedParticles(particleBackend, indexList);
+	}
+
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+}
+
+void Canvas::GatherSortedParticles( const std::vector<unsigned int>& indexList )
+{
+	int particleNum = particles.size();
+	sortedParticles.resize(particleNum);
+
+#pragma omp parallel for
+	for (int i = 0; i < particleNum; i++)
+	{
+		sortedParticles[i] = particles[indexList[i]];
+	}
+}
+
+void Canvas::DrawSortedParticles( ParticleBackend backend, const std::vector<unsigned int>& indexList )
+{
+	int particleNum = particles.size();
+
+	if (backend == PARTICLE_POINT_SPRITE)
+	{
+		// The point size is computed in the vertex shader.
+		// Note that the size is limited by GL_POINT_SIZE_RANGE and
+		// the points are clipped with their centers.
+		glEnable(GL_PROGRAM_POINT_SIZE);
+		strokePointSpriteShader->Begin();
+		brushTextures->Bind();
+		EnableParticleAttributes(&particles[0]);
+		glDrawElements(GL_POINTS, particleNum, GL_UNSIGNED_INT, &indexList[0]);
+		DisableParticleAttributes();
+		strokePointSpriteShader->End();
+		glDisable(GL_PROGRAM_POINT_SIZE);
+	}
+	else if (backend == PARTICLE_INSTANCED_QUAD)
+	{
+		// Corners of the quad drawn as a triangle strip
+		static const float corners[] =
+		{
+			-1.0f, -1.0f,
+			 1.0f, -1.0f,
+			-1.0f,  1.0f,
+			 1.0f,  1.0f
+		};
+
+		// The instances are drawn in the order of the array,
+		// so the particles must be gathered in the sorted order in advance.
+		strokePointInstancedShader->Begin();
+		brushTextures->Bind();
+		EnableParticleAttributes(&sortedParticles[0]);
+		for (int i = 0; i < 4; i++)
+		{
+			glVertexAttribDivisor(i, 1);
+		}
+		glEnableVertexAttribArray(4);
+		glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, 0, corners);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particleNum);
+		glDisableVertexAttribArray(4);
+		for (int i = 0; i < 4; i++)
+		{
+			glVertexAttribDivisor(i, 0);
+		}
+		DisableParticleAttributes();
+		strokePointInstancedShader->End();
+	}
+	else
 	{
-		glDisable(GL_DEPTH_TEST);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		strokePointShader->Begin();
-		strokePointShader->SetUniformMatrix4f("mvMatrix", mvMatrix);
-		strokePointShader->SetUniformMatrix4f("projectionMatrix", projectionMatrix);
-		strokePointShader->SetUniformTexture("brushMap", 0);
 		brushTextures->Bind();
-		glEnableVertexAttribArray(0);
-		glEnableVertexAttribArray(1);
-		glEnableVertexAttribArray(2);
-		glEnableVertexAttribArray(3);
-		GLsizei stride = sizeof(StrokePoint);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, &vertices[0].position);
-		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, &vertices[0].color);
-		glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride, &vertices[0].id);
-		glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, &vertices[0].size);
-		//glDrawArrays(GL_POINTS, 0, vertices.size());
-		glDrawElements(GL_POINTS, vertices.size(), GL_UNSIGNED_INT, &indexList[0]);
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
-		glEnableVertexAttribArray(3);
+		EnableParticleAttributes(&particles[0]);
+		glDrawElements(GL_POINTS, particleNum, GL_UNSIGNED_INT, &indexList[0]);
+		DisableParticleAttributes();
 		strokePointShader->End();
-		glDisable(GL_BLEND);
-		glEnable(GL_DEPTH_TEST);
 	}
+}
 
-	// ------------------------------------------------------------
+void Canvas::BenchmarkParticleBackends( const std::vector<unsigned int>& indexList )
+{
+	// Number of the frames rendered for each backend
+	const int frameNum = 20;
 
-	//
-	// Stroke line
-	//
-	
-	if (enableStrokeLine)
+	const char* backendNames[PARTICLE_BACKEND_NUM] =
+	{
+		"Geometry shader",
+		"Point sprite",
+		"Instanced quad"
+	};
+
+	// The particles of the current view are drawn repeatedly over the frame buffer.
+	// glFinish is called to measure the time including the rasterization and blending.
+	std::string result = (boost::format("Benchmark (%d particles, %dx%d):") % particles.size() % canvasWidth % canvasHeight).str();
+	// The gathering for the instanced backend is done once outside of the measurement.
+	GatherSortedParticles(indexList);
+	for (int backend = 0; backend < PARTICLE_BACKEND_NUM; backend++)
 	{
-		for (int i = 0; i < strokeList.size(); i++)
+		// Warm up
+		DrawSortedParticles((ParticleBackend)backend, indexList);
+		glFinish();
+
+		double start = Timer::GetCurrentTimeMilli();
+		for (int i = 0; i < frameNum; i++)
 		{
-			strokeList[i]->Draw();
+			DrawSortedParticles((ParticleBackend)backend, indexList);
 		}
+		glFinish();
+		double elapsed = (Timer::GetCurrentTimeMilli() - start) / frameNum;
+
+		result += (boost::format(" %s %.2f ms;") % backendNames[backend] % elapsed).str();
 	}
+
+	Util::Get()->ShowStatusMessage(QString::fromStdString(result));
+}
+
+void Canvas::DrawParticlesWeightedOIT()
+{
+	// (Re)create the render targets if the canvas is resized
+	if (!oitFrameBuffer || oitWidth != canvasWidth || oitHeight != canvasHeight)
+	{
+		SAFE_DELETE(oitFrameBuffer);
+		SAFE_DELETE(oitAccumTexture);
+		SAFE_DELETE(oitRevealageTexture);
+		oitWidth = canvasWidth;
+		oitHeight = canvasHeight;
+		oitAccumTexture = new Texture2D(oitWidth, oitHeight, GL_RGBA16F, GL_RGBA, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+		oitRevealageTexture = new Texture2D(oitWidth, oitHeight, GL_R16F, GL_RED, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+		oitFrameBuffer = new FrameBuffer;
+		oitFrameBuffer->AttachTexture(GL_COLOR_ATTACHMENT0, oitAccumTexture);
+		oitFrameBuffer->AttachTexture(GL_COLOR_ATTACHMENT1, oitRevealageTexture);
+	}
+
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+
+	// ------------------------------------------------------------
+
+	//
+	// Accumulation pass.
+	// The blending is order independent, so the particles are not sorted.
+	//
+
+	ScopedProfile profile(profiler, "Draw");
+	oitFrameBuffer->Bind();
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glBlendFunc(GL_ONE, GL_ONE);
+	strokePointOITShader->Begin();
+	brushTextures->Bind();
+	EnableParticleAttributes(&particles[0]);
+	glDrawArrays(GL_POINTS, 0, particles.size());
+	DisableParticleAttributes();
+	strokePointOITShader->End();
+	oitFrameBuffer->Unbind();
+
+	// ------------------------------------------------------------
+
+	//
+	// Resolve pass.
+	// Composite the weighted average color over the frame buffer.
+	//
+
+	glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+	oitResolveShader->Begin();
+	uniforms->oitResolveMvpMatrix.Set(glm::ortho(-1.0f, 1.0f, -1.0f, 1.0f));
+	oitAccumTexture->Bind(GL_TEXTURE0);
+	oitRevealageTexture->Bind(GL_TEXTURE1);
+	quad->Draw();
+	oitResolveShader->End();
+	glActiveTexture(GL_TEXTURE0);
+
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
 }
 
 void Canvas::DrawCurrentStroke()
@@ -507,19 +1188,31 @@ void Canvas::DrawCurrentStroke()
 	glDisable(GL_DEPTH_TEST);
 
 	flatShader->Begin();
-	flatShader->SetUniformMatrix4f("mvpMatrix",
-		glm::ortho(0.0f, (float)canvasWidth, 0.0f, (float)canvasHeight));
-	flatShader->SetUniform4f("color", glm::vec4(0.5f, 0.0f, 0.0f, 1.0f));
-
-	glBegin(GL_LINES);
-	for (int i = 0, j = 1; j < currentStrokePoints.size(); i=j++)
+	uniforms->flatMvpMatrix.Set(glm::ortho(0.0f, (float)canvasWidth, 0.0f, (float)canvasHeight));
+	uniforms->flatColor.Set(glm::vec4(0.5f, 0.0f, 0.0f, 1.0f));
+
+	// Only the points added since the last frame are uploaded.
+	// The draws in flight never read the appended range, so the mapping is not synchronized.
+	// At the start of a stroke the range overlaps the previous stroke still read by the draws in flight,
+	// so the whole buffer is orphaned instead.
+	int pointNum = currentStrokePoints.size();
+	if (currentStrokeLineNum < pointNum)
 	{
-		glm::vec2 v1 = glm::vec2(currentStrokePoints[i].position);
-		glm::vec2 v2 = glm::vec2(currentStrokePoints[j].position);
-		glVertex3f(v1.x, v1.y, 0.0f);
-		glVertex3f(v2.x, v2.y, 0.0f);
+		GLbitfield access = currentStrokeLineNum == 0
+			? GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+			: GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+		currentStrokeLine->Resize(pointNum);
+		glm::vec3* vertices = (glm::vec3*)currentStrokeLine->MapVertices(
+			currentStrokeLineNum, pointNum - currentStrokeLineNum, access);
+		for (int i = currentStrokeLineNum; i < pointNum; i++)
+		{
+			glm::vec2 v = glm::vec2(currentStrokePoints[i].position);
+			vertices[i - currentStrokeLineNum] = glm::vec3(v.x, v.y, 0.0f);
+		}
+		currentStrokeLine->UnmapVertices();
+		currentStrokeLineNum = pointNum;
 	}
-	glEnd();
+	currentStrokeLine->Draw(GL_LINE_STRIP, 0, pointNum);
 
 	flatShader->End();
 
@@ -530,41 +1223,49 @@ void Canvas::OnResizeCanvas( QSize size )
 {
 	canvasWidth = size.width();
 	canvasHeight = size.height();
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleWireframe( int state )
 {
 	enableWireframe = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleAABB( int state )
 {
 	enableAABB = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleGrid( int state )
 {
 	enableGrid = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleParticle( int state )
 {
 	enableParticle = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleStrokeLine( int state )
 {
 	enableStrokeLine = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleCurrentStrokeLine( int state )
 {
 	enableCurrentStrokeLine = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleProxyObjectCheckBox( int state )
 {
 	enableProxyObject = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnToolChanged( int id )
@@ -577,6 +1278,66 @@ void Canvas::OnToolChanged( int id )
 	currentTool = (EmbeddingTool)id;
 }
 
+void Canvas::OnRenderModeChanged( int mode )
+{
+	if (mode < 0 || RENDER_MODE_NUM <= mode)
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Invalid render mode: %d") % mode).str().c_str());
+	}
+	renderMode = (RenderMode)mode;
+	emit RedrawRequested();
+}
+
+void Canvas::OnParticleBackendChanged( int backend )
+{
+	if (backend < 0 || PARTICLE_BACKEND_NUM <= backend)
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Invalid particle backend: %d") % backend).str().c_str());
+	}
+	particleBackend = (ParticleBackend)backend;
+	emit RedrawRequested();
+}
+
+void Canvas::OnBenchmarkParticleBackends()
+{
+	// The benchmark runs in the next frame where the GL context is current
+	benchmarkRequested = true;
+	emit RedrawRequested();
+}
+
+void Canvas::OnToggleProfiler( bool enable )
+{
+	profiler->SetEnabled(enable);
+	if (!enable)
+	{
+		emit ProfileUpdated(QString());
+		emit GpuFrameTimeUpdated(-1.0f);
+	}
+	emit RedrawRequested();
+}
+
+void Canvas::OnExportProfile( QString path )
+{
+	try
+	{
+		profiler->ExportCSV(path.toStdString());
+		Util::Get()->ShowStatusMessage("Exported profile " + path);
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		Util::Get()->ShowStatusMessage("Failed to export profile " + path);
+	}
+}
+
+void Canvas::OnToggleOcclusionCulling( int state )
+{
+	enableOcclusionCulling = state == Qt::Checked;
+	emit RedrawRequested();
+}
+
 void Canvas::OnLevelChanged( double level )
 {
 	currentLevel = (float)level;
@@ -595,6 +1356,7 @@ void Canvas::OnStrokeStepChanged( int step )
 void Canvas::OnStrokeOrderOffsetChanged( double offset )
 {
 	strokeOrderOffset = (float)offset;
+	emit RedrawRequested();
 }
 
 void Canvas::OnResetViewButtonClicked()
@@ -602,28 +1364,38 @@ void Canvas::OnResetViewButtonClicked()
 	scale = 1.0f;
 	trans = glm::vec3();
 	currentQuat = glm::quat();
+	emit RedrawRequested();
 }
 
 void Canvas::OnToggleBackground( int state )
 {
 	enableBackgroundTexture = state == Qt::Checked;
+	emit RedrawRequested();
 }
 
 void Canvas::OnChangeBackgroundImage( QString path )
 {
 	if (!enableBackgroundTexture) return;
-	SAFE_DELETE(backgroundTexture);
-	QImage image;
-	if (!image.load(path))
+
+	// Decode on a worker thread. The previous request still running is superseded,
+	// since the watcher only reports the last future.
+	backgroundImagePath = path;
+	backgroundWatcher->setFuture(QtConcurrent::run(DecodeBackgroundImage, path));
+	Util::Get()->ShowStatusMessage("Loading background image " + path);
+}
+
+void Canvas::OnBackgroundImageDecoded()
+{
+	QImage image = backgroundWatcher->result();
+	if (image.isNull())
 	{
-		Util::Get()->ShowStatusMessage("Failed to load " + path);
+		Util::Get()->ShowStatusMessage("Failed to load " + backgroundImagePath);
 		return;
 	}
-	QImage glimage = QGLWidget::convertToGLFormat(image);
-	backgroundTexture = new Texture2D(
-		glimage.width(), glimage.height(),
-		GL_RGBA8, GL_RGBA, GL_CLAMP, GL_LINEAR, GL_LINEAR, (void*)glimage.bits());
-	Util::Get()->ShowStatusMessage("Loaded background image " + path);
+
+	// The upload is started in the next frame where the GL context is current
+	decodedBackgroundImage = image;
+	emit RedrawRequested();
 }
 
 void Canvas::OnBrushColorChanged( QColor color )
@@ -658,13 +1430,10 @@ void Canvas::DrawProxyObject()
 	{
 		if (enableWireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE); 
 
+		// The display level is chosen with the same pixel scale as the particle levels
+		float pixelScale = projectionMatrix[1][1] * (float)canvasHeight * 0.5f;
 		renderShader->Begin();
-		renderShader->SetUniformMatrix4f("mvpMatrix", mvpMatrix);
-		renderShader->SetUniformMatrix3f("normalMatrix", glm::mat3(glm::transpose(glm::inverse(mvMatrix))));
-		renderShader->SetUniform4f("diffuseColor", glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
-		renderShader->SetUniform4f("emissionColor", glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
-		renderShader->SetUniform4f("lightDir", glm::vec4(0.2f, 0.4f, 0.6f, 0.0f));
-		proxyModel->Draw();
+		proxyModel->Draw(camWorldPos, pixelScale, nearClip);
 		renderShader->End();
 
 		if (enableWireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -674,22 +1443,57 @@ void Canvas::DrawProxyObject()
 	if (enableAABB)
 	{
 		flatShader->Begin();
-		flatShader->SetUniformMatrix4f("mvpMatrix", mvpMatrix);
-		flatShader->SetUniform4f("color", glm::vec4(0.5f, 0.0f, 0.0f, 1.0f));
+		uniforms->flatMvpMatrix.Set(mvpMatrix);
+		uniforms->flatColor.Set(glm::vec4(0.5f, 0.0f, 0.0f, 1.0f));
 		proxyModel->DrawAABB();
 		flatShader->End();
 	}
 }
 
+void Canvas::GetStrokeList( std::vector<Stroke*>& strokeList ) const
+{
+	int strokeNum = strokeStore->GetStrokeNum();
+	strokeList.resize(strokeNum);
+	for (int i = 0; i < strokeNum; i++)
+	{
+		strokeList[i] = new Stroke;
+		strokeStore->GetPoints(i, strokeList[i]->strokePoints);
+		strokeList[i]->brushSpacing = strokeStore->GetAttribute(i).brushSpacing;
+	}
+}
+
+void Canvas::SetStrokeList( const std::vector<Stroke*>& strokeList )
+{
+	strokeStore->Clear();
+	for (int i = 0; i < strokeList.size(); i++)
+	{
+		if (!strokeList[i]->strokePoints.empty())
+		{
+			strokeStore->Add(strokeList[i]->strokePoints, strokeList[i]->brushSpacing);
+		}
+	}
+}
+
+void Canvas::DeleteStrokeList( std::vector<Stroke*>& strokeList )
+{
+	for (int i = 0; i < strokeList.size(); i++)
+	{
+		SAFE_DELETE(strokeList[i]);
+	}
+	strokeList.clear();
+}
+
 void Canvas::OnUndoStroke()
 {
 	if (state == STATE_IDLE)
 	{
-		if (strokeList.size() > 0)
+		if (strokeStore->GetStrokeNum() > 0)
 		{
-			SAFE_DELETE(strokeList.back());
-			strokeList.pop_back();
+			strokeStore->RemoveLast();
+			strokeHierarchy->Invalidate();
 			SetModified(true);
+			emit StrokeUndone();
+			emit RedrawRequested();
 		}
 	}
 }
@@ -708,38 +1512,6 @@ Stroke::Stroke()
 
 }
 
-void Stroke::Draw()
-{
-	if (strokePoints.size() < 2)
-	{
-		return;
-	}
-
-	canvas->flatShader->Begin();
-	canvas->flatShader->SetUniformMatrix4f("mvpMatrix", canvas->mvpMatrix);
-	canvas->flatShader->SetUniform4f("color", glm::vec4(0.5f, 0.5f, 1.0f, 1.0f));
-	
-	glBegin(GL_LINES);
-	for (int i = 0, j = 1; j < strokePoints.size(); i=j++)
-	{
-		glm::vec3& v1 = strokePoints[i].position;
-		glm::vec3& v2 = strokePoints[j].position;
-		glVertex3fv(glm::value_ptr(v1));
-		glVertex3fv(glm::value_ptr(v2));
-	}
-	glEnd();
-
-	glPointSize(2.0);
-	glBegin(GL_POINTS);
-	for (int i = 0; i < strokePoints.size(); i++)
-	{
-		glVertex3fv(glm::value_ptr(strokePoints[i].position));
-	}
-	glEnd();
-
-	canvas->flatShader->End();
-}
-
 bool Stroke::Embed(const std::vector<StrokePoint>& points)
 {
 	// Copy stroke info
@@ -842,7 +1614,7 @@ float Stroke::SphereTrace( const glm::vec3& rayOrigin, const glm::vec3& rayDir,
 	int step = 1;
 	do
 	{
-		minDist = canvas->proxyModel->Distance(currentPos, normal) - level;
+		minDist = canvas->proxyModel->Distance(currentPos, normal, level) - level;
 		currentPos += minDist * rayDir;
 		sumDist += minDist;
 		Util::Get()->ShowStatusMessage((boost::format("Sphere tracing step #%d: %f") % step % sumDist).str().c_str());
@@ -888,7 +1660,7 @@ static lbfgsfloatval_t LBFGS_Evaluate( void *instance, const lbfgsfloatval_t *x,
 		float ti = x[i];
 		glm::vec3& di = stroke->rayDirs[i];
 		glm::vec3& p = strokePoints[i];
-		glm::vec3 q = canvas->proxyModel->ClosestPoint(p, normal);
+		glm::vec3 q = canvas->proxyModel->ClosestPoint(p, normal, level);
 
 		float fpi = glm::distance(p, q);
 		// If the distance is too close, use the normal as a gradient.
@@ -9,6 +9,16 @@ class Camera;
 class Texture2D;
 class Texture2DArray;
 class QuadMesh;
+class FrameBuffer;
+class ParticleSorter;
+class StrokeStore;
+class StrokeHierarchy;
+class OcclusionBuffer;
+class Profiler;
+class UniformBuffer;
+class VertexStream;
+class PixelUploadBuffer;
+struct BoundingSphere;
 
 namespace boost
 {
@@ -69,6 +79,29 @@ private:
 
 };
 
+/*!
+	Packed stroke point.
+	The compact vertex format of the particles uploaded to GL (20 bytes).
+	The color is quantized to RGBA8 and the size is stored as a half float.
+	The GUID is only used for the sorting and is not included.
+*/
+struct PackedStrokePoint
+{
+
+	PackedStrokePoint()
+	{
+
+	}
+
+	explicit PackedStrokePoint(const StrokePoint& p);
+
+	glm::vec3 position;			//!< Stroke point.
+	unsigned char color[4];		//!< Brush color in RGBA8.
+	unsigned short id;			//!< Brush ID.
+	unsigned short size;		//!< Brush size in the world space as a half float.
+
+};
+
 /*!
 	Canvas.
 	The class describes the canvas of the application and manages
@@ -96,6 +129,21 @@ public:
 		TOOL_NUM
 	};
 
+	enum RenderMode
+	{
+		RENDER_SORTED,			//!< Back-to-front sorted alpha blending
+		RENDER_WEIGHTED_OIT,	//!< Weighted blended order-independent transparency
+		RENDER_MODE_NUM
+	};
+
+	enum ParticleBackend
+	{
+		PARTICLE_GEOMETRY_SHADER,	//!< Points expanded to quads in the geometry shader
+		PARTICLE_POINT_SPRITE,		//!< Point sprites sized in the vertex shader
+		PARTICLE_INSTANCED_QUAD,	//!< Instanced quads with per-instance attributes
+		PARTICLE_BACKEND_NUM
+	};
+
 public:
 
 	Canvas();
@@ -129,6 +177,12 @@ public slots:
 	void OnResetViewButtonClicked();
 	void OnToggleBackground(int state);
 	void OnChangeBackgroundImage(QString path);
+	void OnRenderModeChanged(int mode);
+	void OnToggleOcclusionCulling(int state);
+	void OnParticleBackendChanged(int backend);
+	void OnBenchmarkParticleBackends();
+	void OnToggleProfiler(bool enable);
+	void OnExportProfile(QString path);
 
 	void OnToolChanged(int id);
 	void OnLevelChanged(double level);
@@ -142,10 +196,20 @@ public slots:
 	void OnBrushOpacityChanged(int opacity);
 	void OnBrushSpacingChanged(double spacing);
 
+private slots:
+
+	void OnBackgroundImageDecoded();
+
 signals:
 
 	void StateChanged(unsigned int state);
 	void StrokeStateChanged(int strokeNum, int particleNum);
+	void StrokeAdded();
+	void StrokeUndone();
+	void RedrawRequested();
+	void ContinuousRedrawChanged(bool enable);
+	void ProfileUpdated(QString summary);
+	void GpuFrameTimeUpdated(float gpuTime);
 
 private:
 
@@ -153,19 +217,49 @@ private:
 	void DrawGrid(const glm::mat4& mvpMatrix);
 	void LoadBrushTexture();
 	void DrawBackground();
+	void UpdatePendingTextures();
 	void DrawStrokes();
+	void SortParticles();
+	void EnableParticleAttributes(const PackedStrokePoint* data);
+	void DisableParticleAttributes();
+	void DrawParticlesSorted();
+	void GatherSortedParticles(const std::vector<unsigned int>& indexList);
+	void DrawSortedParticles(ParticleBackend backend, const std::vector<unsigned int>& indexList);
+	void BenchmarkParticleBackends(const std::vector<unsigned int>& indexList);
+	void DrawParticlesWeightedOIT();
+	void DrawStrokeLines();
 	void DrawCurrentStroke();
 	void DrawProxyObject();
 
 private:
 
+	// The strokes are serialized in the form of the list of the Stroke objects
+	// in order to keep the compatibility of the saved files.
+	void GetStrokeList(std::vector<Stroke*>& strokeList) const;
+	void SetStrokeList(const std::vector<Stroke*>& strokeList);
+	static void DeleteStrokeList(std::vector<Stroke*>& strokeList);
+
 	friend class boost::serialization::access;
 	template <class Archive>
-	void serialize(Archive& ar, const unsigned int version)
+	void save(Archive& ar, const unsigned int version) const
 	{
+		std::vector<Stroke*> strokeList;
+		GetStrokeList(strokeList);
 		ar & proxyGeometryPath & canvasWidth & canvasHeight & strokeList;
+		DeleteStrokeList(strokeList);
 	}
 
+	template <class Archive>
+	void load(Archive& ar, const unsigned int version)
+	{
+		std::vector<Stroke*> strokeList;
+		ar & proxyGeometryPath & canvasWidth & canvasHeight & strokeList;
+		SetStrokeList(strokeList);
+		DeleteStrokeList(strokeList);
+	}
+
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
+
 public:
 
 	// Canvas info
@@ -179,7 +273,26 @@ public:
 
 	// Strokes
 	std::vector<StrokePoint> currentStrokePoints;
-	std::vector<Stroke*> strokeList;
+	StrokeStore* strokeStore;
+
+	// Particles generated from the strokes
+	std::vector<PackedStrokePoint> particles;
+	std::vector<float> particlePositionX;
+	std::vector<float> particlePositionY;
+	std::vector<float> particlePositionZ;
+	std::vector<float> particleGuids;
+	std::vector<unsigned int> particleIds;
+	unsigned int particleIdNum;
+	std::vector<float> particleDepths;
+	ParticleSorter* particleSorter;
+
+	// Culling
+	StrokeHierarchy* strokeHierarchy;
+	OcclusionBuffer* occlusionBuffer;
+	std::vector<unsigned char> strokeCullResults;
+	std::vector<int> strokeParticleNums;
+	std::vector<int> strokeParticleLevels;
+	bool enableOcclusionCulling;
 
 	// ------------------------------------------------------------
 
@@ -189,6 +302,15 @@ public:
 	GlslShader* flatShader;
 	GlslShader* flatTexShader;
 	GlslShader* strokePointShader;
+	GlslShader* strokePointOITShader;
+	GlslShader* strokePointSpriteShader;
+	GlslShader* strokePointInstancedShader;
+	GlslShader* oitResolveShader;
+
+	// Uniform handles resolved after linking and the camera uniform block
+	struct Uniforms;
+	Uniforms* uniforms;
+	UniformBuffer* cameraBuffer;
 
 	// ------------------------------------------------------------
 
@@ -210,13 +332,45 @@ public:
 	bool enableCurrentStrokeLine;
 	bool enableProxyObject;
 
-	// Background
+	// Line rendering
+	VertexStream* gridLines;
+	VertexStream* strokeLines;
+	std::vector<int> strokeLineFirsts;
+	std::vector<int> strokeLineCounts;
+	int strokeLineRevision;
+	VertexStream* currentStrokeLine;
+	int currentStrokeLineNum;
+
+	// Background.
+	// The image is decoded on a worker thread and uploaded through the pixel buffer,
+	// and the current texture is kept until the pending one is resident.
 	QuadMesh* quad;
 	bool enableBackgroundTexture;
 	Texture2D* backgroundTexture;
+	QFutureWatcher<QImage>* backgroundWatcher;
+	QString backgroundImagePath;
+	QImage decodedBackgroundImage;
+	Texture2D* pendingBackgroundTexture;
+	PixelUploadBuffer* backgroundUploadBuffer;
+
+	// Weighted blended OIT
+	RenderMode renderMode;
+	FrameBuffer* oitFrameBuffer;
+	Texture2D* oitAccumTexture;
+	Texture2D* oitRevealageTexture;
+	int oitWidth, oitHeight;
+
+	// Particle expansion
+	ParticleBackend particleBackend;
+	std::vector<PackedStrokePoint> sortedParticles;
+	bool benchmarkRequested;
+
+	// Per-stage CPU and GPU time
+	Profiler* profiler;
 
 	// Brush state
 	Texture2DArray* brushTextures;
+	PixelUploadBuffer* brushUploadBuffer;
 	glm::vec3 brushColor;
 	int brushID;
 	float brushSize;
@@ -252,7 +406,8 @@ public:
 
 /*!
 	Stroke.
-	The class describes single stroke.
+	The class embeds single stroke onto the proxy object.
+	The embedded stroke points are added to the stroke store of the canvas.
 */
 class Stroke
 {
@@ -260,7 +415,6 @@ public:
 	
 	Stroke();
 	Stroke(Canvas* canvas, float brushSpacing);
-	void Draw();
 	bool Embed(const std::vector<StrokePoint>& points);
 
 protected:
@@ -0,0 +1,372 @@
+#include "culling.h"
+#include "canvas.h"
+#include "strokestore.h"
+
+Frustum::Frustum( const glm::mat4& mvpMatrix )
+{
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+	{
+		rows[i] = glm::vec4(mvpMatrix[0][i], mvpMatrix[1][i], mvpMatrix[2][i], mvpMatrix[3][i]);
+	}
+
+	// Left, right, bottom, top, near, far
+	planes[0] = rows[3] + rows[0];
+	planes[1] = rows[3] - rows[0];
+	planes[2] = rows[3] + rows[1];
+	planes[3] = rows[3] - rows[1];
+	planes[4] = rows[3] + rows[2];
+	planes[5] = rows[3] - rows[2];
+
+	for (int i = 0; i < 6; i++)
+	{
+		planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+}
+
+Frustum::TestResult Frustum::Test( const glm::vec3& center, float radius ) const
+{
+	TestResult result = INSIDE;
+	for (int i = 0; i < 6; i++)
+	{
+		float d = glm::dot(glm::vec3(planes[i]), center) + planes[i].w;
+		if (d < -radius)
+		{
+			return OUTSIDE;
+		}
+		if (d < radius)
+		{
+			result = INTERSECT;
+		}
+	}
+	return result;
+}
+
+bool Frustum::Intersects( const glm::vec3& center, float radius ) const
+{
+	for (int i = 0; i < 6; i++)
+	{
+		if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// ------------------------------------------------------------
+
+StrokeHierarchy::StrokeHierarchy()
+	: strokeNum(0)
+	, valid(false)
+{
+
+}
+
+void StrokeHierarchy::Invalidate()
+{
+	valid = false;
+}
+
+void StrokeHierarchy::Update( const StrokeStore& strokes )
+{
+	// Number of the strokes in a cluster
+	const int clusterSize = 16;
+
+	if (valid && strokeNum == strokes.GetStrokeNum())
+	{
+		return;
+	}
+
+	valid = true;
+	strokeNum = strokes.GetStrokeNum();
+	clusters.clear();
+
+	for (int begin = 0; begin < strokeNum; begin += clusterSize)
+	{
+		Cluster cluster;
+		cluster.begin = begin;
+		cluster.end = std::min(begin + clusterSize, strokeNum);
+
+		// Center of the bounding box of the child spheres
+		glm::vec3 minPos(FLT_MAX), maxPos(-FLT_MAX);
+		for (int i = cluster.begin; i < cluster.end; i++)
+		{
+			BoundingSphere sphere = strokes.GetBoundingSphere(i);
+			minPos = glm::min(minPos, sphere.center - glm::vec3(sphere.radius));
+			maxPos = glm::max(maxPos, sphere.center + glm::vec3(sphere.radius));
+		}
+		cluster.sphere.center = (minPos + maxPos) * 0.5f;
+
+		// The sphere encloses all of the child spheres
+		for (int i = cluster.begin; i < cluster.end; i++)
+		{
+			BoundingSphere sphere = strokes.GetBoundingSphere(i);
+			cluster.sphere.radius = glm::max(cluster.sphere.radius,
+				glm::distance(cluster.sphere.center, sphere.center) + sphere.radius);
+		}
+
+		clusters.push_back(cluster);
+	}
+}
+
+void StrokeHierarchy::Cull( const StrokeStore& strokes, const Frustum& frustum, std::vector<unsigned char>& results )
+{
+	results.resize(strokeNum);
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		Cluster& cluster = clusters[i];
+		Frustum::TestResult clusterResult = frustum.Test(cluster.sphere.center, cluster.sphere.radius);
+		for (int j = cluster.begin; j < cluster.end; j++)
+		{
+			if (clusterResult == Frustum::INTERSECT)
+			{
+				BoundingSphere sphere = strokes.GetBoundingSphere(j);
+				results[j] = (unsigned char)frustum.Test(sphere.center, sphere.radius);
+			}
+			else
+			{
+				results[j] = (unsigned char)clusterResult;
+			}
+		}
+	}
+}
+
+// ------------------------------------------------------------
+
+OcclusionBuffer::OcclusionBuffer()
+	: width(0)
+	, height(0)
+	, pixelScaleX(0.0f)
+	, pixelScaleY(0.0f)
+	, occluderError(0.0f)
+{
+
+}
+
+void OcclusionBuffer::Resize( int width, int height )
+{
+	this->width = std::max(1, width);
+	this->height = std::max(1, height);
+	depths.resize(this->width * this->height);
+}
+
+void OcclusionBuffer::Render( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, float error, const glm::mat4& mvpMatrix )
+{
+	this->mvpMatrix = mvpMatrix;
+	occluderError = error;
+
+	// Pixels per the world space length at the unit depth.
+	// The view is rigid, so the rows of the matrix have the lengths of the projection scales.
+	pixelScaleX = glm::length(glm::vec3(mvpMatrix[0][0], mvpMatrix[1][0], mvpMatrix[2][0])) * 0.5f * width;
+	pixelScaleY = glm::length(glm::vec3(mvpMatrix[0][1], mvpMatrix[1][1], mvpMatrix[2][1])) * 0.5f * height;
+
+	// Transform the vertices to the screen space.
+	// The z component holds 1/w which is linear in the screen space.
+	// The vertices behind the near plane are marked with the negative value.
+	int vertexNum = vertices.size();
+	screenVertices.resize(vertexNum);
+
+#pragma omp parallel for
+	for (int i = 0; i < vertexNum; i++)
+	{
+		glm::vec4 clip = mvpMatrix * glm::vec4(vertices[i], 1.0f);
+		if (clip.w < 1e-4f || clip.z < -clip.w)
+		{
+			screenVertices[i] = glm::vec3(0.0f, 0.0f, -1.0f);
+		}
+		else
+		{
+			float invW = 1.0f / clip.w;
+			screenVertices[i] = glm::vec3(
+				(clip.x * invW * 0.5f + 0.5f) * width,
+				(clip.y * invW * 0.5f + 0.5f) * height,
+				invW);
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	// Bin the triangles to the horizontal bands of the buffer,
+	// so each band visits only the triangles overlapping it.
+	const int bandHeight = 8;
+	int bandNum = (height + bandHeight - 1) / bandHeight;
+	int faceNum = faces.size();
+	faceBands.resize(faceNum);
+
+#pragma omp parallel for
+	for (int i = 0; i < faceNum; i++)
+	{
+		const glm::vec3& v0 = screenVertices[faces[i].x];
+		const glm::vec3& v1 = screenVertices[faces[i].y];
+		const glm::vec3& v2 = screenVertices[faces[i].z];
+
+		// The triangles clipped by the near plane are not used as the occluders
+		faceBands[i] = glm::ivec2(0, -1);
+		if (v0.z < 0.0f || v1.z < 0.0f || v2.z < 0.0f)
+		{
+			continue;
+		}
+
+		float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+		if (glm::abs(area) < 1e-8f)
+		{
+			continue;
+		}
+
+		// Rows of the pixel centers covered by the triangle
+		int minX = std::max(0, (int)ceilf(std::min(v0.x, std::min(v1.x, v2.x)) - 0.5f));
+		int maxX = std::min(width - 1, (int)floorf(std::max(v0.x, std::max(v1.x, v2.x)) - 0.5f));
+		int minY = std::max(0, (int)ceilf(std::min(v0.y, std::min(v1.y, v2.y)) - 0.5f));
+		int maxY = std::min(height - 1, (int)floorf(std::max(v0.y, std::max(v1.y, v2.y)) - 0.5f));
+		if (minX <= maxX && minY <= maxY)
+		{
+			faceBands[i] = glm::ivec2(minY / bandHeight, maxY / bandHeight);
+		}
+	}
+
+	bandOffsets.assign(bandNum + 1, 0);
+	for (int i = 0; i < faceNum; i++)
+	{
+		for (int band = faceBands[i].x; band <= faceBands[i].y; band++)
+		{
+			bandOffsets[band + 1]++;
+		}
+	}
+	for (int band = 0; band < bandNum; band++)
+	{
+		bandOffsets[band + 1] += bandOffsets[band];
+	}
+
+	bandFaces.resize(bandOffsets[bandNum]);
+	for (int i = 0; i < faceNum; i++)
+	{
+		for (int band = faceBands[i].x; band <= faceBands[i].y; band++)
+		{
+			bandFaces[bandOffsets[band]++] = i;
+		}
+	}
+
+	// The offsets are shifted to the ends of the bands by the fill
+	for (int band = bandNum; band > 0; band--)
+	{
+		bandOffsets[band] = bandOffsets[band - 1];
+	}
+	bandOffsets[0] = 0;
+
+	// ------------------------------------------------------------
+
+	// Rasterize the bands in parallel.
+	// Each pixel keeps the largest 1/w, i.e. the nearest eye space depth.
+	std::fill(depths.begin(), depths.end(), 0.0f);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bandNum; band++)
+	{
+		int bandMinY = band * bandHeight;
+		int bandMaxY = std::min(bandMinY + bandHeight, height) - 1;
+
+		for (int j = bandOffsets[band]; j < bandOffsets[band + 1]; j++)
+		{
+			int i = bandFaces[j];
+			const glm::vec3& v0 = screenVertices[faces[i].x];
+			const glm::vec3& v1 = screenVertices[faces[i].y];
+			const glm::vec3& v2 = screenVertices[faces[i].z];
+			float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+
+			// Bounding box of the pixel centers covered by the triangle in the band
+			int minX = std::max(0, (int)ceilf(std::min(v0.x, std::min(v1.x, v2.x)) - 0.5f));
+			int maxX = std::min(width - 1, (int)floorf(std::max(v0.x, std::max(v1.x, v2.x)) - 0.5f));
+			int minY = std::max(bandMinY, (int)ceilf(std::min(v0.y, std::min(v1.y, v2.y)) - 0.5f));
+			int maxY = std::min(bandMaxY, (int)floorf(std::max(v0.y, std::max(v1.y, v2.y)) - 0.5f));
+
+			float invArea = 1.0f / area;
+			for (int y = minY; y <= maxY; y++)
+			{
+				float py = (float)y + 0.5f;
+				for (int x = minX; x <= maxX; x++)
+				{
+					float px = (float)x + 0.5f;
+
+					// Barycentric coordinates, valid for the both windings
+					float b0 = ((v1.x - px) * (v2.y - py) - (v2.x - px) * (v1.y - py)) * invArea;
+					float b1 = ((v2.x - px) * (v0.y - py) - (v0.x - px) * (v2.y - py)) * invArea;
+					float b2 = 1.0f - b0 - b1;
+					if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f)
+					{
+						continue;
+					}
+
+					float invW = b0 * v0.z + b1 * v1.z + b2 * v2.z;
+					float& dest = depths[y * width + x];
+					dest = std::max(dest, invW);
+				}
+			}
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	// Convert to the eye space depth.
+	// The pixels not covered by the proxy object have the infinite depth.
+	int pixelNum = width * height;
+
+#pragma omp parallel for
+	for (int i = 0; i < pixelNum; i++)
+	{
+		depths[i] = depths[i] > 0.0f ? 1.0f / depths[i] : FLT_MAX;
+	}
+}
+
+bool OcclusionBuffer::IsOccluded( const glm::vec3& p, float radius ) const
+{
+	// Relative depth tolerance for the particles lying on the proxy surface
+	const float depthBias = 0.01f;
+
+	// Larger footprints are not tested, since they are rarely occluded entirely
+	const int maxFootprintSize = 16;
+
+	// For the perspective projection w is the eye space depth.
+	// The occluder surface may be nearer than the proxy object by its error.
+	glm::vec4 clip = mvpMatrix * glm::vec4(p, 1.0f);
+	float nearestDepth = clip.w - radius - occluderError;
+	if (nearestDepth <= 0.0f)
+	{
+		return false;
+	}
+
+	// Bounding rectangle of the projected sphere, measured at its nearest depth.
+	// The rectangle is extended by a pixel, since the occluder is sampled at the pixel centers.
+	float invW = 1.0f / clip.w;
+	float cx = (clip.x * invW * 0.5f + 0.5f) * width;
+	float cy = (clip.y * invW * 0.5f + 0.5f) * height;
+	float rx = (radius + occluderError) * pixelScaleX / nearestDepth + 1.0f;
+	float ry = (radius + occluderError) * pixelScaleY / nearestDepth + 1.0f;
+	if (rx * 2.0f > maxFootprintSize || ry * 2.0f > maxFootprintSize)
+	{
+		return false;
+	}
+
+	int minX = std::max(0, (int)floorf(cx - rx));
+	int maxX = std::min(width - 1, (int)floorf(cx + rx));
+	int minY = std::max(0, (int)floorf(cy - ry));
+	int maxY = std::min(height - 1, (int)floorf(cy + ry));
+	if (minX > maxX || minY > maxY)
+	{
+		return false;
+	}
+
+	// The particle is occluded only if it is behind the farthest occluder over the footprint
+	float threshold = nearestDepth / (1.0f + depthBias);
+	for (int y = minY; y <= maxY; y++)
+	{
+		for (int x = minX; x <= maxX; x++)
+		{
+			if (depths[y * width + x] >= threshold)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
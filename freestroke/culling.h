@@ -0,0 +1,133 @@
+#ifndef __CULLING_H__
+#define __CULLING_H__
+
+class StrokeStore;
+
+/*!
+	Bounding sphere.
+*/
+struct BoundingSphere
+{
+
+	BoundingSphere()
+		: center(0.0f)
+		, radius(0.0f)
+	{
+
+	}
+
+	BoundingSphere(const glm::vec3& center, float radius)
+		: center(center)
+		, radius(radius)
+	{
+
+	}
+
+	glm::vec3 center;
+	float radius;
+
+};
+
+/*!
+	View frustum.
+	The class extracts the six clip planes from the model-view-projection matrix
+	and tests the spheres against them.
+*/
+class Frustum
+{
+public:
+
+	enum TestResult
+	{
+		OUTSIDE,
+		INTERSECT,
+		INSIDE
+	};
+
+public:
+
+	Frustum(const glm::mat4& mvpMatrix);
+	TestResult Test(const glm::vec3& center, float radius) const;
+	bool Intersects(const glm::vec3& center, float radius) const;
+
+private:
+
+	// Planes (a, b, c, d) with the inward normals (a, b, c) of unit length
+	glm::vec4 planes[6];
+
+};
+
+/*!
+	Stroke hierarchy.
+	Two level bounding sphere hierarchy over the strokes.
+	The consecutive strokes are grouped into the clusters, because the strokes drawn
+	one after another are usually close to each other. The strokes in the clusters
+	which are completely inside or outside of the frustum are not tested individually.
+*/
+class StrokeHierarchy
+{
+public:
+
+	StrokeHierarchy();
+	void Invalidate();
+	void Update(const StrokeStore& strokes);
+	void Cull(const StrokeStore& strokes, const Frustum& frustum, std::vector<unsigned char>& results);
+
+private:
+
+	struct Cluster
+	{
+		BoundingSphere sphere;
+		int begin;
+		int end;
+	};
+
+private:
+
+	std::vector<Cluster> clusters;
+	int strokeNum;
+	bool valid;
+
+};
+
+/*!
+	Occlusion buffer.
+	The low resolution depth buffer of the proxy object rasterized on CPU.
+	A particle is occluded if it is behind the largest eye space depth
+	over its projected footprint, extended by a pixel for the low resolution.
+	The occluder is a simplified mesh, so its error is added to the tested sphere.
+	The error bounds the distance between the surfaces, but not the openings of the proxy object
+	narrower than the error, which the simplification may close.
+	The particles seen through such openings may be culled, so the culling is approximate
+	and disabled by default.
+	The triangles are binned to the horizontal bands once,
+	and the bands are rasterized in parallel.
+*/
+class OcclusionBuffer
+{
+public:
+
+	OcclusionBuffer();
+	void Resize(int width, int height);
+	void Render(const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, float error, const glm::mat4& mvpMatrix);
+	bool IsOccluded(const glm::vec3& p, float radius) const;
+
+private:
+
+	int width;
+	int height;
+	glm::mat4 mvpMatrix;
+	float pixelScaleX;
+	float pixelScaleY;
+	float occluderError;
+	std::vector<float> depths;
+	std::vector<glm::vec3> screenVertices;
+
+	// Triangles of each band in the compressed form
+	std::vector<glm::ivec2> faceBands;
+	std::vector<int> bandOffsets;
+	std::vector<int> bandFaces;
+
+};
+
+#endif // __CULLING_H__
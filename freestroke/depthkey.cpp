@@ -0,0 +1,112 @@
+#include "depthkey.h"
+#include <xmmintrin.h>
+
+namespace
+{
+
+	// Computes 4 keys at once.
+	// sqrt(d2) is approximated by d2 * rsqrt(d2) refined with one Newton-Raphson iteration.
+	inline __m128 ComputeKey4(
+		__m128 x, __m128 y, __m128 z, __m128 guid,
+		__m128 cx, __m128 cy, __m128 cz, __m128 offset)
+	{
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 three = _mm_set1_ps(3.0f);
+		const __m128 minDist2 = _mm_set1_ps(FLT_MIN);
+
+		__m128 dx = _mm_sub_ps(x, cx);
+		__m128 dy = _mm_sub_ps(y, cy);
+		__m128 dz = _mm_sub_ps(z, cz);
+		__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		d2 = _mm_max_ps(d2, minDist2);
+
+		__m128 r = _mm_rsqrt_ps(d2);
+		r = _mm_mul_ps(_mm_mul_ps(half, r), _mm_sub_ps(three, _mm_mul_ps(_mm_mul_ps(d2, r), r)));
+		__m128 dist = _mm_mul_ps(d2, r);
+
+		__m128 t = _mm_sub_ps(dist, _mm_mul_ps(offset, guid));
+		return _mm_mul_ps(t, t);
+	}
+
+}
+
+void DepthKeyKernel::Compute(
+	const float* x, const float* y, const float* z, const float* guid, int n,
+	const glm::vec3& camPos, float strokeOrderOffset, float* keys )
+{
+	const __m128 cx = _mm_set1_ps(camPos.x);
+	const __m128 cy = _mm_set1_ps(camPos.y);
+	const __m128 cz = _mm_set1_ps(camPos.z);
+	const __m128 offset = _mm_set1_ps(strokeOrderOffset);
+
+	// 8 keys per iteration
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128 k0 = ComputeKey4(
+			_mm_loadu_ps(x + i), _mm_loadu_ps(y + i), _mm_loadu_ps(z + i), _mm_loadu_ps(guid + i),
+			cx, cy, cz, offset);
+		__m128 k1 = ComputeKey4(
+			_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4), _mm_loadu_ps(z + i + 4), _mm_loadu_ps(guid + i + 4),
+			cx, cy, cz, offset);
+		_mm_storeu_ps(keys + i, k0);
+		_mm_storeu_ps(keys + i + 4, k1);
+	}
+
+	// Remaining particles are padded to 8 so that
+	// all keys are computed with the same precision.
+	int remaining = n - i;
+	if (remaining > 0)
+	{
+		float px[8] = {0}, py[8] = {0}, pz[8] = {0}, pguid[8] = {0}, pkeys[8];
+		for (int j = 0; j < remaining; j++)
+		{
+			px[j] = x[i + j];
+			py[j] = y[i + j];
+			pz[j] = z[i + j];
+			pguid[j] = guid[i + j];
+		}
+
+		_mm_storeu_ps(pkeys, ComputeKey4(
+			_mm_loadu_ps(px), _mm_loadu_ps(py), _mm_loadu_ps(pz), _mm_loadu_ps(pguid),
+			cx, cy, cz, offset));
+		_mm_storeu_ps(pkeys + 4, ComputeKey4(
+			_mm_loadu_ps(px + 4), _mm_loadu_ps(py + 4), _mm_loadu_ps(pz + 4), _mm_loadu_ps(pguid + 4),
+			cx, cy, cz, offset));
+
+		for (int j = 0; j < remaining; j++)
+		{
+			keys[i + j] = pkeys[j];
+		}
+	}
+}
+
+void DepthKeyKernel::ComputeScalar(
+	const float* x, const float* y, const float* z, const float* guid, int n,
+	const glm::vec3& camPos, float strokeOrderOffset, float* keys )
+{
+	for (int i = 0; i < n; i++)
+	{
+		glm::vec3 pi(x[i], y[i], z[i]);
+		glm::vec3 di = glm::normalize(pi - camPos);
+		keys[i] = glm::distance2(pi - strokeOrderOffset * guid[i] * di, camPos);
+	}
+}
+
+float DepthKeyKernel::MaxRelativeError(
+	const float* x, const float* y, const float* z, const float* guid, int n,
+	const glm::vec3& camPos, float strokeOrderOffset, const float* keys )
+{
+	// The error is measured relative to the larger of the key and the squared distance from the camera,
+	// because the key itself can be close to zero for the offset particles.
+	float maxError = 0.0f;
+	for (int i = 0; i < n; i++)
+	{
+		float key;
+		ComputeScalar(x + i, y + i, z + i, guid + i, 1, camPos, strokeOrderOffset, &key);
+		glm::vec3 pi(x[i], y[i], z[i]);
+		float scale = glm::max(glm::max(glm::distance2(pi, camPos), key), 1e-6f);
+		maxError = glm::max(maxError, glm::abs(keys[i] - key) / scale);
+	}
+	return maxError;
+}
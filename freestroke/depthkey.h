@@ -0,0 +1,34 @@
+#ifndef __DEPTH_KEY_H__
+#define __DEPTH_KEY_H__
+
+/*!
+	Depth key kernel.
+	Computes the sort keys of the particles from the particle positions and GUIDs
+	stored in the structure-of-arrays form.
+	The key is the squared distance from the camera position to the particle
+	which is moved toward the camera by strokeOrderOffset * guid.
+	Since the offset is along the view direction, the key can be written as
+	(|p - c| - strokeOrderOffset * guid)^2 and computed with the fast reciprocal square root.
+*/
+class DepthKeyKernel
+{
+private:
+
+	DepthKeyKernel() {}
+	DISALLOW_COPY_AND_ASSIGN(DepthKeyKernel);
+
+public:
+
+	static void Compute(
+		const float* x, const float* y, const float* z, const float* guid, int n,
+		const glm::vec3& camPos, float strokeOrderOffset, float* keys);
+	static void ComputeScalar(
+		const float* x, const float* y, const float* z, const float* guid, int n,
+		const glm::vec3& camPos, float strokeOrderOffset, float* keys);
+	static float MaxRelativeError(
+		const float* x, const float* y, const float* z, const float* guid, int n,
+		const glm::vec3& camPos, float strokeOrderOffset, const float* keys);
+
+};
+
+#endif // __DEPTH_KEY_H__
\ No newline at end of file
@@ -1,8 +1,79 @@
 #include "gllib.h"
 #include <FreeImage.h>
 
+namespace
+{
+
+	// Debug output state.
+	// The asynchronous output may call the callback from a driver thread,
+	// so the pending message is guarded by the mutex.
+	bool debugOutputEnabled = false;
+	QMutex debugMessageMutex;
+	std::string pendingDebugMessage;
+
+	void APIENTRY DebugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
+		GLsizei length, const GLchar* message, GLvoid* userParam)
+	{
+		// Exceptions must not be thrown across the driver,
+		// so the first message is kept until the next check.
+		QMutexLocker locker(&debugMessageMutex);
+		if (pendingDebugMessage.empty())
+		{
+			pendingDebugMessage = message;
+		}
+	}
+
+}
+
+bool EnableGLDebugOutput( bool synchronous )
+{
+#ifdef _DEBUG
+	// The context is not requested as a debug context, since QGLFormat has no such option.
+	// The drivers supporting the extension report the errors in the ordinary context as well.
+	if (!GLEW_ARB_debug_output)
+	{
+		return false;
+	}
+
+	// The asynchronous output does not stall the driver, but the error is reported at a later check.
+	// The synchronous output calls the callback inside the erroneous call,
+	// so the error is attributed to the nearest check after the call.
+	if (synchronous)
+	{
+		glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
+	}
+	glDebugMessageCallbackARB(DebugOutputCallback, NULL);
+
+	// Only the errors and the undefined behaviors are reported
+	glDebugMessageControlARB(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE);
+	glDebugMessageControlARB(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR_ARB, GL_DONT_CARE, 0, NULL, GL_TRUE);
+	glDebugMessageControlARB(GL_DONT_CARE, GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR_ARB, GL_DONT_CARE, 0, NULL, GL_TRUE);
+
+	debugOutputEnabled = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
 void CheckGLErrors( const char* filename, const char* funcname, const int line )
 {
+	// While the callback is active, only the pending message is checked.
+	// glGetError is not called, since it synchronizes the driver on every check.
+	if (debugOutputEnabled)
+	{
+		std::string message;
+		{
+			QMutexLocker locker(&debugMessageMutex);
+			message.swap(pendingDebugMessage);
+		}
+		if (!message.empty())
+		{
+			throw Exception(Exception::OpenGLError, message, filename, funcname, line, GetStackTrace());
+		}
+		return;
+	}
+
 	int err;
 	if ((err = glGetError()) != GL_NO_ERROR)
 	{
@@ -29,183 +100,391 @@ void CheckGLErrors( const char* filename, const char* funcname, const int line )
 	}
 }
 
+unsigned short FloatToHalf( float f )
+{
+	unsigned int x;
+	memcpy(&x, &f, sizeof(float));
+
+	unsigned int sign = (x >> 16) & 0x8000;
+	int floatExponent = (x >> 23) & 0xff;
+	int exponent = floatExponent - 127 + 15;
+	unsigned int mantissa = x & 0x7fffff;
+
+	// Infinity and NaN
+	if (floatExponent == 0xff)
+	{
+		return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	}
+
+	// Overflow to infinity
+	if (exponent >= 31)
+	{
+		return (unsigned short)(sign | 0x7c00);
+	}
+
+	// Denormalized half or zero
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+		{
+			return (unsigned short)sign;
+		}
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1) half++;
+		return (unsigned short)(sign | half);
+	}
+
+	// Carry of the rounding propagates to the exponent correctly
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) half++;
+	return (unsigned short)half;
+}
+
+AABB::AABB()
+	: stream(NULL)
+{
+
+}
+
+AABB::~AABB()
+{
+	SAFE_DELETE(stream);
+}
+
 void AABB::Draw()
 {
-	glBegin(GL_LINES);
-
-	glVertex3f(min.x, min.y, min.z);
-	glVertex3f(max.x, min.y, min.z);
-	glVertex3f(max.x, min.y, min.z);
-	glVertex3f(max.x, max.y, min.z);
-	glVertex3f(max.x, max.y, min.z);
-	glVertex3f(min.x, max.y, min.z);
-	glVertex3f(min.x, max.y, min.z);
-	glVertex3f(min.x, min.y, min.z);
-
-	glVertex3f(min.x, min.y, max.z);
-	glVertex3f(max.x, min.y, max.z);
-	glVertex3f(max.x, min.y, max.z);
-	glVertex3f(max.x, max.y, max.z);
-	glVertex3f(max.x, max.y, max.z);
-	glVertex3f(min.x, max.y, max.z);
-	glVertex3f(min.x, max.y, max.z);
-	glVertex3f(min.x, min.y, max.z);
-
-	glVertex3f(min.x, min.y, min.z);
-	glVertex3f(min.x, min.y, max.z);
-	glVertex3f(max.x, min.y, min.z);
-	glVertex3f(max.x, min.y, max.z);
-	glVertex3f(max.x, max.y, min.z);
-	glVertex3f(max.x, max.y, max.z);
-	glVertex3f(min.x, max.y, min.z);
-	glVertex3f(min.x, max.y, max.z);
-
-	glEnd();
+	if (!stream || streamMin != min || streamMax != max)
+	{
+		SAFE_DELETE(stream);
+		stream = new VertexStream;
+		stream->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
+
+		// Corners indexed by the bits (x, y, z)
+		stream->Begin();
+		for (int i = 0; i < 8; i++)
+		{
+			stream->AddVertex(VertexStream::POSITION, glm::vec3(
+				(i & 1) ? max.x : min.x,
+				(i & 2) ? max.y : min.y,
+				(i & 4) ? max.z : min.z));
+		}
+
+		// Edges along x, y and z
+		for (int i = 0; i < 8; i++)
+		{
+			if (!(i & 1)) stream->AddIndex(i, i | 1);
+			if (!(i & 2)) stream->AddIndex(i, i | 2);
+			if (!(i & 4)) stream->AddIndex(i, i | 4);
+		}
+		stream->End();
+
+		streamMin = min;
+		streamMax = max;
+	}
+
+	stream->Draw(GL_LINES);
 }
 
 VertexStream::VertexStream()
+	: stride(0)
+	, usage(GL_STATIC_DRAW)
+	, vertexNum(0)
+	, vertexCapacity(0)
+	, indexNum(0)
 {
 	glGenVertexArrays(1, &vaoID);
+	glGenBuffers(1, &vboID);
 	glGenBuffers(1, &indexBufferID);
 	CHECK_GL_ERRORS();
 }
 
 VertexStream::~VertexStream()
 {
-	BOOST_FOREACH (IndexVBOArrayIDMap::value_type& pair, vboArrayIDMap)
-	{
-		glDeleteBuffers(1, &pair.second);
-	}
+	glDeleteBuffers(1, &vboID);
 	glDeleteBuffers(1, &indexBufferID);
 	glDeleteVertexArrays(1, &vaoID);
 }
 
 void VertexStream::AddAttribute( GLuint index, GLint size )
 {
-	if (vboArrayIDMap.find(index) != vboArrayIDMap.end())
+	for (int i = 0; i < attributes.size(); i++)
 	{
-		// Given index is already registered, raise error.
-		THROW_EXCEPTION(Exception::OpenGLError,
-			(boost::format("Vertex attribute %d is already registered.") % index).str());
+		if (attributes[i].index == index)
+		{
+			// Given index is already registered, raise error.
+			THROW_EXCEPTION(Exception::OpenGLError,
+				(boost::format("Vertex attribute %d is already registered.") % index).str());
+		}
 	}
 
-	// Create VBO
-	GLuint vboID;
-	glGenBuffers(1, &vboID);
-	vboArrayIDMap[index] = vboID;
+	if (size <= 0 || size % sizeof(float) != 0)
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Invalid size of vertex attribute %d: %d bytes") % index % size).str());
+	}
 
-	// Vertex attribute size
-	vertexSizeMap[index] = size;
+	// The attribute is appended to the end of the interleaved vertex
+	Attribute attr;
+	attr.index = index;
+	attr.components = size / sizeof(float);
+	attr.offset = stride;
+	attr.count = 0;
+	attributes.push_back(attr);
+	stride += attr.components;
+}
+
+void VertexStream::Reserve( int vertexNum, int indexNum )
+{
+	// The attributes must be added before the reservation
+	vertexList.reserve(vertexNum * stride);
+	indexList.reserve(indexNum);
 }
 
 void VertexStream::Begin()
 {
-	vertexListMap.clear();
+	// The capacities are kept so the reserved storage is reused
+	vertexList.clear();
 	indexList.clear();
+	for (int i = 0; i < attributes.size(); i++)
+	{
+		attributes[i].count = 0;
+	}
 }
 
-void VertexStream::End()
+void VertexStream::End( GLenum usage, bool releaseClientData )
 {
 	// Check validity.
-	// For each attribute index, there must be same index in the vertex list map
-	// and each list must be same length.
-	int vertexnum = -1;
-	BOOST_FOREACH (IndexVBOArrayIDMap::value_type& pair, vboArrayIDMap)
+	// Each attribute must have the same number of the vertices.
+	int vertexnum = attributes.empty() ? 0 : attributes[0].count;
+	for (int i = 1; i < attributes.size(); i++)
 	{
-		if (vertexListMap.find(pair.first) == vertexListMap.end())
+		if (attributes[i].count != vertexnum)
 		{
 			THROW_EXCEPTION(Exception::OpenGLError,
-				(boost::format("Invalid vertex: index attribute %d is not registerd.") % pair.first).str());
-		}
-		else
-		{
-			int length = vertexListMap[pair.first].size();
-			int size = vertexSizeMap[pair.first];
-			if (vertexnum < 0)
-			{
-				vertexnum = length / size;
-			}
-			else if (length / size != vertexnum)
-			{
-				THROW_EXCEPTION(Exception::OpenGLError,
-					(boost::format("Invalid vertex: vertex number is .") % pair.first).str());				
-			}
+				(boost::format("Invalid vertex: attribute %d has %d vertices but %d vertices are expected.")
+					% attributes[i].index % attributes[i].count % vertexnum).str());
 		}
 	}
 
+	this->usage = usage;
+	vertexNum = vertexnum;
+	vertexCapacity = vertexnum;
+	indexNum = indexList.size();
+
 	glBindVertexArray(vaoID);
 
 	// Assign index buffer data.
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferID);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexList.size() * sizeof(GLuint), &indexList[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	// The binding is recorded in the vertex array object.
+	if (indexNum > 0)
+	{
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferID);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexNum * sizeof(GLuint), &indexList[0], usage);
+		CHECK_GL_ERRORS();
+	}
+
+	// Assign buffer data in a single upload.
+	glBindBuffer(GL_ARRAY_BUFFER, vboID);
+	glBufferData(GL_ARRAY_BUFFER, vertexNum * GetStride(), vertexList.empty() ? NULL : &vertexList[0], usage);
+	SetAttributePointers();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	CHECK_GL_ERRORS();
 
-	// Assign buffer data.
-	BOOST_FOREACH (IndexVertexListMap::value_type& pair, vertexListMap)
+	glBindVertexArray(0);
+
+	if (releaseClientData)
 	{
-		int vboID = vboArrayIDMap[pair.first];
-		int size = vertexSizeMap[pair.first];
-		std::vector<float>& v = vertexListMap[pair.first];
+		std::vector<float>().swap(vertexList);
+		std::vector<GLuint>().swap(indexList);
+	}
+}
+
+void VertexStream::SetAttributePointers()
+{
+	// The vertex buffer must be bound to GL_ARRAY_BUFFER with the vertex array object
+	for (int i = 0; i < attributes.size(); i++)
+	{
+		const Attribute& attr = attributes[i];
+		glVertexAttribPointer(attr.index, attr.components, GL_FLOAT, GL_FALSE,
+			GetStride(), (const GLvoid*)(attr.offset * sizeof(float)));
+		glEnableVertexAttribArray(attr.index);
+	}
+}
+
+void VertexStream::Resize( int n )
+{
+	// The storage grows geometrically and the contents of the first
+	// min(n, vertexNum) vertices are kept. The client copy is not changed.
+	if (n > vertexCapacity)
+	{
+		int capacity = std::max(n * 2, 1024);
+
+		GLuint newVboID;
+		glGenBuffers(1, &newVboID);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, newVboID);
+		glBufferData(GL_COPY_WRITE_BUFFER, capacity * GetStride(), NULL, usage);
+		if (vertexNum > 0)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, vboID);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, vertexNum * GetStride());
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		glDeleteBuffers(1, &vboID);
+		vboID = newVboID;
+
+		glBindVertexArray(vaoID);
 		glBindBuffer(GL_ARRAY_BUFFER, vboID);
-		glBufferData(GL_ARRAY_BUFFER, v.size() * sizeof(float), &v[0], GL_STATIC_DRAW);
-		glVertexAttribPointer(pair.first, size / sizeof(float), GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(pair.first);
+		SetAttributePointers();
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
 		CHECK_GL_ERRORS();
+
+		vertexCapacity = capacity;
 	}
 
-	glBindVertexArray(0);
+	vertexNum = n;
+}
+
+void VertexStream::UpdateVertices( int first, int n, const void* data )
+{
+	if (first < 0 || n < 0 || first + n > vertexNum)
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Vertex range [%d, %d) is out of the stream of %d vertices") % first % (first + n) % vertexNum).str());
+	}
+
+	if (n == 0) return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, vboID);
+	glBufferSubData(GL_ARRAY_BUFFER, first * GetStride(), n * GetStride(), data);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+void* VertexStream::MapVertices( int first, int n, GLbitfield access )
+{
+	if (first < 0 || n <= 0 || first + n > vertexNum)
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Vertex range [%d, %d) is out of the stream of %d vertices") % first % (first + n) % vertexNum).str());
+	}
+
+	// The buffer is kept bound until UnmapVertices()
+	glBindBuffer(GL_ARRAY_BUFFER, vboID);
+	void* p = glMapBufferRange(GL_ARRAY_BUFFER, first * GetStride(), n * GetStride(), access);
+	if (!p)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		THROW_EXCEPTION(Exception::OpenGLError, "Failed to map the vertex buffer");
+	}
+	return p;
+}
+
+void VertexStream::UnmapVertices()
+{
+	glBindBuffer(GL_ARRAY_BUFFER, vboID);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+VertexStream::Attribute& VertexStream::FindAttribute( GLuint index )
+{
+	for (int i = 0; i < attributes.size(); i++)
+	{
+		if (attributes[i].index == index)
+		{
+			return attributes[i];
+		}
+	}
+
+	THROW_EXCEPTION(Exception::InvalidArgument,
+		(boost::format("Invalid vertex: index attribute %d is not registerd.") % index).str());
 }
 
 void VertexStream::AddVertex( GLuint index, const glm::vec2& v )
 {
-	std::vector<float>& list = vertexListMap[index];
-	list.push_back(v.x);
-	list.push_back(v.y);
+	AddVertex(index, &v.x, 2);
 }
 
 void VertexStream::AddVertex( GLuint index, const glm::vec3& v )
 {
-	std::vector<float>& list = vertexListMap[index];
-	list.push_back(v.x);
-	list.push_back(v.y);
-	list.push_back(v.z);
+	AddVertex(index, &v.x, 3);
 }
 
 void VertexStream::AddVertex( GLuint index, const glm::vec4& v )
 {
-	std::vector<float>& list = vertexListMap[index];
-	list.push_back(v.x);
-	list.push_back(v.y);
-	list.push_back(v.z);
-	list.push_back(v.w);
+	AddVertex(index, &v.x, 4);
 }
 
 void VertexStream::AddVertex( GLuint index, const std::vector<float>& v )
 {
-	std::vector<float>& list = vertexListMap[index];
-	BOOST_FOREACH (float f, v)
+	if (!v.empty())
 	{
-		list.push_back(f);
+		AddVertex(index, &v[0], v.size());
 	}
 }
 
 void VertexStream::AddVertex( GLuint index, const float* v, int n )
 {
-	std::vector<float>& list = vertexListMap[index];
-	for (int i = 0; i < n; i++)
+	// n can be a multiple of the components to add several vertices at once
+	Attribute& attr = FindAttribute(index);
+	if (n % attr.components != 0)
 	{
-		list.push_back(v[i]);
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Invalid vertex: attribute %d has %d components but %d values are given.")
+				% index % attr.components % n).str());
+	}
+
+	for (int i = 0; i < n; i += attr.components)
+	{
+		int base = attr.count * stride + attr.offset;
+		if (vertexList.size() < (attr.count + 1) * stride)
+		{
+			vertexList.resize((attr.count + 1) * stride);
+		}
+		std::copy(v + i, v + i + attr.components, vertexList.begin() + base);
+		attr.count++;
 	}
 }
 
 void VertexStream::Draw( GLenum mode )
 {
+	Draw(mode, 0, indexNum > 0 ? indexNum : vertexNum);
+}
+
+void VertexStream::Draw( GLenum mode, int first, int count )
+{
+	// The range is in the indices for the indexed streams and in the vertices otherwise
+	if (count <= 0) return;
+
 	glBindVertexArray(vaoID);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferID);
-	glDrawElements(mode, indexList.size(), GL_UNSIGNED_INT, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	if (indexNum > 0)
+	{
+		glDrawElements(mode, count, GL_UNSIGNED_INT, (const GLvoid*)(first * sizeof(GLuint)));
+	}
+	else
+	{
+		glDrawArrays(mode, first, count);
+	}
+	glBindVertexArray(0);
+}
+
+void VertexStream::MultiDraw( GLenum mode, const std::vector<GLint>& firsts, const std::vector<GLsizei>& counts )
+{
+	// Only for the streams without the indices
+	if (indexNum > 0)
+	{
+		THROW_EXCEPTION(Exception::InvalidOperation, "MultiDraw is not supported for the indexed stream");
+	}
+
+	if (firsts.empty()) return;
+
+	glBindVertexArray(vaoID);
+	glMultiDrawArrays(mode, &firsts[0], &counts[0], firsts.size());
 	glBindVertexArray(0);
 }
 
@@ -237,18 +516,12 @@ void VertexStream::AddIndex( GLuint i0, GLuint i1, GLuint i2, GLuint i3 )
 
 void VertexStream::AddIndex( const std::vector<GLuint>& v )
 {
-	BOOST_FOREACH (GLuint i, v)
-	{
-		indexList.push_back(i);
-	}
+	indexList.insert(indexList.end(), v.begin(), v.end());
 }
 
 void VertexStream::AddIndex( const GLuint* v, int n )
 {
-	for (int i = 0; i < n; i++)
-	{
-		indexList.push_back(v[i]);
-	}
+	indexList.insert(indexList.end(), v, v + n);
 }
 
 TriangleMesh::TriangleMesh()
@@ -281,6 +554,7 @@ SphereMesh::SphereMesh( float radius, int slicenum, int stacknum )
 	float s = 0.0f;
 
 	unsigned int v_index = 0;
+	Reserve(stacknum * slicenum * 6, stacknum * slicenum * 6);
 	Begin();
 
 	for (int i = 0; i < stacknum; ++i)
@@ -452,83 +726,79 @@ QuadMesh::QuadMesh( float x, float y, float w, float h )
 	End();
 }
 
-GlslShader::GlslShader()
+namespace
 {
-	programID = glCreateProgram();
-	CHECK_GL_ERRORS();
-}
 
-GlslShader::~GlslShader()
-{
-	glDeleteProgram(programID);
-}
-
-// Create and compile shader
-void GlslShader::AddShader( ShaderType type, const std::string& path )
-{
-	if (path.empty())
+	// Program binaries loaded or stored in this session.
+	// The programs created again, e.g. by opening another project, are loaded from here.
+	struct ProgramBinary
 	{
-		THROW_EXCEPTION(Exception::InvalidArgument, "Given path is empty");
-	}
+		GLenum format;
+		std::vector<char> data;
+	};
 
-	// Load file
-	std::string content = LoadShaderFile(path);
+	typedef boost::unordered_map<std::string, ProgramBinary> ProgramBinaryMap;
+	ProgramBinaryMap programBinaryMap;
 
-	// Convert shader type to GL shader type
-	GLuint shaderID;
-	switch (type)
+	GLenum GetGLShaderType(GlslShader::ShaderType type)
 	{
-	case VERTEX_SHADER:
-		shaderID = CreateAndCompileShader(GL_VERTEX_SHADER, content, path);
-		break;
+		switch (type)
+		{
+		case GlslShader::VERTEX_SHADER:
+			return GL_VERTEX_SHADER;
 
-	case FRAGMENT_SHADER:
-		shaderID = CreateAndCompileShader(GL_FRAGMENT_SHADER, content, path);
-		break;
+		case GlslShader::FRAGMENT_SHADER:
+			return GL_FRAGMENT_SHADER;
 
-	case GEOMETRY_SHADER:
-		shaderID = CreateAndCompileShader(GL_GEOMETRY_SHADER, content, path);
-		break;
+		case GlslShader::GEOMETRY_SHADER:
+			return GL_GEOMETRY_SHADER;
+		}
 
-	default:
 		THROW_EXCEPTION(Exception::InvalidArgument, "Invalid shader type");
 	}
 
-	// Attach to the program and delete
-	glAttachShader(programID, shaderID);
-	glDeleteShader(shaderID);
+}
 
+std::string GlslShader::binaryCacheDirectory;
+
+GlslShader::GlslShader()
+{
+	programID = glCreateProgram();
 	CHECK_GL_ERRORS();
 }
 
-void GlslShader::AddShaderString( ShaderType type, const std::string& content )
+GlslShader::~GlslShader()
 {
-	// Convert shader type to GL shader type
-	GLuint shaderID;
-	const std::string path = "<literal>";
-	switch (type)
-	{
-	case VERTEX_SHADER:
-		shaderID = CreateAndCompileShader(GL_VERTEX_SHADER, content, path);
-		break;
-
-	case FRAGMENT_SHADER:
-		shaderID = CreateAndCompileShader(GL_FRAGMENT_SHADER, content, path);
-		break;
+	glDeleteProgram(programID);
+}
 
-	case GEOMETRY_SHADER:
-		shaderID = CreateAndCompileShader(GL_GEOMETRY_SHADER, content, path);
-		break;
+void GlslShader::SetBinaryCacheDirectory( const std::string& directory )
+{
+	binaryCacheDirectory = directory;
+}
 
-	default:
-		THROW_EXCEPTION(Exception::InvalidArgument, "Invalid shader type");
+// Load the shader source. The shader is compiled in Initialize().
+void GlslShader::AddShader( ShaderType type, const std::string& path )
+{
+	if (path.empty())
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument, "Given path is empty");
 	}
 
-	// Attach to the program and delete
-	glAttachShader(programID, shaderID);
-	glDeleteShader(shaderID);
+	ShaderSource source;
+	source.type = GetGLShaderType(type);
+	source.content = LoadShaderFile(path);
+	source.path = path;
+	sources.push_back(source);
+}
 
-	CHECK_GL_ERRORS();
+void GlslShader::AddShaderString( ShaderType type, const std::string& content )
+{
+	ShaderSource source;
+	source.type = GetGLShaderType(type);
+	source.content = content;
+	source.path = "<literal>";
+	sources.push_back(source);
 }
 
 // Load shader file and return its content
@@ -540,17 +810,9 @@ std::string GlslShader::LoadShaderFile(const std::string& path)
 		THROW_EXCEPTION(Exception::FileError, path);
 	}
 
-	std::string line = "";
-	std::string text = "";
-
-	while (getline(ifs, line))
-	{
-		text += ("\n" + line);
-	}
-
-	ifs.close();
-
-	return text;
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	return ss.str();
 }
 
 GLuint GlslShader::CreateAndCompileShader( GLuint type, const std::string& content, const std::string& path )
@@ -587,12 +849,43 @@ GLuint GlslShader::CreateAndCompileShader( GLuint type, const std::string& conte
 
 void GlslShader::BindAttribute( GLuint index, const std::string& name )
 {
+	// The bindings are also a part of the program binary
 	glBindAttribLocation(programID, index, name.c_str());
+	attributes.push_back(std::make_pair(index, name));
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::Initialize()
 {
+	std::string key = GetBinaryCacheKey();
+	if (!LoadProgramBinary(key))
+	{
+		CompileAndLink();
+		SaveProgramBinary(key);
+	}
+
+	ResolveUniforms();
+
+	// The sources are no longer needed
+	sources.clear();
+	attributes.clear();
+}
+
+void GlslShader::CompileAndLink()
+{
+	for (int i = 0; i < sources.size(); i++)
+	{
+		// Attach to the program and delete
+		GLuint shaderID = CreateAndCompileShader(sources[i].type, sources[i].content, sources[i].path);
+		glAttachShader(programID, shaderID);
+		glDeleteShader(shaderID);
+	}
+
+	if (GLEW_ARB_get_program_binary)
+	{
+		glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	// Link program
 	glLinkProgram(programID);
 
@@ -615,43 +908,229 @@ void GlslShader::Initialize()
 	CHECK_GL_ERRORS();
 }
 
-GLuint GlslShader::GetOrCreateUniformID( const std::string& name )
+void GlslShader::ResolveUniforms()
+{
+	// Resolve the locations of the active uniforms.
+	// The uniforms in the uniform blocks have no location and are skipped.
+	GLint uniformNum;
+	GLint maxNameLength;
+	glGetProgramiv(programID, GL_ACTIVE_UNIFORMS, &uniformNum);
+	glGetProgramiv(programID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+	boost::scoped_array<char> nameBuffer(new char[maxNameLength + 1]);
+
+	uniformLocationMap.clear();
+	for (GLint i = 0; i < uniformNum; i++)
+	{
+		GLint arraySize;
+		GLenum type;
+		glGetActiveUniform(programID, i, maxNameLength + 1, NULL, &arraySize, &type, nameBuffer.get());
+
+		std::string name = nameBuffer.get();
+		GLint location = glGetUniformLocation(programID, name.c_str());
+		if (location < 0)
+		{
+			continue;
+		}
+
+		// Arrays are reported as "name[0]"
+		std::string::size_type bracket = name.find('[');
+		if (bracket != std::string::npos)
+		{
+			name = name.substr(0, bracket);
+		}
+
+		UniformInfo info;
+		info.location = location;
+		info.type = type;
+		uniformLocationMap[name] = info;
+	}
+
+	CHECK_GL_ERRORS();
+}
+
+std::string GlslShader::GetBinaryCacheKey()
+{
+	// The binary depends on the sources, the attribute bindings and the driver
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	hash.addData((const char*)glGetString(GL_VENDOR));
+	hash.addData((const char*)glGetString(GL_RENDERER));
+	hash.addData((const char*)glGetString(GL_VERSION));
+	for (int i = 0; i < sources.size(); i++)
+	{
+		hash.addData((boost::format("\n#type %d\n") % sources[i].type).str().c_str());
+		hash.addData(sources[i].content.c_str(), sources[i].content.size());
+	}
+	for (int i = 0; i < attributes.size(); i++)
+	{
+		hash.addData((boost::format("\n#attribute %d %s\n") % attributes[i].first % attributes[i].second).str().c_str());
+	}
+	return QString(hash.result().toHex()).toStdString();
+}
+
+bool GlslShader::LoadProgramBinary( const std::string& key )
+{
+	if (!GLEW_ARB_get_program_binary)
+	{
+		return false;
+	}
+
+	// Find in the session, then in the cache directory
+	ProgramBinaryMap::iterator it = programBinaryMap.find(key);
+	if (it == programBinaryMap.end())
+	{
+		if (binaryCacheDirectory.empty())
+		{
+			return false;
+		}
+
+		std::ifstream ifs((binaryCacheDirectory + "/" + key + ".bin").c_str(), std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+		{
+			return false;
+		}
+
+		ProgramBinary binary;
+		if (!ifs.read((char*)&binary.format, sizeof(GLenum)))
+		{
+			return false;
+		}
+
+		std::stringstream ss;
+		ss << ifs.rdbuf();
+		std::string data = ss.str();
+		if (data.empty())
+		{
+			return false;
+		}
+
+		binary.data.assign(data.begin(), data.end());
+		it = programBinaryMap.insert(std::make_pair(key, binary)).first;
+	}
+
+	// The binary in the format not supported by the driver (e.g. after the driver update) is not given to GL
+	GLint formatNum;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatNum);
+	std::vector<GLint> formats(std::max(formatNum, 1));
+	glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, &formats[0]);
+	if (std::find(formats.begin(), formats.begin() + formatNum, (GLint)it->second.format) == formats.begin() + formatNum)
+	{
+		programBinaryMap.erase(it);
+		return false;
+	}
+
+	// The driver can still reject the binary, then the program is compiled from the sources
+	glProgramBinary(programID, it->second.format, &it->second.data[0], it->second.data.size());
+	GLint ret;
+	glGetProgramiv(programID, GL_LINK_STATUS, &ret);
+	if (ret == GL_FALSE)
+	{
+		programBinaryMap.erase(it);
+		return false;
+	}
+
+	CHECK_GL_ERRORS();
+	return true;
+}
+
+void GlslShader::SaveProgramBinary( const std::string& key )
+{
+	if (!GLEW_ARB_get_program_binary)
+	{
+		return;
+	}
+
+	GLint length;
+	glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+	{
+		return;
+	}
+
+	ProgramBinary binary;
+	binary.data.resize(length);
+	glGetProgramBinary(programID, length, NULL, &binary.format, &binary.data[0]);
+	CHECK_GL_ERRORS();
+	programBinaryMap[key] = binary;
+
+	// Failure of writing the cache is not an error
+	if (!binaryCacheDirectory.empty() && QDir().mkpath(QString::fromStdString(binaryCacheDirectory)))
+	{
+		std::ofstream ofs((binaryCacheDirectory + "/" + key + ".bin").c_str(), std::ios::out | std::ios::binary);
+		if (ofs.is_open())
+		{
+			ofs.write((const char*)&binary.format, sizeof(GLenum));
+			ofs.write(&binary.data[0], binary.data.size());
+		}
+	}
+}
+
+GLint GlslShader::GetUniformID( const std::string& name )
+{
+	// Inactive uniforms are ignored as glUniform* does for the location -1
+	UniformLocationMap::iterator it = uniformLocationMap.find(name);
+	return it == uniformLocationMap.end() ? -1 : it->second.location;
+}
+
+GLint GlslShader::GetUniformLocation( const std::string& name, GLenum type )
 {
 	UniformLocationMap::iterator it = uniformLocationMap.find(name);
 	if (it == uniformLocationMap.end())
 	{
-		GLuint loc = glGetUniformLocation(programID, name.c_str());
-		uniformLocationMap[name] = loc;
-		return loc;
+		return -1;
+	}
+
+	// The integer handles are also accepted for the samplers
+	GLenum actualType = it->second.type;
+	bool isSampler =
+		actualType == GL_SAMPLER_1D || actualType == GL_SAMPLER_2D || actualType == GL_SAMPLER_3D ||
+		actualType == GL_SAMPLER_CUBE || actualType == GL_SAMPLER_2D_SHADOW ||
+		actualType == GL_SAMPLER_1D_ARRAY || actualType == GL_SAMPLER_2D_ARRAY ||
+		actualType == GL_SAMPLER_2D_RECT || actualType == GL_SAMPLER_BUFFER;
+	if (actualType != type && !(type == GL_INT && (isSampler || actualType == GL_BOOL)))
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Type mismatch of the uniform '%s': 0x%x is requested but 0x%x is declared") % name % type % actualType).str());
+	}
+
+	return it->second.location;
+}
+
+void GlslShader::BindUniformBlock( const std::string& name, GLuint binding )
+{
+	// The program which does not use the block is skipped
+	GLuint blockIndex = glGetUniformBlockIndex(programID, name.c_str());
+	if (blockIndex != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programID, blockIndex, binding);
 	}
-	return it->second;
+	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniformMatrix4f( const std::string& name, const glm::mat4& mat )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
+	GLint uniformID = GetUniformID(name);
 	glUniformMatrix4fv(uniformID, 1, GL_FALSE, glm::value_ptr(mat));
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniformMatrix3f( const std::string& name, const glm::mat3& mat )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
+	GLint uniformID = GetUniformID(name);
 	glUniformMatrix3fv(uniformID, 1, GL_FALSE, glm::value_ptr(mat));
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniform3f( const std::string& name, const glm::vec3& v )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
-	glUniform3fv(uniformID, 1, glm::value_ptr(v));
+	GLint uniformID = GetUniformID(name);
+	glUniform3fv(uniformID, 1, &v.x);
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniform4f( const std::string& name, const glm::vec4& v )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
-	glUniform4fv(uniformID, 1, glm::value_ptr(v));
+	GLint uniformID = GetUniformID(name);
+	glUniform4fv(uniformID, 1, &v.x);
 	CHECK_GL_ERRORS();
 }
 
@@ -669,28 +1148,28 @@ void GlslShader::End()
 
 void GlslShader::SetUniformTexture( const std::string& name, int unit )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
+	GLint uniformID = GetUniformID(name);
 	glUniform1i(uniformID, unit);
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniform1f( const std::string& name, float v )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
+	GLint uniformID = GetUniformID(name);
 	glUniform1f(uniformID, v);
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniform2f( const std::string& name, const glm::vec2& v )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
-	glUniform2fv(uniformID, 1, glm::value_ptr(v));
+	GLint uniformID = GetUniformID(name);
+	glUniform2fv(uniformID, 1, &v.x);
 	CHECK_GL_ERRORS();
 }
 
 void GlslShader::SetUniform1i( const std::string& name, int v )
 {
-	GLuint uniformID = GetOrCreateUniformID(name);
+	GLint uniformID = GetUniformID(name);
 	glUniform1i(uniformID, v);
 	CHECK_GL_ERRORS();
 }
@@ -768,9 +1247,23 @@ void Texture2D::SetTextureParam(GLint wrapmode, GLint minfilter, GLint magfilter
 Texture2DArray::Texture2DArray(int width, int height, int depth, GLint internalformat, GLenum format, GLint wrapmode, GLint magfilter, GLint minfilter)
 	: width(width)
 	, height(height)
+	, levels(1)
 {
+	if (minfilter != GL_NEAREST && minfilter != GL_LINEAR)
+	{
+		while ((std::max(width, height) >> levels) > 0)
+		{
+			levels++;
+		}
+	}
+
 	glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
-	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalformat, width, height, depth, 0, format, GL_UNSIGNED_BYTE, NULL);
+	for (int level = 0; level < levels; level++)
+	{
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalformat,
+			std::max(width >> level, 1), std::max(height >> level, 1), depth, 0, format, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
 	SetTextureParam(wrapmode, minfilter, magfilter);
 	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 	CHECK_GL_ERRORS();
@@ -803,18 +1296,256 @@ void Texture2DArray::SetTextureParam( GLint wrapmode, GLint minfilter, GLint mag
 	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrapmode);
 
 	// Filters
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, magfilter);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minfilter);
 }
 
 void Texture2DArray::Substitute( int depth, GLenum format, const void* data )
 {
+	Substitute(depth, 1, format, data);
+}
+
+void Texture2DArray::Substitute( int first, int count, GLenum format, const void* data )
+{
+	// The rows of the single channel layers may not be aligned to 4 bytes
+	glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, first, width, height, count, format, GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	CHECK_GL_ERRORS();
+}
+
+void Texture2DArray::GenerateMipmap()
+{
+	if (levels == 1)
+	{
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	CHECK_GL_ERRORS();
+}
+
+void Texture2DArray::SetSwizzle( GLint r, GLint g, GLint b, GLint a )
+{
+	// Maps the stored channels to the components read by the shaders
+	GLint swizzle[4] = { r, g, b, a };
 	glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
-	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, depth, width, height, 1, format, GL_UNSIGNED_BYTE, data);
+	glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
 	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 	CHECK_GL_ERRORS();
 }
 
+template <>
+void GlslUniform<int>::Set( const int& v ) const
+{
+	glUniform1i(location, v);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<float>::Set( const float& v ) const
+{
+	glUniform1f(location, v);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<glm::vec2>::Set( const glm::vec2& v ) const
+{
+	glUniform2fv(location, 1, &v.x);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<glm::vec3>::Set( const glm::vec3& v ) const
+{
+	glUniform3fv(location, 1, &v.x);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<glm::vec4>::Set( const glm::vec4& v ) const
+{
+	glUniform4fv(location, 1, &v.x);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<glm::mat3>::Set( const glm::mat3& v ) const
+{
+	glUniformMatrix3fv(location, 1, GL_FALSE, &v.x);
+	CHECK_GL_ERRORS();
+}
+
+template <>
+void GlslUniform<glm::mat4>::Set( const glm::mat4& v ) const
+{
+	glUniformMatrix4fv(location, 1, GL_FALSE, &v.x);
+	CHECK_GL_ERRORS();
+}
+
+FrameBuffer::FrameBuffer()
+	: prevFboID(0)
+{
+	glGenFramebuffers(1, &fboID);
+	CHECK_GL_ERRORS();
+}
+
+FrameBuffer::~FrameBuffer()
+{
+	glDeleteFramebuffers(1, &fboID);
+}
+
+void FrameBuffer::AttachTexture( GLenum attachment, Texture* texture )
+{
+	Bind();
+	glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture->GetID(), 0);
+
+	// Color attachments are written in the order of the attachment
+	if (attachment != GL_DEPTH_ATTACHMENT && attachment != GL_STENCIL_ATTACHMENT)
+	{
+		drawBuffers.push_back(attachment);
+		glDrawBuffers(drawBuffers.size(), &drawBuffers[0]);
+	}
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	Unbind();
+
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		THROW_EXCEPTION(Exception::OpenGLError,
+			(boost::format("Frame buffer is incomplete: 0x%x") % status).str());
+	}
+
+	CHECK_GL_ERRORS();
+}
+
+void FrameBuffer::Bind()
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFboID);
+	glBindFramebuffer(GL_FRAMEBUFFER, fboID);
+	CHECK_GL_ERRORS();
+}
+
+void FrameBuffer::Unbind()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, prevFboID);
+	CHECK_GL_ERRORS();
+}
+
+UniformBuffer::UniformBuffer( GLsizeiptr size )
+	: size(size)
+{
+	glGenBuffers(1, &bufferID);
+	glBindBuffer(GL_UNIFORM_BUFFER, bufferID);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+UniformBuffer::~UniformBuffer()
+{
+	glDeleteBuffers(1, &bufferID);
+}
+
+void UniformBuffer::Update( const void* data )
+{
+	glBindBuffer(GL_UNIFORM_BUFFER, bufferID);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+void UniformBuffer::BindBase( GLuint binding )
+{
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, bufferID);
+	CHECK_GL_ERRORS();
+}
+
+PixelUploadBuffer::PixelUploadBuffer( GLsizeiptr size )
+	: size(size)
+	, fence(NULL)
+{
+	glGenBuffers(1, &bufferID);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bufferID);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+PixelUploadBuffer::~PixelUploadBuffer()
+{
+	// The buffer in use by the pending transfer is released by GL after the transfer
+	if (fence)
+	{
+		glDeleteSync(fence);
+	}
+	glDeleteBuffers(1, &bufferID);
+}
+
+void* PixelUploadBuffer::Map()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bufferID);
+	void* p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!p)
+	{
+		THROW_EXCEPTION(Exception::OpenGLError, "Failed to map the pixel upload buffer");
+	}
+	return p;
+}
+
+void PixelUploadBuffer::Unmap()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bufferID);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	CHECK_GL_ERRORS();
+}
+
+void PixelUploadBuffer::Bind()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bufferID);
+}
+
+void PixelUploadBuffer::Unbind()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void PixelUploadBuffer::Fence()
+{
+	if (fence)
+	{
+		glDeleteSync(fence);
+	}
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	CHECK_GL_ERRORS();
+}
+
+bool PixelUploadBuffer::IsComplete()
+{
+	// Polls the fence without waiting
+	if (!fence)
+	{
+		return true;
+	}
+
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+	{
+		glDeleteSync(fence);
+		fence = NULL;
+		return true;
+	}
+	return false;
+}
+
 class ImageLoader::Impl
 {
 public:
@@ -4,17 +4,47 @@
 #include <GL/glew.h>
 #include <GL/wglew.h>
 
+/*!
+	GL error check.
+	In the debug build the errors are reported by the debug output callback if it is enabled,
+	and thrown at the next check with its file and line. Otherwise glGetError is checked.
+	In the release build the check is removed, since glGetError synchronizes the driver.
+*/
+#ifdef _DEBUG
 #define CHECK_GL_ERRORS() CheckGLErrors(__FILE__, __FUNCTION__, __LINE__)
+#else
+#define CHECK_GL_ERRORS()
+#endif
 void CheckGLErrors(const char* filename, const char* funcname, const int line);
 
+/*!
+	Enable the debug output (GL_ARB_debug_output) in the debug build.
+	The output is asynchronous unless \a synchronous is true,
+	which stalls the driver but reports the error at the check right after the call.
+	Returns false if the extension is not supported or in the release build.
+*/
+bool EnableGLDebugOutput(bool synchronous = false);
+
+/*!
+	Convert a float to the IEEE 754 half float (GL_HALF_FLOAT).
+	The mantissa is rounded to the nearest.
+*/
+unsigned short FloatToHalf(float f);
+
+class VertexStream;
+
 /*!
 	AABB.
 	Axis-Aligned Bounding Box.
+	The edges are drawn from the static vertex buffer
+	which is rebuilt only when the bounds are changed.
 */
 class AABB
 {
 public:
 
+	AABB();
+	~AABB();
 	void Draw();
 
 public:
@@ -22,21 +52,34 @@ public:
 	glm::vec3 min;
 	glm::vec3 max;
 
+private:
+
+	VertexStream* stream;
+	glm::vec3 streamMin;
+	glm::vec3 streamMax;
+
 };
 
 /*!
 	Vertex stream.
 	The class represents GL vertex stream
-	which associates a vertex array object and
-	several vertex buffer objects.
+	which associates a vertex array object,
+	an interleaved vertex buffer object and an index buffer object.
+	The vertices are built between Begin() and End() and uploaded at once in End().
+	The attributes can be added in any order, because each attribute has its own cursor.
+	The streams created with GL_DYNAMIC_DRAW can be updated later by the sub-ranges.
 */
 class VertexStream
 {
 private:
 
-	typedef boost::unordered_map<GLuint, std::vector<float> > IndexVertexListMap;
-	typedef boost::unordered_map<GLuint, GLint> IndexVertexSizeMap;
-	typedef boost::unordered_map<GLuint, GLuint> IndexVBOArrayIDMap;
+	struct Attribute
+	{
+		GLuint index;		//!< Attribute index.
+		int components;		//!< Number of the float components.
+		int offset;			//!< Offset in the vertex in floats.
+		int count;			//!< Number of the vertices written.
+	};
 
 public:
 
@@ -56,9 +99,21 @@ public:
 	VertexStream();
 	virtual ~VertexStream();
 	void AddAttribute(GLuint index, GLint size);
+	void Reserve(int vertexNum, int indexNum);
 	void Begin();
-	void End();
+	void End(GLenum usage = GL_STATIC_DRAW, bool releaseClientData = false);
+	int GetVertexNum() const { return vertexNum; }
+	int GetIndexNum() const { return indexNum; }
+	GLsizei GetStride() const { return stride * sizeof(float); }
+
+	void Resize(int n);
+	void UpdateVertices(int first, int n, const void* data);
+	void* MapVertices(int first, int n, GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	void UnmapVertices();
+
 	void Draw(GLenum mode);
+	void Draw(GLenum mode, int first, int count);
+	void MultiDraw(GLenum mode, const std::vector<GLint>& firsts, const std::vector<GLsizei>& counts);
 	void AddVertex(GLuint index, const glm::vec2& v);
 	void AddVertex(GLuint index, const glm::vec3& v);
 	void AddVertex(GLuint index, const glm::vec4& v);
@@ -71,15 +126,25 @@ public:
 	void AddIndex(const std::vector<GLuint>& v);
 	void AddIndex(const GLuint* v, int n);
 
+private:
+
+	Attribute& FindAttribute(GLuint index);
+	void SetAttributePointers();
+
 protected:
 
-	IndexVertexListMap vertexListMap;
-	IndexVertexSizeMap vertexSizeMap;
-	IndexVBOArrayIDMap vboArrayIDMap;
+	std::vector<Attribute> attributes;
+	int stride;						//!< Size of a vertex in floats.
+	std::vector<float> vertexList;	//!< Interleaved client copy of the vertices.
+	std::vector<GLuint> indexList;	//!< Client copy of the indices.
 
 	GLuint vaoID;
+	GLuint vboID;
 	GLuint indexBufferID;
-	std::vector<GLuint> indexList;
+	GLenum usage;
+	int vertexNum;
+	int vertexCapacity;
+	int indexNum;
 
 };
 
@@ -118,9 +183,64 @@ public:
 
 };
 
+/*!
+	GLSL uniform.
+	Typed handle of a uniform variable resolved from the program after linking.
+	The handle of the inactive uniform has the location -1 and Set() is ignored by GL.
+	The program must be in use when Set() is called.
+*/
+template <typename T>
+class GlslUniform
+{
+public:
+
+	GlslUniform()
+		: location(-1)
+	{
+
+	}
+
+	explicit GlslUniform(GLint location)
+		: location(location)
+	{
+
+	}
+
+	bool IsActive() const { return location >= 0; }
+	void Set(const T& v) const;
+
+private:
+
+	GLint location;
+
+};
+
+template <> void GlslUniform<int>::Set(const int& v) const;
+template <> void GlslUniform<float>::Set(const float& v) const;
+template <> void GlslUniform<glm::vec2>::Set(const glm::vec2& v) const;
+template <> void GlslUniform<glm::vec3>::Set(const glm::vec3& v) const;
+template <> void GlslUniform<glm::vec4>::Set(const glm::vec4& v) const;
+template <> void GlslUniform<glm::mat3>::Set(const glm::mat3& v) const;
+template <> void GlslUniform<glm::mat4>::Set(const glm::mat4& v) const;
+
+// GL type of the uniform for each handle type.
+// Integer handles are also used for the samplers.
+template <typename T> struct GlslUniformType;
+template <> struct GlslUniformType<int> { static const GLenum Value = GL_INT; };
+template <> struct GlslUniformType<float> { static const GLenum Value = GL_FLOAT; };
+template <> struct GlslUniformType<glm::vec2> { static const GLenum Value = GL_FLOAT_VEC2; };
+template <> struct GlslUniformType<glm::vec3> { static const GLenum Value = GL_FLOAT_VEC3; };
+template <> struct GlslUniformType<glm::vec4> { static const GLenum Value = GL_FLOAT_VEC4; };
+template <> struct GlslUniformType<glm::mat3> { static const GLenum Value = GL_FLOAT_MAT3; };
+template <> struct GlslUniformType<glm::mat4> { static const GLenum Value = GL_FLOAT_MAT4; };
+
 /*!
 	GLSL program.
 	The class for handling a GLSL program with shaders.
+	The active uniforms are enumerated once at the link time.
+	The shaders are compiled in Initialize(). If the binary cache is enabled,
+	the linked program binary is stored with the key of the sources and the driver,
+	and the compilation is skipped when the same program is created again.
 */
 class GlslShader
 {
@@ -133,7 +253,13 @@ public:
 		GEOMETRY_SHADER
 	};
 
-	typedef boost::unordered_map<std::string, GLuint> UniformLocationMap;
+	struct UniformInfo
+	{
+		GLint location;
+		GLenum type;
+	};
+
+	typedef boost::unordered_map<std::string, UniformInfo> UniformLocationMap;
 
 public:
 
@@ -143,6 +269,14 @@ public:
 	void AddShaderString(ShaderType type, const std::string& content);
 	void Initialize();
 	void BindAttribute(GLuint index, const std::string& name);
+	void BindUniformBlock(const std::string& name, GLuint binding);
+
+	template <typename T>
+	GlslUniform<T> GetUniform(const std::string& name)
+	{
+		return GlslUniform<T>(GetUniformLocation(name, GlslUniformType<T>::Value));
+	}
+
 	void SetUniformMatrix4f(const std::string& name, const glm::mat4& mat);
 	void SetUniformMatrix3f(const std::string& name, const glm::mat3& mat);
 	void SetUniform1f(const std::string& name, float v);
@@ -154,17 +288,38 @@ public:
 	void Begin();
 	void End();
 
+	static void SetBinaryCacheDirectory(const std::string& directory);
+
 private:
 
 	std::string LoadShaderFile(const std::string& path);
 	GLuint CreateAndCompileShader(GLuint type, const std::string& content, const std::string& path);
-	GLuint GetOrCreateUniformID(const std::string& name);
-	
+	void CompileAndLink();
+	void ResolveUniforms();
+	std::string GetBinaryCacheKey();
+	bool LoadProgramBinary(const std::string& key);
+	void SaveProgramBinary(const std::string& key);
+	GLint GetUniformLocation(const std::string& name, GLenum type);
+	GLint GetUniformID(const std::string& name);
+
 private:
 
+	struct ShaderSource
+	{
+		GLenum type;
+		std::string content;
+		std::string path;
+	};
+
 	GLuint programID;
 	UniformLocationMap uniformLocationMap;
 
+	// Sources and attribute bindings kept until Initialize()
+	std::vector<ShaderSource> sources;
+	std::vector<std::pair<GLuint, std::string> > attributes;
+
+	static std::string binaryCacheDirectory;
+
 };
 
 
@@ -211,6 +366,78 @@ private:
 
 };
 
+/*!
+	Frame buffer.
+	The class describes GL frame buffer object.
+	Bind() remembers the frame buffer bound before and Unbind() restores it.
+*/
+class FrameBuffer
+{
+public:
+
+	FrameBuffer();
+	~FrameBuffer();
+	void AttachTexture(GLenum attachment, Texture* texture);
+	void Bind();
+	void Unbind();
+
+private:
+
+	GLuint fboID;
+	GLint prevFboID;
+	std::vector<GLenum> drawBuffers;
+
+};
+
+/*!
+	Uniform buffer.
+	The class describes GL uniform buffer object
+	which holds a uniform block in the std140 layout shared by the programs.
+*/
+class UniformBuffer
+{
+public:
+
+	UniformBuffer(GLsizeiptr size);
+	~UniformBuffer();
+	void Update(const void* data);
+	void BindBase(GLuint binding);
+
+private:
+
+	GLuint bufferID;
+	GLsizeiptr size;
+
+};
+
+/*!
+	Pixel upload buffer.
+	The class describes the pixel buffer object bound to GL_PIXEL_UNPACK_BUFFER.
+	The pixels written to the mapped buffer are transferred to the texture asynchronously
+	by the texture substitution with the NULL data while the buffer is bound.
+	The fence inserted after the substitution tells when the texture is resident.
+*/
+class PixelUploadBuffer
+{
+public:
+
+	PixelUploadBuffer(GLsizeiptr size);
+	~PixelUploadBuffer();
+	void* Map();
+	void Unmap();
+	void Bind();
+	void Unbind();
+	void Fence();
+	bool IsComplete();
+
+private:
+
+	GLuint bufferID;
+	GLsizeiptr size;
+	GLsync fence;
+
+};
+
 class ImageLoader
 {
 public:
@@ -231,6 +458,8 @@ private:
 /*!
 	2D texture array.
 	The class describes GL_TEXTURE_2D_ARRAY.
+	If the minification filter uses the mipmaps, the full mip chain is allocated
+	and filled by GenerateMipmap() after the layers are substituted.
 */
 class Texture2DArray : public Texture
 {
@@ -240,6 +469,9 @@ public:
 	void Bind();
 	void Bind(GLenum unit);
 	void Substitute(int depth, GLenum format, const void* data);
+	void Substitute(int first, int count, GLenum format, const void* data);
+	void GenerateMipmap();
+	void SetSwizzle(GLint r, GLint g, GLint b, GLint a);
 
 private:
 
@@ -249,6 +481,7 @@ private:
 
 	int width;
 	int height;
+	int levels;
 
 };
 
@@ -9,15 +9,20 @@ GraphicsView::GraphicsView()
 }
 
 GLScene::GLScene()
-	: timeSum(0.0)
+	: continuousRedraw(false)
+	, timeSum(0.0)
 	, frameCount(0)
-	, prevTime(Timer::GetCurrentTimeMilli())
 {
 	GLenum err = glewInit();
 	if (err != GLEW_OK)
 	{
 		THROW_EXCEPTION(Exception::OpenGLError, (char*)glewGetErrorString(err));
 	}
+
+	EnableGLDebugOutput();
+
+	// Linked programs are cached to skip the shader compilation in the next time
+	GlslShader::SetBinaryCacheDirectory("./cache");
 }
 
 void GraphicsView::resizeEvent( QResizeEvent* event )
@@ -42,11 +47,54 @@ QSize GraphicsView::sizeHint() const
 
 void GLScene::drawBackground( QPainter* painter, const QRectF& rect )
 {
+	// Measure the CPU time spent for the frame itself instead of the interval between the frames.
+	// The GPU is not waited for; its cost is reported by the profiler queries.
+	double startTime = Timer::GetCurrentTimeMilli();
 	emit DrawCanvas();
-	UpdateFps();
-	QTimer::singleShot(10, this, SLOT(update()));
+	UpdateFrameTime(Timer::GetCurrentTimeMilli() - startTime);
+
+	if (continuousRedraw)
+	{
+		QTimer::singleShot(10, this, SLOT(update()));
+	}
+}
+
+void GLScene::drawForeground( QPainter* painter, const QRectF& rect )
+{
+	if (overlayText.isEmpty()) return;
+
+	painter->save();
+	painter->setFont(QFont("Courier New", 9));
+	QRectF textRect = painter->boundingRect(QRectF(10.0, 10.0, 0.0, 0.0), Qt::AlignLeft | Qt::AlignTop, overlayText);
+	painter->fillRect(textRect.adjusted(-5.0, -5.0, 5.0, 5.0), QColor(0, 0, 0, 160));
+	painter->setPen(Qt::white);
+	painter->drawText(textRect, Qt::AlignLeft | Qt::AlignTop, overlayText);
+	painter->restore();
+}
+
+void GLScene::SetOverlayText( QString text )
+{
+	overlayText = text;
+}
+
+void GLScene::RequestRedraw()
+{
+	// Multiple requests before the next frame are merged into one redraw
+	update();
 }
 
+void GLScene::SetContinuousRedraw( bool enable )
+{
+	continuousRedraw = enable;
+	if (enable)
+	{
+		update();
+	}
+}
+
+// The input events are forwarded to the canvas, which requests the redraw only if the view is changed.
+// Otherwise e.g. hovering over the idle canvas would redraw all strokes.
+
 void GLScene::keyPressEvent( QKeyEvent* event )
 {
 	emit KeyPressed(event);
@@ -77,18 +125,15 @@ void GLScene::wheelEvent( QGraphicsSceneWheelEvent* event )
 	emit MouseWheeled(event);
 }
 
-void GLScene::UpdateFps()
+void GLScene::UpdateFrameTime( double frameTime )
 {
-	double currentTime = Timer::GetCurrentTimeMilli();
-	double elapsedTime = currentTime - prevTime;
-	prevTime = currentTime;
-
-	// Calculate FPS
-	timeSum += elapsedTime;
+	// Average over the frames while drawn continuously.
+	// Since the frames are sparse in the on-demand mode, the single frame is also reported.
+	timeSum += frameTime;
 	frameCount++;
-	if (frameCount >= 13)
+	if (frameCount >= 13 || !continuousRedraw)
 	{
-		emit UpdateFpsLabel(1000.0 * 13.0 / timeSum);
+		emit UpdateFrameTimeLabel((float)(timeSum / frameCount));
 		timeSum = 0.0;
 		frameCount = 0;
 	}
@@ -42,10 +42,17 @@ public:
 
 	GLScene();
 	void drawBackground(QPainter* painter, const QRectF& rect);
+	void drawForeground(QPainter* painter, const QRectF& rect);
+
+public slots:
+
+	void RequestRedraw();
+	void SetContinuousRedraw(bool enable);
+	void SetOverlayText(QString text);
 
 signals:
 
-	void UpdateFpsLabel(float fps);
+	void UpdateFrameTimeLabel(float frameTime);
 	void DrawCanvas();
 	void KeyPressed(QKeyEvent* event);
 	void KeyReleased(QKeyEvent* event);
@@ -65,12 +72,18 @@ protected:
 
 private:
 
-	void UpdateFps();
+	void UpdateFrameTime(double frameTime);
 
 private:
 
-	// FPS calculation
-	double prevTime;
+	// The scene is redrawn continuously only while the canvas is manipulated,
+	// otherwise it is redrawn on demand.
+	bool continuousRedraw;
+
+	// Text drawn over the canvas, e.g. the profiler results
+	QString overlayText;
+
+	// Frame time calculation
 	double timeSum;
 	int frameCount;
 
@@ -2,10 +2,54 @@
 #include "graphicsview.h"
 #include "canvas.h"
 #include "util.h"
+#include "projectfile.h"
+#include "strokestore.h"
 #include <QGLWidget>
+#include <QtConcurrentRun>
+#include <QFutureWatcher>
+#include <QUuid>
+
+namespace
+{
+
+	const int autosaveInterval = 60 * 1000;
+
+	// The journal is compacted when it exceeds the quarter of the project file
+	const qint64 minCompactionSize = 4 * 1024 * 1024;
+
+	// Random ID of the saved file which identifies the journal based on the file.
+	// The random bits are taken from a new UUID since qrand is not seeded.
+	long long NewSaveID()
+	{
+		QUuid uuid = QUuid::createUuid();
+		long long bits = ((long long)uuid.data1 << 32) ^ ((long long)uuid.data2 << 16) ^ (long long)uuid.data3;
+		for (int i = 0; i < 8; i++)
+		{
+			bits ^= (long long)uuid.data4[i] << (i * 8);
+		}
+		return (QDateTime::currentMSecsSinceEpoch() << 20) ^ bits;
+	}
+
+	// Saves the snapshot on a worker thread.
+	// Returns the error message or the empty string on success.
+	QString SaveSnapshot(QString path, ProjectInfo info, StrokeStore snapshot)
+	{
+		try
+		{
+			ProjectFile::Save(path, info, snapshot);
+		}
+		catch (const Exception& e)
+		{
+			return QString(e.what());
+		}
+		return QString();
+	}
+
+}
 
 MainWindow::MainWindow(QWidget *parent, Qt::WFlags flags)
 	: QMainWindow(parent, flags)
+	, gpuFrameTime(-1.0f)
 	, canvas(NULL)
 {
 
@@ -29,7 +73,7 @@ MainWindow::MainWindow(QWidget *parent, Qt::WFlags flags)
 	graphicsView->setScene(glscene);
 	
 	setCentralWidget(graphicsView);
-	connect(glscene, SIGNAL(UpdateFpsLabel(float)), this, SLOT(OnUpdateFpsLabel(float)));
+	connect(glscene, SIGNAL(UpdateFrameTimeLabel(float)), this, SLOT(OnUpdateFrameTimeLabel(float)));
 
 	// ------------------------------------------------------------
 
@@ -38,10 +82,40 @@ MainWindow::MainWindow(QWidget *parent, Qt::WFlags flags)
 	CreateToolBar();
 	CreateStatusBar();
 	CreateDockWidget();
+
+	// ------------------------------------------------------------
+
+	//
+	// Autosave
+	//
+
+	autosaveRevision = -1;
+	autosaveWatcher = new QFutureWatcher<QString>(this);
+	connect(autosaveWatcher, SIGNAL(finished()), this, SLOT(OnAutosaveFinished()));
+	autosaveTimer = new QTimer(this);
+	connect(autosaveTimer, SIGNAL(timeout()), this, SLOT(Autosave()));
+	autosaveTimer->start(autosaveInterval);
+
+	// The autosave of the unsaved canvas is not tied to a project,
+	// so its recovery is offered once the window is shown
+	QTimer::singleShot(0, this, SLOT(RecoverUntitledAutosave()));
+
+	//
+	// Journal
+	//
+
+	journal = new StrokeJournal;
+	compactionJournalID = compactionSaveID = 0;
+	compactionRecordNum = 0;
+	compactionWatcher = new QFutureWatcher<QString>(this);
+	connect(compactionWatcher, SIGNAL(finished()), this, SLOT(OnCompactionFinished()));
 }
 
 MainWindow::~MainWindow()
 {
+	autosaveWatcher->waitForFinished();
+	compactionWatcher->waitForFinished();
+	SAFE_DELETE(journal);
 	SAFE_DELETE(canvas);
 }
 
@@ -90,6 +164,8 @@ void MainWindow::NewFile()
 
 	InitCanvas();
 	canvas->SetModified(true);
+	projectPath.clear();
+	journal->Close();
 	statusBar()->showMessage("Created a new canvas with a proxy object " + file);
 }
 
@@ -107,7 +183,7 @@ void MainWindow::OpenFile()
 
 	QFileDialog dialog;
 	dialog.setFileMode(QFileDialog::ExistingFile);
-	dialog.setNameFilter("Freestroke file (*.xml)");
+	dialog.setNameFilter("Freestroke file (*.fsp *.xml)");
 	dialog.setWindowTitle("Select a file");
 	if (!dialog.exec())
 	{
@@ -117,12 +193,89 @@ void MainWindow::OpenFile()
 	SAFE_DELETE(canvas);
 
 	QString path = dialog.selectedFiles()[0];
+	QString loadPath = path;
 
-	std::ifstream ifs(path.toStdString());
-	boost::archive::text_iarchive ia(ifs);
+	// Recover from the autosave newer than the project
+	QFileInfo autosaveInfo(GetAutosavePath(path));
+	if (autosaveInfo.exists() && autosaveInfo.lastModified() > QFileInfo(path).lastModified())
+	{
+		int ret = QMessageBox::question(this, appTitle,
+			"The autosave is newer than the file. Do you want to recover it?",
+			QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes);
+		if (ret == QMessageBox::Yes)
+		{
+			loadPath = autosaveInfo.absoluteFilePath();
+		}
+	}
 
+	journal->Close();
 	canvas = new Canvas;
-	ia >> *canvas;
+	bool isProjectFile = ProjectFile::IsProjectFile(loadPath);
+	bool recovered = loadPath != path;
+	if (isProjectFile)
+	{
+		ProjectInfo info;
+		try
+		{
+			ProjectFile::Load(loadPath, info, *canvas->strokeStore);
+			canvas->proxyGeometryPath = info.proxyGeometryPath;
+			canvas->canvasWidth = info.canvasWidth;
+			canvas->canvasHeight = info.canvasHeight;
+		}
+		catch (const Exception& e)
+		{
+			if (e.Type() != Exception::FileError) throw;
+			SAFE_DELETE(canvas);
+			statusBar()->showMessage("Failed to load: " + QString(e.what()));
+			return;
+		}
+
+		// Replay the journal of the project file.
+		// The records after the last save are left from the crash or the discarded changes.
+		if (!recovered && info.saveID != 0)
+		{
+			QString journalPath = StrokeJournal::GetPath(path);
+			try
+			{
+				if (journal->Open(journalPath, info, *canvas->strokeStore))
+				{
+					int uncommittedNum = journal->GetUncommittedRecordNum();
+					if (uncommittedNum > 0)
+					{
+						int ret = QMessageBox::question(this, appTitle,
+							QString("The journal has %1 unsaved operations. Do you want to recover them?").arg(uncommittedNum),
+							QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes);
+						if (ret == QMessageBox::Yes)
+						{
+							journal->ApplyUncommitted(*canvas->strokeStore);
+							recovered = true;
+						}
+						else
+						{
+							journal->DiscardUncommitted();
+						}
+					}
+				}
+				else
+				{
+					journal->Create(journalPath, info.saveID);
+				}
+			}
+			catch (const Exception& e)
+			{
+				if (e.Type() != Exception::FileError) throw;
+				journal->Close();
+				statusBar()->showMessage("Failed to replay the journal: " + QString(e.what()));
+			}
+		}
+	}
+	else
+	{
+		// Text archives of the old versions are imported
+		std::ifstream ifs(loadPath.toStdString());
+		boost::archive::text_iarchive ia(ifs);
+		ia >> *canvas;
+	}
 
 	// Retrieve full path of proxy geometry path 
 	canvas->proxyGeometryPath = QFileInfo(path).dir().absoluteFilePath(QString::fromStdString(canvas->proxyGeometryPath)).toStdString();
@@ -130,39 +283,309 @@ void MainWindow::OpenFile()
 
 	canvas->Initialize();
 	InitCanvas();
+	canvas->SetModified(recovered);
+
+	// The text archives are saved to the new file
+	projectPath = isProjectFile ? path : QString();
 
 	statusBar()->showMessage("OpenFile " + path);
 }
 
 void MainWindow::SaveFile()
+{
+	if (projectPath.isEmpty())
+	{
+		SaveFileAs();
+		return;
+	}
+
+	if (!journal->IsOpen())
+	{
+		SaveProject(projectPath);
+		return;
+	}
+
+	// The strokes are already in the journal, so only the commit record is written
+	try
+	{
+		journal->Commit();
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		journal->Close();
+		SaveProject(projectPath);
+		return;
+	}
+
+	statusBar()->showMessage("SaveFile " + projectPath);
+	canvas->SetModified(false);
+	CompactJournal();
+}
+
+void MainWindow::SaveFileAs()
 {
 	QFileDialog dialog;
 	dialog.setAcceptMode(QFileDialog::AcceptSave);
-	dialog.setNameFilter("Freestroke file (*.xml)");
+	dialog.setNameFilter("Freestroke file (*.fsp)");
+	dialog.setDefaultSuffix("fsp");
 	dialog.setWindowTitle("Select a file");
 	if (!dialog.exec())
 	{
 		return;
 	}
 
-	QString path = dialog.selectedFiles()[0];
-	
+	SaveProject(dialog.selectedFiles()[0]);
+}
+
+void MainWindow::SaveProject( const QString& path )
+{
+	// The compaction may still write the project file
+	compactionWatcher->waitForFinished();
+
 	// Convert proxy geometry path to relative one
 	QDir projectDir = QFileInfo(path).dir();
 
-	std::string absPath = canvas->proxyGeometryPath;
-	canvas->proxyGeometryPath = projectDir.relativeFilePath(QString::fromStdString(absPath)).toStdString();
-	
-	std::ofstream ofs(path.toStdString());
-	boost::archive::text_oarchive oa(ofs);
-
-	oa << *canvas;
+	ProjectInfo info;
+	info.proxyGeometryPath = projectDir.relativeFilePath(QString::fromStdString(canvas->proxyGeometryPath)).toStdString();
+	info.canvasWidth = canvas->canvasWidth;
+	info.canvasHeight = canvas->canvasHeight;
+	info.saveID = NewSaveID();
 
-	canvas->proxyGeometryPath = absPath;
+	try
+	{
+		ProjectFile::Save(path, info, *canvas->strokeStore);
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		statusBar()->showMessage("Failed to save: " + QString(e.what()));
+		return;
+	}
 
-	ofs.close();
 	statusBar()->showMessage("SaveFile " + path);
 	canvas->SetModified(false);
+	if (projectPath.isEmpty())
+	{
+		// The strokes of the unsaved canvas are in the project now
+		RemoveUntitledAutosave();
+	}
+	projectPath = path;
+
+	// The new journal is based on the saved file.
+	// Without the journal the next save writes the whole file again.
+	try
+	{
+		if (journal->IsOpen())
+		{
+			// The strokes of the previous journal are in the saved file
+			journal->DiscardUncommitted();
+		}
+		journal->Create(StrokeJournal::GetPath(path), info.saveID);
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		journal->Close();
+		statusBar()->showMessage("Failed to create the journal: " + QString(e.what()));
+	}
+}
+
+void MainWindow::CompactJournal()
+{
+	if (compactionWatcher->isRunning() ||
+		journal->GetSize() < std::max(minCompactionSize, QFileInfo(projectPath).size() / 4))
+	{
+		return;
+	}
+
+	// The strokes are committed, so the snapshot is the state of the committed records
+	ProjectInfo info;
+	info.proxyGeometryPath = QFileInfo(projectPath).dir().relativeFilePath(QString::fromStdString(canvas->proxyGeometryPath)).toStdString();
+	info.canvasWidth = canvas->canvasWidth;
+	info.canvasHeight = canvas->canvasHeight;
+	info.saveID = NewSaveID();
+	info.compactedJournalID = journal->GetID();
+	info.compactedRecordNum = journal->GetCommittedRecordNum();
+
+	compactionJournalID = info.compactedJournalID;
+	compactionSaveID = info.saveID;
+	compactionRecordNum = info.compactedRecordNum;
+	compactionWatcher->setFuture(QtConcurrent::run(SaveSnapshot, projectPath, info, StrokeStore(*canvas->strokeStore)));
+}
+
+void MainWindow::OnCompactionFinished()
+{
+	QString error = compactionWatcher->result();
+	if (!error.isEmpty())
+	{
+		statusBar()->showMessage("Failed to compact the journal: " + error);
+		return;
+	}
+
+	// The journal may be replaced while compacting
+	if (!journal->IsOpen() || journal->GetID() != compactionJournalID)
+	{
+		return;
+	}
+
+	// The records made while compacting are moved to the new journal
+	try
+	{
+		journal->Rebase(compactionSaveID, compactionRecordNum);
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		statusBar()->showMessage("Failed to compact the journal: " + QString(e.what()));
+	}
+}
+
+void MainWindow::OnStrokeAdded()
+{
+	if (!journal->IsOpen())
+	{
+		return;
+	}
+
+	try
+	{
+		journal->AppendAdd(*canvas->strokeStore, canvas->strokeStore->GetStrokeNum() - 1);
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		journal->Close();
+		statusBar()->showMessage("Failed to write the journal: " + QString(e.what()));
+	}
+}
+
+void MainWindow::OnStrokeUndone()
+{
+	if (!journal->IsOpen())
+	{
+		return;
+	}
+
+	try
+	{
+		journal->AppendUndo();
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		journal->Close();
+		statusBar()->showMessage("Failed to write the journal: " + QString(e.what()));
+	}
+}
+
+void MainWindow::Autosave()
+{
+	// The journal already records the strokes of the saved project
+	if (!canvas || !canvas->IsModified() || journal->IsOpen() || autosaveWatcher->isRunning() ||
+		canvas->strokeStore->GetRevision() == autosaveRevision)
+	{
+		return;
+	}
+
+	autosavePath = GetAutosavePath(projectPath);
+	if (!QDir().mkpath(QFileInfo(autosavePath).absolutePath()))
+	{
+		statusBar()->showMessage("Failed to create the autosave directory for " + autosavePath);
+		return;
+	}
+
+	ProjectInfo info;
+	info.proxyGeometryPath = QFileInfo(autosavePath).dir().relativeFilePath(QString::fromStdString(canvas->proxyGeometryPath)).toStdString();
+	info.canvasWidth = canvas->canvasWidth;
+	info.canvasHeight = canvas->canvasHeight;
+
+	// Copying the store only shares the arrays.
+	// The canvas copies them when the strokes are modified while the snapshot is saved.
+	autosaveRevision = canvas->strokeStore->GetRevision();
+	autosaveWatcher->setFuture(QtConcurrent::run(SaveSnapshot, autosavePath, info, StrokeStore(*canvas->strokeStore)));
+}
+
+void MainWindow::OnAutosaveFinished()
+{
+	QString error = autosaveWatcher->result();
+	if (error.isEmpty())
+	{
+		statusBar()->showMessage("Autosaved " + autosavePath);
+	}
+	else
+	{
+		autosaveRevision = -1;
+		statusBar()->showMessage("Autosave failed: " + error);
+	}
+}
+
+QString MainWindow::GetAutosavePath( const QString& projectPath )
+{
+	// The autosave of the unsaved canvas is kept in the working directory
+	if (projectPath.isEmpty())
+	{
+		return QDir::current().absoluteFilePath("autosave/untitled.autosave.fsp");
+	}
+
+	QFileInfo info(projectPath);
+	return info.dir().absoluteFilePath(info.completeBaseName() + ".autosave.fsp");
+}
+
+void MainWindow::RecoverUntitledAutosave()
+{
+	// Left by the crash of the application while the canvas was not saved
+	QString path = GetAutosavePath(QString());
+	if (canvas || !QFileInfo(path).exists())
+	{
+		return;
+	}
+
+	int ret = QMessageBox::question(this, appTitle,
+		"An autosave of an unsaved canvas is found. Do you want to recover it?",
+		QMessageBox::Yes | QMessageBox::No | QMessageBox::Discard, QMessageBox::Yes);
+	if (ret == QMessageBox::Discard)
+	{
+		RemoveUntitledAutosave();
+		return;
+	}
+	if (ret != QMessageBox::Yes)
+	{
+		return;
+	}
+
+	journal->Close();
+	canvas = new Canvas;
+	try
+	{
+		ProjectInfo info;
+		ProjectFile::Load(path, info, *canvas->strokeStore);
+		canvas->proxyGeometryPath = QFileInfo(path).dir().absoluteFilePath(QString::fromStdString(info.proxyGeometryPath)).toStdString();
+		canvas->canvasWidth = info.canvasWidth;
+		canvas->canvasHeight = info.canvasHeight;
+	}
+	catch (const Exception& e)
+	{
+		if (e.Type() != Exception::FileError) throw;
+		SAFE_DELETE(canvas);
+		statusBar()->showMessage("Failed to recover: " + QString(e.what()));
+		return;
+	}
+
+	canvas->Initialize();
+	InitCanvas();
+
+	// The recovered canvas is still unsaved
+	canvas->SetModified(true);
+	projectPath.clear();
+	statusBar()->showMessage("Recovered " + path);
+}
+
+void MainWindow::RemoveUntitledAutosave()
+{
+	// The running autosave may write the file again
+	autosaveWatcher->waitForFinished();
+	QFile::remove(GetAutosavePath(QString()));
 }
 
 void MainWindow::About()
@@ -176,10 +599,45 @@ void MainWindow::Undo()
 	statusBar()->showMessage("Undo");
 }
 
-void MainWindow::OnUpdateFpsLabel(float fps)
+void MainWindow::ExportProfile()
+{
+	if (!canvas)
+	{
+		return;
+	}
+
+	QFileDialog dialog;
+	dialog.setAcceptMode(QFileDialog::AcceptSave);
+	dialog.setNameFilter("CSV file (*.csv)");
+	dialog.setWindowTitle("Select a file");
+	if (!dialog.exec())
+	{
+		return;
+	}
+
+	emit SaveProfile(dialog.selectedFiles()[0]);
+}
+
+void MainWindow::OnUpdateFrameTimeLabel(float frameTime)
 {
+	// FPS is the upper bound from the frame cost, not the actual redraw rate.
+	// The frame time is the CPU time; the GPU time is known only while the profiler is enabled.
 	QString str;
-	fpsLabel->setText(str.sprintf("FPS %.1f", fps));
+	if (gpuFrameTime < 0.0f)
+	{
+		fpsLabel->setText(str.sprintf("Frame CPU %.2f ms (FPS %.1f)", frameTime, 1000.0f / std::max(frameTime, 1e-3f)));
+	}
+	else
+	{
+		float cost = std::max(frameTime, gpuFrameTime);
+		fpsLabel->setText(str.sprintf("Frame CPU %.2f ms GPU %.2f ms (FPS %.1f)", frameTime, gpuFrameTime, 1000.0f / std::max(cost, 1e-3f)));
+	}
+}
+
+void MainWindow::OnUpdateGpuFrameTime(float gpuTime)
+{
+	// Shown with the next frame time
+	gpuFrameTime = gpuTime;
 }
 
 void MainWindow::CreateAction()
@@ -200,6 +658,11 @@ void MainWindow::CreateAction()
 	saveFileAction->setStatusTip("Save canvas");
 	connect(saveFileAction, SIGNAL(triggered()), this, SLOT(SaveFile()));
 
+	saveFileAsAction = new QAction("Save &As...", this);
+	saveFileAsAction->setShortcuts(QKeySequence::SaveAs);
+	saveFileAsAction->setStatusTip("Save canvas to a new file");
+	connect(saveFileAsAction, SIGNAL(triggered()), this, SLOT(SaveFileAs()));
+
 	exitAction = new QAction("E&xit", this);
 	exitAction->setShortcuts(QKeySequence::Quit);
 	exitAction->setStatusTip("Exit the application");
@@ -211,6 +674,15 @@ void MainWindow::CreateAction()
 	undoAction->setStatusTip("Undo");
 	connect(undoAction, SIGNAL(triggered()), this, SLOT(Undo()));
 
+	// View
+	profilerAction = new QAction("&Profiler", this);
+	profilerAction->setCheckable(true);
+	profilerAction->setStatusTip("Show the CPU and GPU time of the rendering stages");
+
+	exportProfileAction = new QAction("Export &Profile...", this);
+	exportProfileAction->setStatusTip("Export the recorded profile as CSV");
+	connect(exportProfileAction, SIGNAL(triggered()), this, SLOT(ExportProfile()));
+
 	// Help
 	aboutAction = new QAction("&About", this);
 	aboutAction->setStatusTip("About the application");
@@ -223,6 +695,10 @@ void MainWindow::CreateMenu()
 	fileMenu = menuBar()->addMenu("&File");
 	fileMenu->addAction(newFileAction);
 	fileMenu->addAction(openFileAction);
+	fileMenu->addAction(saveFileAction);
+	fileMenu->addAction(saveFileAsAction);
+	fileMenu->addSeparator();
+	fileMenu->addAction(exportProfileAction);
 	fileMenu->addSeparator();
 	fileMenu->addAction(exitAction);
 
@@ -232,6 +708,7 @@ void MainWindow::CreateMenu()
 
 	// View
 	viewMenu = menuBar()->addMenu("&View");
+	viewMenu->addAction(profilerAction);
 
 	// Help
 	helpMenu = menuBar()->addMenu("&Help");
@@ -337,11 +814,31 @@ int MainWindow::SaveOrDiscardChanges()
 	{
 		SaveFile();
 	}
+	else if (ret == QMessageBox::Discard && projectPath.isEmpty())
+	{
+		// The discarded canvas must not be recovered from the autosave
+		RemoveUntitledAutosave();
+	}
+	else if (ret == QMessageBox::Discard && journal->IsOpen())
+	{
+		// The discarded strokes must not be recovered from the journal
+		try
+		{
+			journal->DiscardUncommitted();
+		}
+		catch (const Exception& e)
+		{
+			if (e.Type() != Exception::FileError) throw;
+			journal->Close();
+		}
+	}
 	return ret;
 }
 
 void MainWindow::InitCanvas()
 {
+	autosaveRevision = -1;
+
 	// Undo
 	connect(this, SIGNAL(UndoStroke()), canvas, SLOT(OnUndoStroke()));
 
@@ -352,6 +849,21 @@ void MainWindow::InitCanvas()
 	connect(canvas, SIGNAL(StateChanged(unsigned int)), this, SLOT(OnCanvasStateChanged(unsigned int)));
 	connect(canvas, SIGNAL(StrokeStateChanged(int, int)), this, SLOT(OnStrokeStateChanged(int, int)));
 
+	// Journal
+	connect(canvas, SIGNAL(StrokeAdded()), this, SLOT(OnStrokeAdded()));
+	connect(canvas, SIGNAL(StrokeUndone()), this, SLOT(OnStrokeUndone()));
+
+	// Redraw requests
+	connect(canvas, SIGNAL(RedrawRequested()), glscene, SLOT(RequestRedraw()));
+	connect(canvas, SIGNAL(ContinuousRedrawChanged(bool)), glscene, SLOT(SetContinuousRedraw(bool)));
+
+	// Profiler
+	connect(this, SIGNAL(SaveProfile(QString)), canvas, SLOT(OnExportProfile(QString)));
+	connect(profilerAction, SIGNAL(toggled(bool)), canvas, SLOT(OnToggleProfiler(bool)));
+	connect(canvas, SIGNAL(ProfileUpdated(QString)), glscene, SLOT(SetOverlayText(QString)));
+	connect(canvas, SIGNAL(GpuFrameTimeUpdated(float)), this, SLOT(OnUpdateGpuFrameTime(float)));
+	canvas->OnToggleProfiler(profilerAction->isChecked());
+
 	// Draw signal and event signals
 	connect(glscene, SIGNAL(DrawCanvas()), canvas, SLOT(OnDraw()));
 	connect(glscene, SIGNAL(KeyPressed(QKeyEvent*)), canvas, SLOT(OnKeyPressed(QKeyEvent*)));
@@ -369,9 +881,13 @@ void MainWindow::InitCanvas()
 	connect(canvasManipWidget, SIGNAL(ToggleStrokeLine(int)), canvas, SLOT(OnToggleStrokeLine(int)));
 	connect(canvasManipWidget, SIGNAL(ToggleCurrentStrokeLine(int)), canvas, SLOT(OnToggleCurrentStrokeLine(int)));
 	connect(canvasManipWidget, SIGNAL(ToggleProxyObjectCheckBox(int)), canvas, SLOT(OnToggleProxyObjectCheckBox(int)));
+	connect(canvasManipWidget, SIGNAL(ToggleOcclusionCulling(int)), canvas, SLOT(OnToggleOcclusionCulling(int)));
 	connect(canvasManipWidget, SIGNAL(ResetViewButtonClicked()), canvas, SLOT(OnResetViewButtonClicked()));
 	connect(canvasManipWidget, SIGNAL(ToggleBackground(int)), canvas, SLOT(OnToggleBackground(int)));
 	connect(canvasManipWidget, SIGNAL(ChangeBackgroundImage(QString)), canvas, SLOT(OnChangeBackgroundImage(QString)));
+	connect(canvasManipWidget, SIGNAL(RenderModeChanged(int)), canvas, SLOT(OnRenderModeChanged(int)));
+	connect(canvasManipWidget, SIGNAL(ParticleBackendChanged(int)), canvas, SLOT(OnParticleBackendChanged(int)));
+	connect(canvasManipWidget, SIGNAL(BenchmarkButtonClicked()), canvas, SLOT(OnBenchmarkParticleBackends()));
 
 	// Embedding tool
 	connect(embeddingToolWidget, SIGNAL(ToolChanged(int)), canvas, SLOT(OnToolChanged(int)));
@@ -389,6 +905,7 @@ void MainWindow::InitCanvas()
 
 	SetEnabledDockWidgets(true);
 	emit ResetDockWidgets();
+	glscene->RequestRedraw();
 }
 
 void MainWindow::SetEnabledDockWidgets( bool enable )
@@ -423,6 +940,8 @@ CanvasManipulatorWidget::CanvasManipulatorWidget( QWidget *parent /*= 0*/ )
 	strokeLineCheckBox = new QCheckBox("Stroke");
 	currentStrokeLineCheckBox = new QCheckBox("Current Stroke");
 	proxyObjectCheckBox = new QCheckBox("Proxy Object");
+	occlusionCullingCheckBox = new QCheckBox("Occlusion Culling");
+	occlusionCullingCheckBox->setToolTip("Approximate: the particles seen through the narrow openings of the proxy object may be culled");
 	gl1->addWidget(wireframeCheckBox, 0, 0);
 	gl1->addWidget(aabbCheckBox, 0, 1);
 	gl1->addWidget(gridCheckBox, 1, 0);
@@ -430,6 +949,7 @@ CanvasManipulatorWidget::CanvasManipulatorWidget( QWidget *parent /*= 0*/ )
 	gl1->addWidget(currentStrokeLineCheckBox, 2, 0);
 	gl1->addWidget(strokeLineCheckBox, 2, 1);
 	gl1->addWidget(proxyObjectCheckBox, 3, 0);
+	gl1->addWidget(occlusionCullingCheckBox, 3, 1);
 	particleCheckBox->setChecked(true);
 	currentStrokeLineCheckBox->setChecked(true);
 	proxyObjectCheckBox->setChecked(true);
@@ -440,6 +960,7 @@ CanvasManipulatorWidget::CanvasManipulatorWidget( QWidget *parent /*= 0*/ )
 	connect(strokeLineCheckBox, SIGNAL(stateChanged(int)), this, SIGNAL(ToggleStrokeLine(int)));
 	connect(currentStrokeLineCheckBox, SIGNAL(stateChanged(int)), this, SIGNAL(ToggleCurrentStrokeLine(int)));
 	connect(proxyObjectCheckBox, SIGNAL(stateChanged(int)), this, SIGNAL(ToggleProxyObjectCheckBox(int)));
+	connect(occlusionCullingCheckBox, SIGNAL(stateChanged(int)), this, SIGNAL(ToggleOcclusionCulling(int)));
 
 	// Reset view
 	QPushButton* resetViewButton = new QPushButton("Reset View");
@@ -457,10 +978,36 @@ CanvasManipulatorWidget::CanvasManipulatorWidget( QWidget *parent /*= 0*/ )
 	connect(backgroundCheckBox, SIGNAL(stateChanged(int)), this, SLOT(stateChanged_BackgroundCheckBox(int)));
 	connect(findBackgroundImageButton, SIGNAL(clicked()), this, SLOT(clicked_FindBackgroundImageButton()));
 
+	// Render mode
+	// The order of the items corresponds to Canvas::RenderMode.
+	QHBoxLayout* hl2 = new QHBoxLayout;
+	renderModeComboBox = new QComboBox;
+	renderModeComboBox->addItem("Sorted");
+	renderModeComboBox->addItem("Weighted OIT");
+	hl2->addWidget(new QLabel("Render Mode :"));
+	hl2->addWidget(renderModeComboBox);
+	connect(renderModeComboBox, SIGNAL(currentIndexChanged(int)), this, SIGNAL(RenderModeChanged(int)));
+
+	// Particle backend
+	// The order of the items corresponds to Canvas::ParticleBackend.
+	QHBoxLayout* hl3 = new QHBoxLayout;
+	particleBackendComboBox = new QComboBox;
+	particleBackendComboBox->addItem("Geometry Shader");
+	particleBackendComboBox->addItem("Point Sprite");
+	particleBackendComboBox->addItem("Instanced Quad");
+	QPushButton* benchmarkButton = new QPushButton("Benchmark");
+	hl3->addWidget(new QLabel("Particle :"));
+	hl3->addWidget(particleBackendComboBox);
+	hl3->addWidget(benchmarkButton);
+	connect(particleBackendComboBox, SIGNAL(currentIndexChanged(int)), this, SIGNAL(ParticleBackendChanged(int)));
+	connect(benchmarkButton, SIGNAL(clicked()), this, SIGNAL(BenchmarkButtonClicked()));
+
 	// Main layout
 	QVBoxLayout* layout = new QVBoxLayout;
 	layout->addLayout(gl1);
 	layout->addLayout(hl1);
+	layout->addLayout(hl2);
+	layout->addLayout(hl3);
 	layout->addWidget(resetViewButton);
 	layout->addStretch(0);
 	setLayout(layout);
@@ -485,8 +1032,11 @@ void CanvasManipulatorWidget::OnReset()
 	emit ToggleStrokeLine(strokeLineCheckBox->checkState());
 	emit ToggleCurrentStrokeLine(currentStrokeLineCheckBox->checkState());
 	emit ToggleProxyObjectCheckBox(proxyObjectCheckBox->checkState());
+	emit ToggleOcclusionCulling(occlusionCullingCheckBox->checkState());
 	emit ToggleBackground(backgroundCheckBox->checkState());
 	emit ChangeBackgroundImage(backgroundImagePath);
+	emit RenderModeChanged(renderModeComboBox->currentIndex());
+	emit ParticleBackendChanged(particleBackendComboBox->currentIndex());
 }
 
 void CanvasManipulatorWidget::stateChanged_BackgroundCheckBox( int state )
@@ -768,14 +1318,13 @@ PenToolWidget::PenToolWidget( QWidget* parent /*= 0*/ )
 	connect(colorSelectButton, SIGNAL(clicked()), this, SLOT(clicked_ColorSelectButton()));
 
 	// Brush view
-	Util::Get()->CreateBrushPathList();
+	Util::Get()->LoadBrushes();
 	QHBoxLayout* hl5 = new QHBoxLayout;
 	brushScene = new BrushScene(0);
 	for (int i = 0; i < Util::Get()->GetBrushNum(); i++)
 	{
 		int x = i % 4, y = i / 4;
-		QPixmap pixmap(Util::Get()->GetBrushPath(i));
-		pixmap = pixmap.scaled(QSize(30, 30));
+		QPixmap pixmap = QPixmap::fromImage(Util::Get()->GetBrushImage(i).scaled(QSize(30, 30)));
 		BrushRectItem* rectItem = new BrushRectItem(QRect(0, 0, 30, 30), i);
 		rectItem->setPen(QPen(Qt::lightGray));
 		rectItem->setBrush(QBrush(pixmap));
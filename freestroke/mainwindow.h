@@ -4,6 +4,7 @@
 class GraphicsView;
 class GLScene;
 class Canvas;
+class StrokeJournal;
 
 class CanvasManipulatorWidget;
 class EmbeddingToolWidget;
@@ -27,17 +28,27 @@ private slots:
 	void NewFile();
 	void OpenFile();
 	void SaveFile();
+	void SaveFileAs();
 	void About();
 	void Undo();
-	void OnUpdateFpsLabel(float fps);
+	void ExportProfile();
+	void OnUpdateFrameTimeLabel(float frameTime);
+	void OnUpdateGpuFrameTime(float gpuTime);
 	void OnCanvasStateChanged(unsigned int state);
 	void OnStatusMessage(QString mes);
 	void OnStrokeStateChanged(int strokeNum, int particleNum);
+	void Autosave();
+	void OnAutosaveFinished();
+	void RecoverUntitledAutosave();
+	void OnStrokeAdded();
+	void OnStrokeUndone();
+	void OnCompactionFinished();
 
 signals:
 
 	void ResetDockWidgets();
 	void UndoStroke();
+	void SaveProfile(QString path);
 
 protected:
 
@@ -53,14 +64,21 @@ private:
 	void CreateStatusBar();
 	void CreateDockWidget();
 	void SetEnabledDockWidgets(bool enable);
+	QString GetAutosavePath(const QString& projectPath);
+	void RemoveUntitledAutosave();
+	void SaveProject(const QString& path);
+	void CompactJournal();
 
 private:
 
 	QAction* newFileAction;
 	QAction* openFileAction;
 	QAction* saveFileAction;
+	QAction* saveFileAsAction;
 	QAction* exitAction;
 	QAction* undoAction;
+	QAction* exportProfileAction;
+	QAction* profilerAction;
 	QAction* aboutAction;
 	QMenu* fileMenu;
 	QMenu* editMenu;
@@ -71,6 +89,7 @@ private:
 
 	// Status bar info
 	QLabel* fpsLabel;
+	float gpuFrameTime;		//!< Negative if the profiler is disabled.
 	QLabel* canvasStateLabel;
 	QLabel* strokeStateLabel;
 
@@ -88,6 +107,23 @@ private:
 	GLScene* glscene;
 	Canvas* canvas;
 
+	// Autosave.
+	// The snapshot of the strokes is saved on a worker thread
+	// when the strokes are modified since the last autosave.
+	QString projectPath;
+	QTimer* autosaveTimer;
+	QFutureWatcher<QString>* autosaveWatcher;
+	QString autosavePath;
+	int autosaveRevision;
+
+	// Journal of the strokes next to the project file.
+	// The journal is compacted into the project file on a worker thread when it grows.
+	StrokeJournal* journal;
+	QFutureWatcher<QString>* compactionWatcher;
+	long long compactionJournalID;
+	long long compactionSaveID;
+	int compactionRecordNum;
+
 };
 
 /*!
@@ -119,9 +155,13 @@ signals:
 	void ToggleStrokeLine(int state);
 	void ToggleCurrentStrokeLine(int state);
 	void ToggleProxyObjectCheckBox(int state);
+	void ToggleOcclusionCulling(int state);
 	void ResetViewButtonClicked();
 	void ToggleBackground(int state);
 	void ChangeBackgroundImage(QString path);
+	void RenderModeChanged(int mode);
+	void ParticleBackendChanged(int backend);
+	void BenchmarkButtonClicked();
 
 private:
 
@@ -132,11 +172,15 @@ private:
 	QCheckBox* strokeLineCheckBox;
 	QCheckBox* currentStrokeLineCheckBox;
 	QCheckBox* proxyObjectCheckBox;
+	QCheckBox* occlusionCullingCheckBox;
 
 	QCheckBox* backgroundCheckBox;
 	QPushButton* findBackgroundImageButton;
 	QString backgroundImagePath;
 
+	QComboBox* renderModeComboBox;
+	QComboBox* particleBackendComboBox;
+
 };
 
 /*!
@@ -0,0 +1,351 @@
+#include "meshutil.h"
+
+namespace
+{
+
+	// Lexicographic order of the faces
+	struct FaceLess
+	{
+		bool operator()(const glm::ivec3& a, const glm::ivec3& b) const
+		{
+			if (a.x != b.x) return a.x < b.x;
+			if (a.y != b.y) return a.y < b.y;
+			return a.z < b.z;
+		}
+	};
+
+}
+
+void MeshUtil::ComputeVertexNormals( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, std::vector<glm::vec3>& normals )
+{
+	normals.assign(vertices.size(), glm::vec3(0.0f));
+
+	for (int i = 0; i < faces.size(); i++)
+	{
+		const glm::ivec3& f = faces[i];
+		glm::vec3 n = glm::cross(vertices[f.y] - vertices[f.x], vertices[f.z] - vertices[f.x]);
+		float len = glm::length(n);
+		if (len < 1e-20f)
+		{
+			// Degenerated face
+			continue;
+		}
+		n /= len;
+
+		for (int j = 0; j < 3; j++)
+		{
+			const glm::vec3& p = vertices[f[j]];
+			glm::vec3 e1 = vertices[f[(j + 1) % 3]] - p;
+			glm::vec3 e2 = vertices[f[(j + 2) % 3]] - p;
+			float l1 = glm::length(e1);
+			float l2 = glm::length(e2);
+			if (l1 < 1e-20f || l2 < 1e-20f)
+			{
+				continue;
+			}
+			float angle = glm::acos(glm::clamp(glm::dot(e1, e2) / (l1 * l2), -1.0f, 1.0f));
+			normals[f[j]] += n * angle;
+		}
+	}
+
+	for (int i = 0; i < normals.size(); i++)
+	{
+		float len = glm::length(normals[i]);
+		normals[i] = len > 0.0f ? normals[i] / len : glm::vec3(0.0f, 0.0f, 1.0f);
+	}
+}
+
+void MeshUtil::OptimizeVertexCache( std::vector<glm::ivec3>& faces, int vertexNum, int cacheSize )
+{
+	int faceNum = faces.size();
+
+	// Vertex-face adjacency in the compressed form
+	std::vector<int> adjacencyBegin(vertexNum + 1, 0);
+	for (int i = 0; i < faceNum; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			adjacencyBegin[faces[i][j] + 1]++;
+		}
+	}
+	for (int v = 0; v < vertexNum; v++)
+	{
+		adjacencyBegin[v + 1] += adjacencyBegin[v];
+	}
+
+	std::vector<int> adjacency(adjacencyBegin[vertexNum]);
+	std::vector<int> fill(adjacencyBegin.begin(), adjacencyBegin.end() - 1);
+	for (int i = 0; i < faceNum; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			adjacency[fill[faces[i][j]]++] = i;
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	// Number of the faces not emitted yet around each vertex
+	std::vector<int> liveNums(vertexNum);
+	for (int v = 0; v < vertexNum; v++)
+	{
+		liveNums[v] = adjacencyBegin[v + 1] - adjacencyBegin[v];
+	}
+
+	std::vector<int> timeStamps(vertexNum, 0);
+	std::vector<unsigned char> emitted(faceNum, 0);
+	std::vector<int> deadEnds;
+	std::vector<int> candidates;
+	std::vector<glm::ivec3> result;
+	result.reserve(faceNum);
+
+	int fanningVertex = 0;
+	int time = cacheSize + 1;
+	int cursor = 0;
+
+	while (fanningVertex >= 0)
+	{
+		// Emit all faces around the fanning vertex
+		candidates.clear();
+		for (int k = adjacencyBegin[fanningVertex]; k < adjacencyBegin[fanningVertex + 1]; k++)
+		{
+			int face = adjacency[k];
+			if (emitted[face]) continue;
+
+			result.push_back(faces[face]);
+			emitted[face] = 1;
+
+			for (int j = 0; j < 3; j++)
+			{
+				int v = faces[face][j];
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				liveNums[v]--;
+				if (time - timeStamps[v] > cacheSize)
+				{
+					timeStamps[v] = time++;
+				}
+			}
+		}
+
+		// The next fanning vertex is the one staying in the cache longest
+		// after its remaining faces are emitted
+		fanningVertex = -1;
+		int bestPriority = -1;
+		for (int k = 0; k < candidates.size(); k++)
+		{
+			int v = candidates[k];
+			if (liveNums[v] <= 0) continue;
+
+			int priority = 0;
+			if (time - timeStamps[v] + 2 * liveNums[v] <= cacheSize)
+			{
+				priority = time - timeStamps[v];
+			}
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanningVertex = v;
+			}
+		}
+
+		// Dead end: go back to the recently used vertices, then to the remaining vertices in order
+		while (fanningVertex < 0 && !deadEnds.empty())
+		{
+			int v = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveNums[v] > 0) fanningVertex = v;
+		}
+		while (fanningVertex < 0 && cursor < vertexNum)
+		{
+			if (liveNums[cursor] > 0) fanningVertex = cursor;
+			cursor++;
+		}
+	}
+
+	faces.swap(result);
+}
+
+float MeshUtil::ComputeACMR( const std::vector<glm::ivec3>& faces, int vertexNum, int cacheSize )
+{
+	if (faces.empty())
+	{
+		return 0.0f;
+	}
+
+	// FIFO cache: the vertex is in the cache if it entered within the last cacheSize misses
+	std::vector<int> entered(vertexNum, INT_MIN / 2);
+	int misses = 0;
+	for (int i = 0; i < faces.size(); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			int v = faces[i][j];
+			if (misses - entered[v] >= cacheSize)
+			{
+				entered[v] = misses++;
+			}
+		}
+	}
+
+	return (float)misses / (float)faces.size();
+}
+
+void MeshUtil::Simplify( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, float cellSize, std::vector<glm::vec3>& simplifiedVertices, std::vector<glm::ivec3>& simplifiedFaces )
+{
+	simplifiedVertices.clear();
+	simplifiedFaces.clear();
+	if (vertices.empty())
+	{
+		return;
+	}
+
+	glm::vec3 minPos = vertices[0];
+	for (int i = 1; i < vertices.size(); i++)
+	{
+		minPos = glm::min(minPos, vertices[i]);
+	}
+
+	// Assign the vertices to the cells.
+	// The cell coordinates are packed into 21 bits each.
+	boost::unordered_map<unsigned long long, int> cellMap;
+	std::vector<glm::ivec3> cells;
+	std::vector<int> vertexClusters(vertices.size());
+	for (int i = 0; i < vertices.size(); i++)
+	{
+		glm::ivec3 cell = glm::ivec3((vertices[i] - minPos) / cellSize);
+		unsigned long long key =
+			((unsigned long long)cell.x << 42) |
+			((unsigned long long)cell.y << 21) |
+			(unsigned long long)cell.z;
+		boost::unordered_map<unsigned long long, int>::iterator it = cellMap.find(key);
+		if (it == cellMap.end())
+		{
+			it = cellMap.insert(std::make_pair(key, (int)cells.size())).first;
+			cells.push_back(cell);
+		}
+		vertexClusters[i] = it->second;
+	}
+
+	// ------------------------------------------------------------
+
+	// Accumulate the area weighted quadrics of the face planes and the vertex positions.
+	// The symmetric 4x4 quadric is stored as the 10 coefficients in double precision.
+	int clusterNum = cells.size();
+	std::vector<double> quadrics(clusterNum * 10, 0.0);
+	std::vector<glm::dvec3> positionSums(clusterNum, glm::dvec3(0.0));
+	std::vector<int> positionNums(clusterNum, 0);
+
+	for (int i = 0; i < vertices.size(); i++)
+	{
+		positionSums[vertexClusters[i]] += glm::dvec3(vertices[i]);
+		positionNums[vertexClusters[i]]++;
+	}
+
+	for (int i = 0; i < faces.size(); i++)
+	{
+		const glm::ivec3& f = faces[i];
+		glm::dvec3 v0(vertices[f.x]);
+		glm::dvec3 n = glm::cross(glm::dvec3(vertices[f.y]) - v0, glm::dvec3(vertices[f.z]) - v0);
+		double len = glm::length(n);
+		if (len < 1e-30)
+		{
+			continue;
+		}
+
+		// Plane (n, d) weighted by the area
+		double area = len * 0.5;
+		n /= len;
+		double p[4] = { n.x, n.y, n.z, -glm::dot(n, v0) };
+		double q[10] = {
+			p[0] * p[0], p[0] * p[1], p[0] * p[2], p[0] * p[3],
+			p[1] * p[1], p[1] * p[2], p[1] * p[3],
+			p[2] * p[2], p[2] * p[3],
+			p[3] * p[3] };
+
+		for (int j = 0; j < 3; j++)
+		{
+			double* dest = &quadrics[vertexClusters[f[j]] * 10];
+			for (int k = 0; k < 10; k++)
+			{
+				dest[k] += area * q[k];
+			}
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	// Representative vertices minimizing the quadric errors.
+	// The mean position is used if the quadric is singular, e.g. for the flat regions.
+	std::vector<glm::vec3> representatives(clusterNum);
+	for (int c = 0; c < clusterNum; c++)
+	{
+		const double* q = &quadrics[c * 10];
+		glm::dvec3 mean = positionSums[c] / (double)positionNums[c];
+		glm::dvec3 x = mean;
+
+		// Solve A x = -b with Cramer's rule
+		double a00 = q[0], a01 = q[1], a02 = q[2];
+		double a11 = q[4], a12 = q[5];
+		double a22 = q[7];
+		double b0 = -q[3], b1 = -q[6], b2 = -q[8];
+		double c00 = a11 * a22 - a12 * a12;
+		double c01 = a02 * a12 - a01 * a22;
+		double c02 = a01 * a12 - a02 * a11;
+		double det = a00 * c00 + a01 * c01 + a02 * c02;
+		double trace = a00 + a11 + a22;
+		if (glm::abs(det) > 1e-6 * trace * trace * trace)
+		{
+			double c11 = a00 * a22 - a02 * a02;
+			double c12 = a01 * a02 - a00 * a12;
+			double c22 = a00 * a11 - a01 * a01;
+			x = glm::dvec3(
+				c00 * b0 + c01 * b1 + c02 * b2,
+				c01 * b0 + c11 * b1 + c12 * b2,
+				c02 * b0 + c12 * b1 + c22 * b2) / det;
+		}
+
+		glm::vec3 cellMin = minPos + glm::vec3(cells[c]) * cellSize;
+		representatives[c] = glm::clamp(glm::vec3(x), cellMin, cellMin + glm::vec3(cellSize));
+	}
+
+	// ------------------------------------------------------------
+
+	// Keep the faces spanning three clusters.
+	// The faces are rotated to start with the smallest index keeping the orientation,
+	// so the duplicated faces are removed by sorting.
+	std::vector<glm::ivec3> clusterFaces;
+	for (int i = 0; i < faces.size(); i++)
+	{
+		glm::ivec3 f(vertexClusters[faces[i].x], vertexClusters[faces[i].y], vertexClusters[faces[i].z]);
+		if (f.x == f.y || f.y == f.z || f.z == f.x)
+		{
+			continue;
+		}
+		while (f.x > f.y || f.x > f.z)
+		{
+			f = glm::ivec3(f.y, f.z, f.x);
+		}
+		clusterFaces.push_back(f);
+	}
+
+	std::sort(clusterFaces.begin(), clusterFaces.end(), FaceLess());
+	clusterFaces.erase(std::unique(clusterFaces.begin(), clusterFaces.end()), clusterFaces.end());
+
+	// Compact the vertices referenced by the faces
+	std::vector<int> remap(clusterNum, -1);
+	simplifiedFaces.resize(clusterFaces.size());
+	for (int i = 0; i < clusterFaces.size(); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			int& r = remap[clusterFaces[i][j]];
+			if (r < 0)
+			{
+				r = simplifiedVertices.size();
+				simplifiedVertices.push_back(representatives[clusterFaces[i][j]]);
+			}
+			simplifiedFaces[i][j] = r;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __MESH_UTIL_H__
+#define __MESH_UTIL_H__
+
+/*!
+	Mesh utility.
+	The operations on the indexed triangle meshes used to prepare the proxy object for rendering.
+*/
+class MeshUtil
+{
+private:
+
+	MeshUtil() {}
+	DISALLOW_COPY_AND_ASSIGN(MeshUtil);
+
+public:
+
+	/*!
+		Angle-weighted vertex normals.
+		Each face normal is weighted by the angle of the face at the vertex,
+		so the normal does not depend on the tessellation of the surrounding faces.
+	*/
+	static void ComputeVertexNormals(
+		const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces,
+		std::vector<glm::vec3>& normals);
+
+	/*!
+		Vertex cache optimization.
+		Reorders the faces for the post-transform vertex cache
+		with Tipsify [Sander et al. 2007]. The algorithm fans around the vertices
+		which are likely still in the cache of the given size, and runs in linear time.
+	*/
+	static void OptimizeVertexCache(std::vector<glm::ivec3>& faces, int vertexNum, int cacheSize);
+
+	/*!
+		Average cache miss ratio.
+		Number of the vertex shader invocations per triangle simulated with the FIFO cache.
+		The value is between 0.5 (ideal for large regular meshes) and 3.0.
+	*/
+	static float ComputeACMR(const std::vector<glm::ivec3>& faces, int vertexNum, int cacheSize);
+
+	/*!
+		Quadric error simplification.
+		Simplifies the mesh by the vertex clustering on the uniform grid of the given cell size.
+		The representative vertex of each cell minimizes the sum of the quadric errors
+		[Garland and Heckbert 1997] of the faces around the vertices in the cell [Lindstrom 2000],
+		and is clamped to the cell, so the vertices move at most the cell diagonal.
+		The faces collapsed by the clustering are removed.
+		The algorithm runs in linear time and is suitable for the scans of millions of faces.
+	*/
+	static void Simplify(
+		const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, float cellSize,
+		std::vector<glm::vec3>& simplifiedVertices, std::vector<glm::ivec3>& simplifiedFaces);
+
+};
+
+#endif // __MESH_UTIL_H__
@@ -1,6 +1,7 @@
 #include "model.h"
 #include "gllib.h"
 #include "util.h"
+#include "meshutil.h"
 
 #include <CGAL/Simple_cartesian.h>
 #include <CGAL/AABB_tree.h>
@@ -22,14 +23,41 @@ public:
 
 	Impl(const std::string& path, float size);
 	~Impl();
-	void Draw();
+	void Draw(const glm::vec3& camPos, float pixelScale, float minDepth);
 	void DrawAABB();
 	glm::vec3 ClosestPoint(const glm::vec3& p, glm::vec3& normal);
-	glm::vec3 ClosestPointAABB(const glm::vec3& p, glm::vec3& normal);
-	float Distance(const glm::vec3 p, glm::vec3& normal);
+	glm::vec3 ClosestPointAABB(const glm::vec3& p, glm::vec3& normal, float level);
+	float Distance(const glm::vec3 p, glm::vec3& normal, float level);
+	const std::vector<glm::vec3>& GetVertices() { return vertices; }
+	const std::vector<glm::ivec3>& GetFaces() { return faces; }
+	const std::vector<glm::vec3>& GetOccluderVertices() { return occluderVertices; }
+	const std::vector<glm::ivec3>& GetOccluderFaces() { return occluderFaces; }
+	float GetOccluderError() { return occluderError; }
 
 private:
 
+	/*!
+		Display level.
+		Mesh drawn when the error projects under the pixel tolerance.
+	*/
+	struct DisplayLevel
+	{
+		TriangleMesh* mesh;
+		int faceNum;
+		float error;		//!< Upper bound of the vertex displacement from the exact mesh.
+	};
+
+private:
+
+	void BuildDisplayLevels(int vertexCacheSize);
+	void BuildQueryMesh();
+	static void BuildTree(
+		const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces,
+		KTriList& triangles, AABBTriTree& tree);
+	static glm::vec3 ClosestPointTree(const AABBTriTree& tree, const glm::vec3& p, glm::vec3& normal);
+	static float MeasureDistanceBound(
+		const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, const AABBTriTree& tree);
+	static TriangleMesh* CreateMesh(const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces);
 	glm::vec3 ClosestPointTriangle(
 		const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
 
@@ -37,16 +65,33 @@ private:
 
 	std::vector<glm::vec3> vertices;
 	std::vector<glm::ivec3> faces;
-	TriangleMesh* mesh;
+	std::vector<DisplayLevel> displayLevels;
 	AABB* aabb;
 
+	// Finest display level within the face budget of the CPU rasterization,
+	// and the measured distance bound between its surface and the exact mesh
+	std::vector<glm::vec3> occluderVertices;
+	std::vector<glm::ivec3> occluderFaces;
+	float occluderError;
+
 	KTriList triangles;
 	AABBTriTree aabbTree;
 
+	// Simplified query mesh and the Hausdorff distance bound to the exact mesh.
+	// Not built for the small meshes (coarseError < 0).
+	KTriList coarseTriangles;
+	AABBTriTree coarseTree;
+	float coarseError;
+
 };
 
 ObjModel::Impl::Impl( const std::string& path, float size )
+	: occluderError(0.0f)
+	, coarseError(-1.0f)
 {
+	// Number of the entries of the simulated post-transform vertex cache
+	const int vertexCacheSize = 16;
+
 	// Open file
 	std::ifstream ifs(path, std::ios::in);
 	if (!ifs)
@@ -119,50 +164,253 @@ ObjModel::Impl::Impl( const std::string& path, float size )
 
 	// Construct AABB tree
 	Util::Get()->ShowStatusMessage("Constructing AABB tree");
+	BuildTree(vertices, faces, triangles, aabbTree);
+	BuildQueryMesh();
+	Util::Get()->ShowStatusMessage("AABB tree is constructed; creating GL triangle mesh");
+
+	// ------------------------------------------------------------
+
+	// Reorder the faces for the post-transform vertex cache.
+	// The order of the faces does not matter for the other uses.
+	float acmr = MeshUtil::ComputeACMR(faces, vertices.size(), vertexCacheSize);
+	MeshUtil::OptimizeVertexCache(faces, vertices.size(), vertexCacheSize);
+	Util::Get()->ShowStatusMessage(QString().sprintf(
+		"Optimized vertex cache; ACMR %.3f -> %.3f",
+		acmr, MeshUtil::ComputeACMR(faces, vertices.size(), vertexCacheSize)));
+
+	BuildDisplayLevels(vertexCacheSize);
+}
+
+ObjModel::Impl::~Impl()
+{
+	SAFE_DELETE(aabb);
+	for (int i = 0; i < displayLevels.size(); i++)
+	{
+		SAFE_DELETE(displayLevels[i].mesh);
+	}
+}
+
+void ObjModel::Impl::BuildDisplayLevels( int vertexCacheSize )
+{
+	// The exact mesh is drawn only if it is small enough.
+	// The coarser levels have at most a half of the faces of the previous level.
+	const int maxDisplayFaceNum = 1 << 20;
+	const int minDisplayFaceNum = 1000;
+	const int maxDisplayLevelNum = 4;
+	const int gridResolution = 1024;
+	const int maxOccluderFaceNum = 1 << 16;
+
+	if (faces.size() <= maxDisplayFaceNum)
+	{
+		DisplayLevel level;
+		level.mesh = CreateMesh(vertices, faces);
+		level.faceNum = faces.size();
+		level.error = 0.0f;
+		displayLevels.push_back(level);
+	}
+
+	float cellSize = glm::max(aabb->max.x - aabb->min.x,
+		glm::max(aabb->max.y - aabb->min.y, aabb->max.z - aabb->min.z)) / (float)gridResolution;
+	int prevFaceNum = faces.size();
+	std::vector<glm::vec3> simplifiedVertices;
+	std::vector<glm::ivec3> simplifiedFaces;
+
+	// Each level is simplified from the previous accepted level instead of the exact mesh,
+	// so the cost decreases with the levels. The vertex displacements accumulate over the levels.
+	std::vector<glm::vec3> sourceVertices(vertices);
+	std::vector<glm::ivec3> sourceFaces(faces);
+	float sourceError = 0.0f;
+	if (faces.size() <= maxOccluderFaceNum)
+	{
+		occluderVertices = vertices;
+		occluderFaces = faces;
+	}
+
+	while (displayLevels.size() < maxDisplayLevelNum && prevFaceNum > minDisplayFaceNum)
+	{
+		Util::Get()->ShowStatusMessage(QString().sprintf("Simplifying the display mesh; cell size %g", cellSize));
+		MeshUtil::Simplify(sourceVertices, sourceFaces, cellSize, simplifiedVertices, simplifiedFaces);
+		if (simplifiedFaces.empty())
+		{
+			break;
+		}
+
+		int faceNum = simplifiedFaces.size();
+		if (faceNum <= maxDisplayFaceNum && faceNum * 2 <= prevFaceNum)
+		{
+			MeshUtil::OptimizeVertexCache(simplifiedFaces, simplifiedVertices.size(), vertexCacheSize);
+
+			DisplayLevel level;
+			level.mesh = CreateMesh(simplifiedVertices, simplifiedFaces);
+			level.faceNum = faceNum;
+			level.error = sourceError + cellSize * glm::sqrt(3.0f);
+			displayLevels.push_back(level);
+			prevFaceNum = faceNum;
+
+			sourceVertices.swap(simplifiedVertices);
+			sourceFaces.swap(simplifiedFaces);
+			sourceError = level.error;
+
+			if (occluderFaces.empty() && faceNum <= maxOccluderFaceNum)
+			{
+				occluderVertices = sourceVertices;
+				occluderFaces = sourceFaces;
+				occluderError = sourceError;
+			}
+		}
+
+		cellSize *= 2.0f;
+	}
+
+	// The coarsest level is used if no level is within the budget
+	if (occluderFaces.empty())
+	{
+		occluderVertices.swap(sourceVertices);
+		occluderFaces.swap(sourceFaces);
+		occluderError = sourceError;
+	}
+
+	// The accumulated vertex displacement does not bound the distance between the surfaces,
+	// since the clustering closes the gaps and the thin cavities.
+	// The distance is measured in the both directions as for the query mesh.
+	if (occluderError > 0.0f)
+	{
+		Util::Get()->ShowStatusMessage("Measuring the error of the occluder mesh");
+		KTriList occluderTriangles;
+		AABBTriTree occluderTree;
+		BuildTree(occluderVertices, occluderFaces, occluderTriangles, occluderTree);
+		occluderError = glm::max(
+			MeasureDistanceBound(vertices, faces, occluderTree),
+			MeasureDistanceBound(occluderVertices, occluderFaces, aabbTree));
+	}
+
+	// Fallback for the meshes which cannot be simplified
+	if (displayLevels.empty())
+	{
+		DisplayLevel level;
+		level.mesh = CreateMesh(vertices, faces);
+		level.faceNum = faces.size();
+		level.error = 0.0f;
+		displayLevels.push_back(level);
+	}
+
+	QString message = "Display levels:";
+	for (int i = 0; i < displayLevels.size(); i++)
+	{
+		message += QString().sprintf(" %d", displayLevels[i].faceNum);
+	}
+	Util::Get()->ShowStatusMessage(message + " faces");
+}
+
+void ObjModel::Impl::BuildQueryMesh()
+{
+	// The query mesh is built only for the large meshes,
+	// and used only if it has at most a quarter of the faces.
+	const int minQueryFaceNum = 1 << 16;
+	const int gridResolution = 256;
+
+	if (faces.size() < minQueryFaceNum)
+	{
+		return;
+	}
+
+	Util::Get()->ShowStatusMessage("Simplifying the query mesh");
+	float cellSize = glm::max(aabb->max.x - aabb->min.x,
+		glm::max(aabb->max.y - aabb->min.y, aabb->max.z - aabb->min.z)) / (float)gridResolution;
+	std::vector<glm::vec3> coarseVertices;
+	std::vector<glm::ivec3> coarseFaces;
+	MeshUtil::Simplify(vertices, faces, cellSize, coarseVertices, coarseFaces);
+	if (coarseFaces.empty() || coarseFaces.size() * 4 > faces.size())
+	{
+		return;
+	}
+
+	// The faces collapsed by the clustering vanish, so the cell size does not bound the distance.
+	// The Hausdorff distance is measured instead in the both directions,
+	// since the distances to the two meshes differ at most by it.
+	BuildTree(coarseVertices, coarseFaces, coarseTriangles, coarseTree);
+	Util::Get()->ShowStatusMessage("Measuring the error of the query mesh");
+	coarseError = glm::max(
+		MeasureDistanceBound(vertices, faces, coarseTree),
+		MeasureDistanceBound(coarseVertices, coarseFaces, aabbTree));
+	Util::Get()->ShowStatusMessage(QString().sprintf(
+		"Query mesh: %d faces; error bound %g", (int)coarseFaces.size(), coarseError));
+}
+
+void ObjModel::Impl::BuildTree( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, KTriList& triangles, AABBTriTree& tree )
+{
+	triangles.clear();
+	triangles.reserve(faces.size());
 	for (int i = 0; i < faces.size(); i++)
 	{
-		glm::vec3& v0 = vertices[faces[i].x];
-		glm::vec3& v1 = vertices[faces[i].y];
-		glm::vec3& v2 = vertices[faces[i].z];
+		const glm::vec3& v0 = vertices[faces[i].x];
+		const glm::vec3& v1 = vertices[faces[i].y];
+		const glm::vec3& v2 = vertices[faces[i].z];
 		triangles.push_back(K::Triangle_3(
 			K::Point_3(v0.x, v0.y, v0.z),
 			K::Point_3(v1.x, v1.y, v1.z),
 			K::Point_3(v2.x, v2.y, v2.z)));
 	}
-	aabbTree.rebuild(triangles.begin(), triangles.end());
-	aabbTree.accelerate_distance_queries();
-	Util::Get()->ShowStatusMessage("AABB tree is constructed; creating GL triangle mesh");
+	tree.rebuild(triangles.begin(), triangles.end());
+	tree.accelerate_distance_queries();
+}
 
-	// ------------------------------------------------------------
+float ObjModel::Impl::MeasureDistanceBound( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces, const AABBTriTree& tree )
+{
+	// Upper bound of the distance from the points of the faces to the tree.
+	// The distance is sampled at the vertices and the edge midpoints of each face.
+	// Every point of a triangle is within 1/sqrt(3) of the longest edge from a vertex,
+	// and the distance function is 1-Lipschitz, so the samples of the four midpoint subtriangles
+	// bound the distance over the face with the half of that margin.
+	const float marginScale = 0.5f / glm::sqrt(3.0f);
+
+	int n = faces.size();
+	std::vector<float> faceBounds(n);
+
+#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		const glm::vec3& v0 = vertices[faces[i].x];
+		const glm::vec3& v1 = vertices[faces[i].y];
+		const glm::vec3& v2 = vertices[faces[i].z];
+		glm::vec3 samples[6] = { v0, v1, v2, (v0 + v1) * 0.5f, (v1 + v2) * 0.5f, (v2 + v0) * 0.5f };
 
-	// Create mesh for GL rendering
-	mesh = new TriangleMesh;
-	mesh->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
-	mesh->AddAttribute(VertexStream::NORMAL, sizeof(glm::vec3));
-	mesh->Begin();
-	int index = 0;
-	for (int i = 0; i < faces.size(); i++)
+		float maxd2 = 0.0f;
+		for (int j = 0; j < 6; j++)
+		{
+			float d2 = (float)tree.squared_distance(K::Point_3(samples[j].x, samples[j].y, samples[j].z));
+			maxd2 = glm::max(maxd2, d2);
+		}
+
+		float maxEdge2 = glm::max(glm::distance2(v0, v1), glm::max(glm::distance2(v1, v2), glm::distance2(v2, v0)));
+		faceBounds[i] = glm::sqrt(maxd2) + marginScale * glm::sqrt(maxEdge2);
+	}
+
+	float bound = 0.0f;
+	for (int i = 0; i < n; i++)
 	{
-		glm::vec3& v0 = vertices[faces[i].x];
-		glm::vec3& v1 = vertices[faces[i].y];
-		glm::vec3& v2 = vertices[faces[i].z];
-		glm::vec3 normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
-		mesh->AddVertex(VertexStream::POSITION, v0);
-		mesh->AddVertex(VertexStream::POSITION, v1);
-		mesh->AddVertex(VertexStream::POSITION, v2);
-		mesh->AddVertex(VertexStream::NORMAL, normal);
-		mesh->AddVertex(VertexStream::NORMAL, normal);
-		mesh->AddVertex(VertexStream::NORMAL, normal);
-		mesh->AddIndex(index, index + 1, index + 2);
-		index += 3;
+		bound = glm::max(bound, faceBounds[i]);
 	}
-	mesh->End();
+	return bound;
 }
 
-ObjModel::Impl::~Impl()
+TriangleMesh* ObjModel::Impl::CreateMesh( const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& faces )
 {
-	SAFE_DELETE(aabb);
-	SAFE_DELETE(mesh);
+	// Indexed mesh for GL rendering.
+	// The vertices are shared by the faces with the angle-weighted normals.
+	std::vector<glm::vec3> normals;
+	MeshUtil::ComputeVertexNormals(vertices, faces, normals);
+
+	TriangleMesh* mesh = new TriangleMesh;
+	mesh->AddAttribute(VertexStream::POSITION, sizeof(glm::vec3));
+	mesh->AddAttribute(VertexStream::NORMAL, sizeof(glm::vec3));
+	mesh->Reserve(vertices.size(), faces.size() * 3);
+	mesh->Begin();
+	mesh->AddVertex(VertexStream::POSITION, glm::value_ptr(vertices[0]), vertices.size() * 3);
+	mesh->AddVertex(VertexStream::NORMAL, glm::value_ptr(normals[0]), normals.size() * 3);
+	mesh->AddIndex((const GLuint*)glm::value_ptr(faces[0]), faces.size() * 3);
+	mesh->End(GL_STATIC_DRAW, true);
+	return mesh;
 }
 
 glm::vec3 ObjModel::Impl::ClosestPoint( const glm::vec3& p, glm::vec3& normal )
@@ -185,14 +433,29 @@ glm::vec3 ObjModel::Impl::ClosestPoint( const glm::vec3& p, glm::vec3& normal )
 	return minp;
 }
 
-void ObjModel::Impl::Draw()
+void ObjModel::Impl::Draw( const glm::vec3& camPos, float pixelScale, float minDepth )
 {
-	mesh->Draw();
+	// Projected error tolerance in pixels
+	const float maxPixelError = 1.0f;
+
+	// The nearest point of the bounding sphere determines the level
+	glm::vec3 center = (aabb->min + aabb->max) * 0.5f;
+	float radius = glm::distance(aabb->min, aabb->max) * 0.5f;
+	float depth = glm::max(glm::distance(camPos, center) - radius, minDepth);
+
+	int level = 0;
+	while (level + 1 < displayLevels.size() &&
+		displayLevels[level + 1].error * pixelScale / depth <= maxPixelError)
+	{
+		level++;
+	}
+	displayLevels[level].mesh->Draw();
 }
 
-float ObjModel::Impl::Distance( const glm::vec3 p, glm::vec3& normal )
+float ObjModel::Impl::Distance( const glm::vec3 p, glm::vec3& normal, float level )
 {
-	return glm::distance(p, ClosestPoint(p, normal));
+	// Same query as ClosestPoint() of the model instead of the linear search
+	return glm::distance(p, ClosestPointAABB(p, normal, level));
 }
 
 glm::vec3 ObjModel::Impl::ClosestPointTriangle( const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c )
@@ -262,10 +525,33 @@ void ObjModel::Impl::DrawAABB()
 	aabb->Draw();
 }
 
-glm::vec3 ObjModel::Impl::ClosestPointAABB( const glm::vec3& p, glm::vec3& normal )
+glm::vec3 ObjModel::Impl::ClosestPointAABB( const glm::vec3& p, glm::vec3& normal, float level )
+{
+	// Relative error of the distance allowed for the coarse query
+	const float maxRelativeError = 0.1f;
+
+	// The distances to the two meshes differ at most by the error bound,
+	// so the coarse mesh is used if the bound is small relative to the distance,
+	// e.g. for the points of the hair and feather strokes floating above the surface.
+	// The query is routed before the search, with the level of the stroke
+	// or the distance to the bounding box, which is a lower bound of the distance to the mesh.
+	if (coarseError >= 0.0f)
+	{
+		glm::vec3 d = glm::max(glm::max(aabb->min - p, p - aabb->max), glm::vec3(0.0f));
+		float minDist = glm::max(level, glm::length(d));
+		if (coarseError <= maxRelativeError * minDist)
+		{
+			return ClosestPointTree(coarseTree, p, normal);
+		}
+	}
+
+	return ClosestPointTree(aabbTree, p, normal);
+}
+
+glm::vec3 ObjModel::Impl::ClosestPointTree( const AABBTriTree& tree, const glm::vec3& p, glm::vec3& normal )
 {
 	K::Point_3 point(p.x, p.y, p.z);
-	AABBTriTree::Point_and_primitive_id pp = aabbTree.closest_point_and_primitive(point);
+	AABBTriTree::Point_and_primitive_id pp = tree.closest_point_and_primitive(point);
 	AABBTriPrimitive::Id id = pp.second; // iterator
 	glm::vec3 v0(id->vertex(0).x(), id->vertex(0).y(), id->vertex(0).z());
 	glm::vec3 v1(id->vertex(1).x(), id->vertex(1).y(), id->vertex(1).z());
@@ -287,9 +573,9 @@ ObjModel::~ObjModel()
 
 }
 
-void ObjModel::Draw()
+void ObjModel::Draw( const glm::vec3& camPos, float pixelScale, float minDepth )
 {
-	pimpl->Draw();
+	pimpl->Draw(camPos, pixelScale, minDepth);
 }
 
 void ObjModel::DrawAABB()
@@ -297,16 +583,41 @@ void ObjModel::DrawAABB()
 	pimpl->DrawAABB();
 }
 
-glm::vec3 ObjModel::ClosestPoint( const glm::vec3& p, glm::vec3& normal )
+glm::vec3 ObjModel::ClosestPoint( const glm::vec3& p, glm::vec3& normal, float level )
 {
 #if 0
 	return pimpl->ClosestPoint(p, normal);
 #else
-	return pimpl->ClosestPointAABB(p, normal);
+	return pimpl->ClosestPointAABB(p, normal, level);
 #endif
 }
 
-float ObjModel::Distance( const glm::vec3 p, glm::vec3& normal )
+float ObjModel::Distance( const glm::vec3 p, glm::vec3& normal, float level )
+{
+	return pimpl->Distance(p, normal, level);
+}
+
+const std::vector<glm::vec3>& ObjModel::GetVertices()
+{
+	return pimpl->GetVertices();
+}
+
+const std::vector<glm::ivec3>& ObjModel::GetFaces()
+{
+	return pimpl->GetFaces();
+}
+
+const std::vector<glm::vec3>& ObjModel::GetOccluderVertices()
+{
+	return pimpl->GetOccluderVertices();
+}
+
+const std::vector<glm::ivec3>& ObjModel::GetOccluderFaces()
+{
+	return pimpl->GetOccluderFaces();
+}
+
+float ObjModel::GetOccluderError()
 {
-	return pimpl->Distance(p, normal);
+	return pimpl->GetOccluderError();
 }
@@ -5,6 +5,10 @@
 	Proxy object.
 	The class describes the proxy model and 
 	loads the Wavefront .obj file and construct related data structures.
+	The distance queries use the exact mesh near the surface and the simplified query mesh
+	at the level of the stroke (the expected distance from the surface) far enough for its error bound.
+	The proxy object is drawn with the simplified display mesh chosen by the projected size.
+	A display level of a bounded size is also kept on CPU as the occluder mesh.
 */
 class ObjModel
 {
@@ -12,10 +16,15 @@ public:
 
 	ObjModel(const std::string& path, float size);
 	~ObjModel();
-	void Draw();
+	void Draw(const glm::vec3& camPos, float pixelScale, float minDepth);
 	void DrawAABB();
-	glm::vec3 ClosestPoint(const glm::vec3& p, glm::vec3& normal);
-	float Distance(const glm::vec3 p, glm::vec3& normal);
+	glm::vec3 ClosestPoint(const glm::vec3& p, glm::vec3& normal, float level = 0.0f);
+	float Distance(const glm::vec3 p, glm::vec3& normal, float level = 0.0f);
+	const std::vector<glm::vec3>& GetVertices();
+	const std::vector<glm::ivec3>& GetFaces();
+	const std::vector<glm::vec3>& GetOccluderVertices();
+	const std::vector<glm::ivec3>& GetOccluderFaces();
+	float GetOccluderError();
 
 private:
 
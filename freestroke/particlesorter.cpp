@@ -0,0 +1,292 @@
+#include "particlesorter.h"
+#include <omp.h>
+
+namespace
+{
+
+	// Convert a float to the unsigned integer which preserves the order of the floats.
+	inline unsigned int FloatToSortableUInt(float f)
+	{
+		unsigned int u;
+		memcpy(&u, &f, sizeof(float));
+		unsigned int mask = (u & 0x80000000) ? 0xffffffff : 0x80000000;
+		return u ^ mask;
+	}
+
+	// Descending order of the keys
+	class KeyGreater
+	{
+	public:
+
+		KeyGreater(const std::vector<float>& keys)
+			: keys(keys)
+		{
+
+		}
+
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			return keys[a] > keys[b];
+		}
+
+	private:
+
+		const std::vector<float>& keys;
+
+	};
+
+}
+
+ParticleSorter::ParticleSorter()
+	: lastSortIncremental(false)
+{
+
+}
+
+void ParticleSorter::Invalidate()
+{
+	indices.clear();
+	sortedIds.clear();
+}
+
+void ParticleSorter::Sort( const std::vector<float>& keys, const std::vector<unsigned int>& ids, unsigned int idNum )
+{
+	// Upper bound of the average element moves in the insertion sort per particle.
+	// If the estimated disorder of the previous permutation is larger than the value
+	// or the insertion sort exceeds the budget, it falls back to the radix sort
+	// in order to keep the cost of the sorting near linear.
+	const int maxMovesPerParticle = 8;
+
+	lastSortIncremental = false;
+
+	if (keys.size() != ids.size())
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument,
+			(boost::format("Number of the keys %d differs from the IDs %d") % keys.size() % ids.size()).str());
+	}
+
+	// The previous order is not reused if most of the particles are new
+	int n = keys.size();
+	if (n > 0 && RemapPreviousOrder(ids, idNum) && (int)newIndices.size() <= n / 2)
+	{
+		// Try to fix the previous permutation, then merge the new particles
+		if (MeasureDisorder(keys) <= (float)maxMovesPerParticle && InsertionSort(keys, n * maxMovesPerParticle))
+		{
+			if (!newIndices.empty())
+			{
+				KeyGreater greater(keys);
+				std::sort(newIndices.begin(), newIndices.end(), greater);
+				indicesTemp.resize(n);
+				std::merge(indices.begin(), indices.end(), newIndices.begin(), newIndices.end(), indicesTemp.begin(), greater);
+				indices.swap(indicesTemp);
+			}
+			lastSortIncremental = true;
+		}
+	}
+
+	if (!lastSortIncremental)
+	{
+		RadixSort(keys);
+	}
+
+	sortedIds.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		sortedIds[i] = ids[indices[i]];
+	}
+}
+
+bool ParticleSorter::RemapPreviousOrder( const std::vector<unsigned int>& ids, unsigned int idNum )
+{
+	// Without the previous order the remapped permutation is meaningless
+	if (sortedIds.empty())
+	{
+		return false;
+	}
+
+	// The map is cleared after each use, so only the entries of the current particles are touched
+	if (idToIndex.size() < idNum)
+	{
+		idToIndex.resize(idNum, -1);
+	}
+
+	int n = ids.size();
+	for (int i = 0; i < n; i++)
+	{
+		if (ids[i] >= idNum || idToIndex[ids[i]] >= 0)
+		{
+			// Invalid or duplicated IDs; restore the map
+			for (int j = 0; j < i; j++)
+			{
+				idToIndex[ids[j]] = -1;
+			}
+			return false;
+		}
+		idToIndex[ids[i]] = i;
+	}
+
+	// The remaining particles in the previous order, and the new particles.
+	// The entries are cleared as they are consumed.
+	indices.clear();
+	newIndices.clear();
+	for (int i = 0; i < sortedIds.size(); i++)
+	{
+		unsigned int id = sortedIds[i];
+		if (id < idNum && idToIndex[id] >= 0)
+		{
+			indices.push_back(idToIndex[id]);
+			idToIndex[id] = -1;
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		if (idToIndex[ids[i]] >= 0)
+		{
+			newIndices.push_back(i);
+			idToIndex[ids[i]] = -1;
+		}
+	}
+
+	return true;
+}
+
+float ParticleSorter::MeasureDisorder( const std::vector<float>& keys )
+{
+	// Estimate the average number of the element moves in the insertion sort
+	// (number of inversions per particle) from the sampled particles.
+	// For each sample, count the preceding particles which must be placed after the sample.
+	const int sampleNum = 256;
+	const int maxScan = 64;
+
+	int n = indices.size();
+	if (n < 2) return 0.0f;
+
+	int step = std::max(1, n / sampleNum);
+	int samples = 0;
+	int moves = 0;
+	for (int i = 0; i < n; i += step)
+	{
+		float key = keys[indices[i]];
+		for (int j = i - 1; j >= 0 && j >= i - maxScan; j--)
+		{
+			if (keys[indices[j]] < key) moves++;
+		}
+		samples++;
+	}
+
+	return (float)moves / (float)samples;
+}
+
+bool ParticleSorter::InsertionSort( const std::vector<float>& keys, int maxMoves )
+{
+	int n = indices.size();
+	int moves = 0;
+	for (int i = 1; i < n; i++)
+	{
+		unsigned int index = indices[i];
+		float key = keys[index];
+		int j = i;
+		while (j > 0 && keys[indices[j-1]] < key)
+		{
+			indices[j] = indices[j-1];
+			j--;
+			moves++;
+		}
+		indices[j] = index;
+
+		// The permutation is still valid here, so the caller can safely discard it.
+		if (moves > maxMoves)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void ParticleSorter::RadixSort( const std::vector<float>& keys )
+{
+	// Below the number of the particles the sort is done in a single thread.
+	const int minParallelNum = 65536;
+
+	int n = keys.size();
+	indices.resize(n);
+	indicesTemp.resize(n);
+	radixKeys.resize(n);
+	radixKeysTemp.resize(n);
+	if (n == 0) return;
+
+	// Inverted keys are sorted in the ascending order,
+	// which results in the descending order of the original keys.
+#pragma omp parallel for if (n >= minParallelNum)
+	for (int i = 0; i < n; i++)
+	{
+		radixKeys[i] = ~FloatToSortableUInt(keys[i]);
+		indices[i] = i;
+	}
+
+	// The array is split into the contiguous blocks and each block has its own histogram.
+	// Scattering the blocks in order keeps the sort stable.
+	int blockNum = n >= minParallelNum ? omp_get_max_threads() : 1;
+	histograms.resize(blockNum * 256);
+
+	// LSD radix sort with 8-bit digits
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		std::fill(histograms.begin(), histograms.end(), 0);
+
+#pragma omp parallel for if (blockNum > 1)
+		for (int block = 0; block < blockNum; block++)
+		{
+			int* histogram = &histograms[block * 256];
+			int begin = (int)((long long)n * block / blockNum);
+			int end = (int)((long long)n * (block + 1) / blockNum);
+			for (int i = begin; i < end; i++)
+			{
+				histogram[(radixKeys[i] >> shift) & 0xff]++;
+			}
+		}
+
+		// Skip the pass if all keys have the same digit
+		int firstDigit = (radixKeys[0] >> shift) & 0xff;
+		int firstDigitNum = 0;
+		for (int block = 0; block < blockNum; block++)
+		{
+			firstDigitNum += histograms[block * 256 + firstDigit];
+		}
+		if (firstDigitNum == n)
+		{
+			continue;
+		}
+
+		// Offsets of each digit of each block
+		int offset = 0;
+		for (int digit = 0; digit < 256; digit++)
+		{
+			for (int block = 0; block < blockNum; block++)
+			{
+				int& count = histograms[block * 256 + digit];
+				int tmp = count;
+				count = offset;
+				offset += tmp;
+			}
+		}
+
+#pragma omp parallel for if (blockNum > 1)
+		for (int block = 0; block < blockNum; block++)
+		{
+			int* histogram = &histograms[block * 256];
+			int begin = (int)((long long)n * block / blockNum);
+			int end = (int)((long long)n * (block + 1) / blockNum);
+			for (int i = begin; i < end; i++)
+			{
+				unsigned int key = radixKeys[i];
+				int dest = histogram[(key >> shift) & 0xff]++;
+				radixKeysTemp[dest] = key;
+				indicesTemp[dest] = indices[i];
+			}
+		}
+
+		radixKeys.swap(radixKeysTemp);
+		indices.swap(indicesTemp);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __PARTICLE_SORTER_H__
+#define __PARTICLE_SORTER_H__
+
+/*!
+	Particle sorter.
+	The class sorts the stroke particles in back-to-front order.
+	The permutation of the previous frame is kept and reused as the initial guess,
+	because the view changes only a little per frame (e.g. while rotating the camera)
+	and the previous order is almost sorted. The particles are identified by the IDs
+	less than the given number, since the culling changes the particle set per frame:
+	the previous order is remapped to the current particles, and the new particles
+	are sorted separately and merged. If the measured disorder is low,
+	the order is fixed with the insertion sort, otherwise the full radix sort is used.
+	The radix sort runs in parallel for the large number of the particles.
+*/
+class ParticleSorter
+{
+public:
+
+	ParticleSorter();
+	void Sort(const std::vector<float>& keys, const std::vector<unsigned int>& ids, unsigned int idNum);
+	void Invalidate();
+	const std::vector<unsigned int>& GetIndices() { return indices; }
+	bool IsLastSortIncremental() { return lastSortIncremental; }
+
+private:
+
+	bool RemapPreviousOrder(const std::vector<unsigned int>& ids, unsigned int idNum);
+	float MeasureDisorder(const std::vector<float>& keys);
+	bool InsertionSort(const std::vector<float>& keys, int maxMoves);
+	void RadixSort(const std::vector<float>& keys);
+
+private:
+
+	// Permutation of the particles in the descending order of the keys
+	std::vector<unsigned int> indices;
+
+	// IDs of the particles in the sorted order of the previous frame,
+	// and the temporary map from the IDs to the current particles (-1 if absent)
+	std::vector<unsigned int> sortedIds;
+	std::vector<int> idToIndex;
+
+	// Particles not in the previous frame
+	std::vector<unsigned int> newIndices;
+
+	// Temporary buffers for the radix sort
+	std::vector<unsigned int> radixKeys;
+	std::vector<unsigned int> radixKeysTemp;
+	std::vector<unsigned int> indicesTemp;
+	std::vector<int> histograms;
+
+	bool lastSortIncremental;
+
+};
+
+#endif // __PARTICLE_SORTER_H__
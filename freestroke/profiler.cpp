@@ -0,0 +1,309 @@
+#include "profiler.h"
+#include "gllib.h"
+#include "timer.h"
+
+namespace
+{
+
+	// Number of the frames kept for the CSV export
+	const int maxHistorySize = 1000;
+
+}
+
+Profiler::Profiler()
+	: enabled(false)
+	, frame(0)
+	, frameStartTime(0.0)
+	, currentStage(-1)
+	, currentQuery(-1)
+	, stageStartTime(0.0)
+{
+
+}
+
+Profiler::~Profiler()
+{
+	Clear();
+}
+
+void Profiler::SetEnabled( bool enable )
+{
+	if (currentStage >= 0)
+	{
+		THROW_EXCEPTION(Exception::InvalidOperation, "Profiler cannot be toggled inside a stage");
+	}
+	enabled = enable;
+}
+
+void Profiler::Clear()
+{
+	for (int i = 0; i < stages.size(); i++)
+	{
+		glDeleteQueries(2, stages[i].queries);
+	}
+	stages.clear();
+	history.clear();
+}
+
+void Profiler::BeginFrame()
+{
+	if (!enabled) return;
+
+	// The results of the previous frames are collected if available
+	ResolveQueries(false);
+
+	FrameRecord record;
+	record.frame = frame;
+	record.frameTime = -1.0;
+	record.cpuTimes.assign(stages.size(), -1.0);
+	record.gpuTimes.assign(stages.size(), -1.0);
+	history.push_back(record);
+	if (history.size() > maxHistorySize)
+	{
+		history.pop_front();
+	}
+
+	frameStartTime = Timer::GetCurrentTimeMilli();
+}
+
+void Profiler::EndFrame()
+{
+	if (!enabled || history.empty() || history.back().frame != frame) return;
+
+	if (currentStage >= 0)
+	{
+		THROW_EXCEPTION(Exception::InvalidOperation,
+			(boost::format("Profiler stage '%s' is not ended") % stages[currentStage].name).str());
+	}
+
+	history.back().frameTime = Timer::GetCurrentTimeMilli() - frameStartTime;
+	frame++;
+}
+
+void Profiler::BeginStage( const std::string& name )
+{
+	if (!enabled || history.empty() || history.back().frame != frame) return;
+
+	if (currentStage >= 0)
+	{
+		THROW_EXCEPTION(Exception::InvalidOperation,
+			(boost::format("Profiler stage '%s' is nested in '%s'") % name % stages[currentStage].name).str());
+	}
+
+	currentStage = FindStage(name);
+	Stage& stage = stages[currentStage];
+
+	// If the both queries are still pending, the GPU time of this stage is skipped
+	currentQuery = -1;
+	for (int i = 0; i < 2; i++)
+	{
+		if (stage.queryFrames[i] < 0)
+		{
+			currentQuery = i;
+			break;
+		}
+	}
+
+	if (currentQuery >= 0)
+	{
+		glBeginQuery(GL_TIME_ELAPSED, stage.queries[currentQuery]);
+		stage.queryFrames[currentQuery] = frame;
+	}
+
+	stageStartTime = Timer::GetCurrentTimeMilli();
+}
+
+void Profiler::EndStage()
+{
+	if (currentStage < 0) return;
+
+	double elapsed = Timer::GetCurrentTimeMilli() - stageStartTime;
+
+	if (currentQuery >= 0)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+	}
+
+	// The stage may run more than once in a frame
+	FrameRecord& record = history.back();
+	if (record.cpuTimes.size() <= currentStage)
+	{
+		record.cpuTimes.resize(currentStage + 1, -1.0);
+	}
+	double& cpuTime = record.cpuTimes[currentStage];
+	cpuTime = cpuTime < 0.0 ? elapsed : cpuTime + elapsed;
+
+	currentStage = -1;
+	currentQuery = -1;
+}
+
+int Profiler::FindStage( const std::string& name )
+{
+	for (int i = 0; i < stages.size(); i++)
+	{
+		if (stages[i].name == name)
+		{
+			return i;
+		}
+	}
+
+	Stage stage;
+	stage.name = name;
+	glGenQueries(2, stage.queries);
+	stage.queryFrames[0] = -1;
+	stage.queryFrames[1] = -1;
+	stages.push_back(stage);
+
+	return stages.size() - 1;
+}
+
+void Profiler::ResolveQueries( bool wait )
+{
+	for (int i = 0; i < stages.size(); i++)
+	{
+		Stage& stage = stages[i];
+		for (int j = 0; j < 2; j++)
+		{
+			if (stage.queryFrames[j] < 0)
+			{
+				continue;
+			}
+
+			GLint available = GL_FALSE;
+			glGetQueryObjectiv(stage.queries[j], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available && !wait)
+			{
+				continue;
+			}
+
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(stage.queries[j], GL_QUERY_RESULT, &elapsed);
+
+			// The frames in the history are consecutive
+			int index = history.empty() ? -1 : stage.queryFrames[j] - history.front().frame;
+			if (0 <= index && index < history.size())
+			{
+				FrameRecord& record = history[index];
+				if (record.gpuTimes.size() <= i)
+				{
+					record.gpuTimes.resize(i + 1, -1.0);
+				}
+				double& gpuTime = record.gpuTimes[i];
+				double ms = (double)elapsed * 1e-6;
+				gpuTime = gpuTime < 0.0 ? ms : gpuTime + ms;
+			}
+
+			stage.queryFrames[j] = -1;
+		}
+	}
+}
+
+double Profiler::GetGpuFrameTime() const
+{
+	// Total GPU time of the latest frame whose all stages are resolved.
+	// Negative if no frame is resolved yet.
+	for (int i = history.size() - 1; i >= 0; i--)
+	{
+		const FrameRecord& record = history[i];
+		double sum = 0.0;
+		bool resolved = record.frameTime >= 0.0;
+		for (int j = 0; j < record.cpuTimes.size() && resolved; j++)
+		{
+			if (record.cpuTimes[j] < 0.0)
+			{
+				continue;
+			}
+			double gpuTime = j < record.gpuTimes.size() ? record.gpuTimes[j] : -1.0;
+			resolved = gpuTime >= 0.0;
+			sum += gpuTime;
+		}
+
+		if (resolved)
+		{
+			return sum;
+		}
+	}
+
+	return -1.0;
+}
+
+std::string Profiler::GetSummary() const
+{
+	std::stringstream ss;
+	if (history.empty())
+	{
+		return ss.str();
+	}
+
+	// CPU times of the last frame, and the latest available GPU times
+	// which are a frame or two behind.
+	const FrameRecord& last = history.back();
+	ss << boost::format("%-16s %8s %8s") % "Stage" % "CPU ms" % "GPU ms" << std::endl;
+	for (int i = 0; i < stages.size(); i++)
+	{
+		double cpuTime = i < last.cpuTimes.size() ? last.cpuTimes[i] : -1.0;
+		double gpuTime = -1.0;
+		for (int j = history.size() - 1; j >= 0 && gpuTime < 0.0; j--)
+		{
+			if (i < history[j].gpuTimes.size())
+			{
+				gpuTime = history[j].gpuTimes[i];
+			}
+		}
+
+		if (cpuTime < 0.0)
+		{
+			continue;
+		}
+
+		ss << boost::format("%-16s %8.2f ") % stages[i].name % cpuTime;
+		if (gpuTime < 0.0) ss << boost::format("%8s") % "-";
+		else ss << boost::format("%8.2f") % gpuTime;
+		ss << std::endl;
+	}
+	ss << boost::format("%-16s %8.2f") % "Frame" % last.frameTime;
+
+	return ss.str();
+}
+
+void Profiler::ExportCSV( const std::string& path )
+{
+	// Wait for the pending GPU times
+	ResolveQueries(true);
+
+	std::ofstream ofs(path.c_str());
+	if (!ofs.is_open())
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to open %s") % path).str());
+	}
+
+	// One row per frame. The empty cells are the stages not executed in the frame
+	// or the GPU times not available.
+	ofs << "frame,frame_ms";
+	for (int i = 0; i < stages.size(); i++)
+	{
+		ofs << "," << stages[i].name << " cpu_ms";
+		ofs << "," << stages[i].name << " gpu_ms";
+	}
+	ofs << std::endl;
+
+	for (int i = 0; i < history.size(); i++)
+	{
+		const FrameRecord& record = history[i];
+		if (record.frameTime < 0.0)
+		{
+			continue;
+		}
+
+		ofs << record.frame << "," << record.frameTime;
+		for (int j = 0; j < stages.size(); j++)
+		{
+			ofs << ",";
+			if (j < record.cpuTimes.size() && record.cpuTimes[j] >= 0.0) ofs << record.cpuTimes[j];
+			ofs << ",";
+			if (j < record.gpuTimes.size() && record.gpuTimes[j] >= 0.0) ofs << record.gpuTimes[j];
+		}
+		ofs << std::endl;
+	}
+}
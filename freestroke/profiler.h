@@ -0,0 +1,101 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <deque>
+
+/*!
+	Profiler.
+	The class measures the CPU and GPU time of the stages of a frame.
+	The CPU time is measured with the timer and the GPU time with GL_TIME_ELAPSED queries.
+	Each stage has two queries used alternately, and the results are read
+	in the later frames when they become available, so the profiler never stalls the pipeline.
+	Since only one GL_TIME_ELAPSED query can be active at a time, the stages must not be nested.
+*/
+class Profiler
+{
+public:
+
+	Profiler();
+	~Profiler();
+
+	bool IsEnabled() const { return enabled; }
+	void SetEnabled(bool enable);
+	void Clear();
+
+	void BeginFrame();
+	void EndFrame();
+	void BeginStage(const std::string& name);
+	void EndStage();
+
+	double GetGpuFrameTime() const;
+	std::string GetSummary() const;
+	void ExportCSV(const std::string& path);
+
+private:
+
+	int FindStage(const std::string& name);
+	void ResolveQueries(bool wait);
+
+private:
+
+	struct Stage
+	{
+		std::string name;
+		unsigned int queries[2];
+		int queryFrames[2];		//!< Frame in which the query was issued. -1 if not pending.
+	};
+
+	struct FrameRecord
+	{
+		int frame;
+		double frameTime;
+		std::vector<double> cpuTimes;	//!< Negative if the stage did not run.
+		std::vector<double> gpuTimes;	//!< Negative if the result is not available.
+	};
+
+private:
+
+	bool enabled;
+	int frame;
+	double frameStartTime;
+
+	std::vector<Stage> stages;
+	int currentStage;
+	int currentQuery;
+	double stageStartTime;
+
+	// Recent frames
+	std::deque<FrameRecord> history;
+
+};
+
+/*!
+	Scoped profile.
+	The stage is measured during the lifetime of the object.
+*/
+class ScopedProfile
+{
+public:
+
+	ScopedProfile(Profiler* profiler, const char* name)
+		: profiler(profiler)
+	{
+		profiler->BeginStage(name);
+	}
+
+	~ScopedProfile()
+	{
+		profiler->EndStage();
+	}
+
+private:
+
+	DISALLOW_COPY_AND_ASSIGN(ScopedProfile);
+
+private:
+
+	Profiler* profiler;
+
+};
+
+#endif // __PROFILER_H__
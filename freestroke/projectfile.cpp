@@ -0,0 +1,883 @@
+#include "projectfile.h"
+#include "strokestore.h"
+#include "canvas.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+	// File header followed by the chunks
+	struct FileHeader
+	{
+		char magic[4];
+		int version;
+		int chunkNum;
+		int reserved;
+	};
+
+	// Chunk header followed by the payload padded to 8 bytes
+	struct ChunkHeader
+	{
+		char tag[4];
+		int reserved;
+		long long size;
+	};
+
+	// INFO chunk followed by the proxy geometry path in UTF-8
+	struct InfoRecord
+	{
+		int canvasWidth;
+		int canvasHeight;
+		int pathLength;
+		int reserved;
+	};
+
+	// SVID chunk: the journal state of the file.
+	// The chunk is optional and the files without the chunk have no journal.
+	struct SaveRecord
+	{
+		long long saveID;
+		long long compactedJournalID;
+		int compactedRecordNum;
+		int reserved;
+	};
+
+	// STRK chunk: one record per stroke.
+	// The ranges in the arrays are implied by the order of the strokes.
+	struct StrokeRecord
+	{
+		float color[4];
+		int id;
+		float size;
+		int guid;
+		float brushSpacing;
+		int pointNum;
+		int overrideNum;
+	};
+
+	// OVRD chunk: one record per overridden point
+	struct OverrideRecord
+	{
+		int point;
+		float color[4];
+		int id;
+		float size;
+		int guid;
+	};
+
+	const char projectFileMagic[4] = { 'F', 'S', 'P', 'J' };
+	const int projectFileVersion = 1;
+
+	const char infoChunkTag[4]		= { 'I', 'N', 'F', 'O' };
+	const char saveChunkTag[4]		= { 'S', 'V', 'I', 'D' };
+	const char strokeChunkTag[4]	= { 'S', 'T', 'R', 'K' };
+	const char overrideChunkTag[4]	= { 'O', 'V', 'R', 'D' };
+	const char positionChunkTags[3][4] = {
+		{ 'P', 'O', 'S', 'X' },
+		{ 'P', 'O', 'S', 'Y' },
+		{ 'P', 'O', 'S', 'Z' } };
+
+	// ------------------------------------------------------------
+
+	// Journal header followed by the records
+	struct JournalHeader
+	{
+		char magic[4];
+		int version;
+		long long journalID;
+	};
+
+	// Record header followed by the payload
+	struct RecordHeader
+	{
+		int type;
+		int size;
+		int checksum;		//!< CRC-16 of the payload.
+		int reserved;
+	};
+
+	// Payload of the add record in the layout of the chunks of the project file:
+	// StrokeRecord, OverrideRecord * overrideNum, and the x, y and z blocks of the positions.
+	// The attributes shared by the points are written once.
+
+	enum RecordType
+	{
+		RECORD_ADD = 1,
+		RECORD_UNDO,
+		RECORD_COMMIT
+	};
+
+	const char journalMagic[4] = { 'F', 'S', 'J', 'L' };
+	const int journalVersion = 2;
+
+	// ------------------------------------------------------------
+
+	void WriteChunk(QFile& file, const char* tag, const void* data, long long size)
+	{
+		ChunkHeader header;
+		memcpy(header.tag, tag, sizeof(header.tag));
+		header.reserved = 0;
+		header.size = size;
+
+		const char padding[8] = { 0 };
+		if (file.write((const char*)&header, sizeof(ChunkHeader)) != sizeof(ChunkHeader) ||
+			(size > 0 && file.write((const char*)data, size) != size) ||
+			file.write(padding, (8 - size % 8) % 8) != (8 - size % 8) % 8)
+		{
+			THROW_EXCEPTION(Exception::FileError,
+				(boost::format("Failed to write %s") % file.fileName().toStdString()).str());
+		}
+	}
+
+	StrokeRecord MakeStrokeRecord(const StrokeAttribute& attr)
+	{
+		StrokeRecord r;
+		for (int j = 0; j < 4; j++) r.color[j] = attr.color[j];
+		r.id = attr.id;
+		r.size = attr.size;
+		r.guid = attr.guid;
+		r.brushSpacing = attr.brushSpacing;
+		r.pointNum = attr.pointNum;
+		r.overrideNum = attr.overrideNum;
+		return r;
+	}
+
+	OverrideRecord MakeOverrideRecord(const StrokePointOverride& o)
+	{
+		OverrideRecord r;
+		r.point = o.point;
+		for (int j = 0; j < 4; j++) r.color[j] = o.color[j];
+		r.id = o.id;
+		r.size = o.size;
+		r.guid = o.guid;
+		return r;
+	}
+
+	// Returns the payload of the chunk or NULL if the chunk is not found
+	const uchar* FindChunk(const std::vector<const uchar*>& chunks, const char* tag, long long& size)
+	{
+		for (int i = 0; i < chunks.size(); i++)
+		{
+			ChunkHeader header;
+			memcpy(&header, chunks[i], sizeof(ChunkHeader));
+			if (memcmp(header.tag, tag, sizeof(header.tag)) == 0)
+			{
+				size = header.size;
+				return chunks[i] + sizeof(ChunkHeader);
+			}
+		}
+		size = 0;
+		return NULL;
+	}
+
+	// Flushes the buffers of Qt and the OS, so the data reaches the disk before the file is renamed.
+	// Otherwise the rename may be persisted before the data on a crash.
+	bool SyncFile(QFile& file)
+	{
+		if (!file.flush())
+		{
+			return false;
+		}
+#ifdef _WIN32
+		return FlushFileBuffers((HANDLE)_get_osfhandle(file.handle())) != 0;
+#else
+		return fsync(file.handle()) == 0;
+#endif
+	}
+
+	// Replaces the file in one step, so the readers see either the old or the new file
+	bool ReplaceFile(const QString& from, const QString& to)
+	{
+#ifdef _WIN32
+		return MoveFileExW(
+			(LPCWSTR)QDir::toNativeSeparators(from).utf16(),
+			(LPCWSTR)QDir::toNativeSeparators(to).utf16(),
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+	}
+
+	// Stroke operation of a journal record
+	struct JournalOperation
+	{
+		int type;
+		float brushSpacing;
+		std::vector<StrokePoint> points;
+	};
+
+	// Decodes and validates the record without changing the store
+	bool DecodeRecord(int type, const uchar* payload, int size, JournalOperation& op)
+	{
+		op.type = type;
+		if (type != RECORD_ADD)
+		{
+			return true;
+		}
+
+		StrokeRecord strokeRecord;
+		if (size < sizeof(StrokeRecord))
+		{
+			return false;
+		}
+		memcpy(&strokeRecord, payload, sizeof(StrokeRecord));
+		if (strokeRecord.pointNum <= 0 || strokeRecord.overrideNum < 0 || strokeRecord.overrideNum > strokeRecord.pointNum ||
+			size != sizeof(StrokeRecord) + (qint64)strokeRecord.overrideNum * sizeof(OverrideRecord) + (qint64)strokeRecord.pointNum * 3 * sizeof(float))
+		{
+			return false;
+		}
+
+		// The points are restored from the stroke attributes and the overrides,
+		// and the store derives the same attributes from them
+		int pointNum = strokeRecord.pointNum;
+		std::vector<StrokePoint>& points = op.points;
+		points.assign(pointNum, StrokePoint(glm::vec3(0.0f),
+			glm::vec4(strokeRecord.color[0], strokeRecord.color[1], strokeRecord.color[2], strokeRecord.color[3]),
+			strokeRecord.id, strokeRecord.size, strokeRecord.guid));
+
+		const uchar* src = payload + sizeof(StrokeRecord);
+		int prevPoint = -1;
+		for (int i = 0; i < strokeRecord.overrideNum; i++, src += sizeof(OverrideRecord))
+		{
+			OverrideRecord r;
+			memcpy(&r, src, sizeof(OverrideRecord));
+			if (r.point <= prevPoint || r.point >= pointNum)
+			{
+				return false;
+			}
+			prevPoint = r.point;
+
+			StrokePoint& p = points[r.point];
+			p.color = glm::vec4(r.color[0], r.color[1], r.color[2], r.color[3]);
+			p.id = r.id;
+			p.size = r.size;
+			p.guid = r.guid;
+		}
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			for (int i = 0; i < pointNum; i++, src += sizeof(float))
+			{
+				memcpy(&points[i].position[axis], src, sizeof(float));
+			}
+		}
+
+		op.brushSpacing = strokeRecord.brushSpacing;
+		return true;
+	}
+
+}
+
+bool ProjectFile::IsProjectFile( const QString& path )
+{
+	QFile file(path);
+	char magic[4];
+	return
+		file.open(QIODevice::ReadOnly) &&
+		file.read(magic, sizeof(magic)) == sizeof(magic) &&
+		memcmp(magic, projectFileMagic, sizeof(magic)) == 0;
+}
+
+void ProjectFile::Save( const QString& path, const ProjectInfo& info, const StrokeStore& strokeStore )
+{
+	// The file is written next to the destination and replaces it when complete,
+	// so the previous file survives the failure or the crash while writing
+	QString tempPath = path + ".tmp";
+	try
+	{
+		Write(tempPath, info, strokeStore);
+	}
+	catch (const Exception&)
+	{
+		QFile::remove(tempPath);
+		throw;
+	}
+
+	if (!ReplaceFile(tempPath, path))
+	{
+		QFile::remove(tempPath);
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to replace %s") % path.toStdString()).str());
+	}
+}
+
+void ProjectFile::Write( const QString& path, const ProjectInfo& info, const StrokeStore& strokeStore )
+{
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to open %s") % path.toStdString()).str());
+	}
+
+	FileHeader header;
+	memcpy(header.magic, projectFileMagic, sizeof(header.magic));
+	header.version = projectFileVersion;
+	header.chunkNum = 7;
+	header.reserved = 0;
+	if (file.write((const char*)&header, sizeof(FileHeader)) != sizeof(FileHeader))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to write %s") % path.toStdString()).str());
+	}
+
+	// Info
+	QByteArray proxyGeometryPath = QString::fromStdString(info.proxyGeometryPath).toUtf8();
+	InfoRecord infoRecord;
+	infoRecord.canvasWidth = info.canvasWidth;
+	infoRecord.canvasHeight = info.canvasHeight;
+	infoRecord.pathLength = proxyGeometryPath.size();
+	infoRecord.reserved = 0;
+	QByteArray infoChunk((const char*)&infoRecord, sizeof(InfoRecord));
+	infoChunk.append(proxyGeometryPath);
+	WriteChunk(file, infoChunkTag, infoChunk.constData(), infoChunk.size());
+
+	SaveRecord saveRecord;
+	saveRecord.saveID = info.saveID;
+	saveRecord.compactedJournalID = info.compactedJournalID;
+	saveRecord.compactedRecordNum = info.compactedRecordNum;
+	saveRecord.reserved = 0;
+	WriteChunk(file, saveChunkTag, &saveRecord, sizeof(SaveRecord));
+
+	// Stroke table
+	int strokeNum = strokeStore.GetStrokeNum();
+	std::vector<StrokeRecord> strokeRecords(strokeNum);
+	for (int i = 0; i < strokeNum; i++)
+	{
+		strokeRecords[i] = MakeStrokeRecord(strokeStore.data->attributes[i]);
+	}
+	WriteChunk(file, strokeChunkTag, strokeRecords.empty() ? NULL : &strokeRecords[0], (long long)strokeNum * sizeof(StrokeRecord));
+
+	// Override table
+	int overrideNum = strokeStore.data->overrides.size();
+	std::vector<OverrideRecord> overrideRecords(overrideNum);
+	for (int i = 0; i < overrideNum; i++)
+	{
+		overrideRecords[i] = MakeOverrideRecord(strokeStore.data->overrides[i]);
+	}
+	WriteChunk(file, overrideChunkTag, overrideRecords.empty() ? NULL : &overrideRecords[0], (long long)overrideNum * sizeof(OverrideRecord));
+
+	// Point blocks are written directly from the arena
+	const std::vector<float>* positions[3] = { &strokeStore.data->positionX, &strokeStore.data->positionY, &strokeStore.data->positionZ };
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const std::vector<float>& v = *positions[axis];
+		WriteChunk(file, positionChunkTags[axis], v.empty() ? NULL : &v[0], (long long)v.size() * sizeof(float));
+	}
+
+	if (!SyncFile(file))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to write %s") % path.toStdString()).str());
+	}
+}
+
+void ProjectFile::Load( const QString& path, ProjectInfo& info, StrokeStore& strokeStore )
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to open %s") % path.toStdString()).str());
+	}
+
+	const std::string invalidMessage = (boost::format("Invalid project file %s") % path.toStdString()).str();
+	long long fileSize = file.size();
+	const uchar* p = fileSize >= sizeof(FileHeader) ? file.map(0, fileSize) : NULL;
+	if (!p)
+	{
+		THROW_EXCEPTION(Exception::FileError, invalidMessage);
+	}
+
+	FileHeader header;
+	memcpy(&header, p, sizeof(FileHeader));
+	if (memcmp(header.magic, projectFileMagic, sizeof(header.magic)) != 0)
+	{
+		THROW_EXCEPTION(Exception::FileError, invalidMessage);
+	}
+	if (header.version > projectFileVersion)
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Unsupported project file version %d: %s") % header.version % path.toStdString()).str());
+	}
+
+	// Chunk directory
+	std::vector<const uchar*> chunks;
+	long long offset = sizeof(FileHeader);
+	for (int i = 0; i < header.chunkNum; i++)
+	{
+		ChunkHeader chunkHeader;
+		if (offset + (long long)sizeof(ChunkHeader) > fileSize)
+		{
+			THROW_EXCEPTION(Exception::FileError, invalidMessage);
+		}
+		memcpy(&chunkHeader, p + offset, sizeof(ChunkHeader));
+		long long paddedSize = (chunkHeader.size + 7) / 8 * 8;
+		if (chunkHeader.size < 0 || offset + (long long)sizeof(ChunkHeader) + paddedSize > fileSize)
+		{
+			THROW_EXCEPTION(Exception::FileError, invalidMessage);
+		}
+		chunks.push_back(p + offset);
+		offset += sizeof(ChunkHeader) + paddedSize;
+	}
+
+	// ------------------------------------------------------------
+
+	long long infoSize, strokeSize, overrideSize, positionSizes[3];
+	const uchar* infoChunk = FindChunk(chunks, infoChunkTag, infoSize);
+	const uchar* strokeChunk = FindChunk(chunks, strokeChunkTag, strokeSize);
+	const uchar* overrideChunk = FindChunk(chunks, overrideChunkTag, overrideSize);
+	const uchar* positionChunks[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		positionChunks[axis] = FindChunk(chunks, positionChunkTags[axis], positionSizes[axis]);
+	}
+
+	InfoRecord infoRecord;
+	if (!infoChunk || infoSize < sizeof(InfoRecord) || !strokeChunk || !overrideChunk ||
+		!positionChunks[0] || !positionChunks[1] || !positionChunks[2] ||
+		strokeSize % sizeof(StrokeRecord) != 0 || overrideSize % sizeof(OverrideRecord) != 0 ||
+		positionSizes[0] % sizeof(float) != 0 ||
+		positionSizes[0] != positionSizes[1] || positionSizes[0] != positionSizes[2])
+	{
+		THROW_EXCEPTION(Exception::FileError, invalidMessage);
+	}
+
+	memcpy(&infoRecord, infoChunk, sizeof(InfoRecord));
+	if (infoRecord.pathLength < 0 || sizeof(InfoRecord) + infoRecord.pathLength > infoSize)
+	{
+		THROW_EXCEPTION(Exception::FileError, invalidMessage);
+	}
+
+	// The ranges of the strokes must cover the arrays exactly
+	int strokeNum = strokeSize / sizeof(StrokeRecord);
+	int overrideNum = overrideSize / sizeof(OverrideRecord);
+	int pointNum = positionSizes[0] / sizeof(float);
+	std::vector<StrokeAttribute> attributes(strokeNum);
+	int pointBegin = 0;
+	int overrideBegin = 0;
+	for (int i = 0; i < strokeNum; i++)
+	{
+		StrokeRecord r;
+		memcpy(&r, strokeChunk + i * sizeof(StrokeRecord), sizeof(StrokeRecord));
+		if (r.pointNum <= 0 || r.overrideNum < 0 ||
+			r.pointNum > pointNum - pointBegin || r.overrideNum > overrideNum - overrideBegin)
+		{
+			THROW_EXCEPTION(Exception::FileError, invalidMessage);
+		}
+
+		StrokeAttribute& attr = attributes[i];
+		attr.color = glm::vec4(r.color[0], r.color[1], r.color[2], r.color[3]);
+		attr.id = r.id;
+		attr.size = r.size;
+		attr.guid = r.guid;
+		attr.brushSpacing = r.brushSpacing;
+		attr.pointBegin = pointBegin;
+		attr.pointNum = r.pointNum;
+		attr.overrideBegin = overrideBegin;
+		attr.overrideNum = r.overrideNum;
+		pointBegin += r.pointNum;
+		overrideBegin += r.overrideNum;
+	}
+	if (pointBegin != pointNum || overrideBegin != overrideNum)
+	{
+		THROW_EXCEPTION(Exception::FileError, invalidMessage);
+	}
+
+	std::vector<StrokePointOverride> overrides(overrideNum);
+	for (int i = 0; i < strokeNum; i++)
+	{
+		const StrokeAttribute& attr = attributes[i];
+		for (int j = attr.overrideBegin; j < attr.overrideBegin + attr.overrideNum; j++)
+		{
+			OverrideRecord r;
+			memcpy(&r, overrideChunk + j * sizeof(OverrideRecord), sizeof(OverrideRecord));
+
+			// The overrides of a stroke are sorted by the point for the binary search
+			if (r.point < 0 || r.point >= attr.pointNum ||
+				(j > attr.overrideBegin && r.point <= overrides[j - 1].point))
+			{
+				THROW_EXCEPTION(Exception::FileError, invalidMessage);
+			}
+
+			StrokePointOverride& o = overrides[j];
+			o.point = r.point;
+			o.color = glm::vec4(r.color[0], r.color[1], r.color[2], r.color[3]);
+			o.id = r.id;
+			o.size = r.size;
+			o.guid = r.guid;
+		}
+	}
+
+	// ------------------------------------------------------------
+
+	// The file is valid, so the store is replaced.
+	// The point blocks are copied from the mapped file as they are.
+	info.canvasWidth = infoRecord.canvasWidth;
+	info.canvasHeight = infoRecord.canvasHeight;
+	info.proxyGeometryPath = QString::fromUtf8((const char*)infoChunk + sizeof(InfoRecord), infoRecord.pathLength).toStdString();
+
+	long long saveSize;
+	const uchar* saveChunk = FindChunk(chunks, saveChunkTag, saveSize);
+	info.saveID = info.compactedJournalID = 0;
+	info.compactedRecordNum = 0;
+	if (saveChunk && saveSize >= sizeof(SaveRecord))
+	{
+		SaveRecord saveRecord;
+		memcpy(&saveRecord, saveChunk, sizeof(SaveRecord));
+		info.saveID = saveRecord.saveID;
+		info.compactedJournalID = saveRecord.compactedJournalID;
+		info.compactedRecordNum = saveRecord.compactedRecordNum;
+	}
+
+	strokeStore.Detach();
+	std::vector<float>* positions[3] = { &strokeStore.data->positionX, &strokeStore.data->positionY, &strokeStore.data->positionZ };
+	for (int axis = 0; axis < 3; axis++)
+	{
+		positions[axis]->resize(pointNum);
+		if (pointNum > 0)
+		{
+			memcpy(&(*positions[axis])[0], positionChunks[axis], pointNum * sizeof(float));
+		}
+	}
+	strokeStore.data->overrides.swap(overrides);
+	strokeStore.data->attributes.swap(attributes);
+
+	// The particle counts and the bounds are not stored, since they depend on the loader version
+	for (int i = 0; i < strokeNum; i++)
+	{
+		strokeStore.UpdateDerivedAttribute(strokeStore.data->attributes[i]);
+	}
+	strokeStore.revision++;
+}
+
+// ------------------------------------------------------------
+
+StrokeJournal::StrokeJournal()
+	: journalID(0)
+	, committedRecordNum(0)
+{
+
+}
+
+StrokeJournal::~StrokeJournal()
+{
+	Close();
+}
+
+QString StrokeJournal::GetPath( const QString& projectPath )
+{
+	return projectPath + ".journal";
+}
+
+void StrokeJournal::Create( const QString& path, long long journalID )
+{
+	Close();
+
+	JournalHeader header;
+	memcpy(header.magic, journalMagic, sizeof(header.magic));
+	header.version = journalVersion;
+	header.journalID = journalID;
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) ||
+		file.write((const char*)&header, sizeof(JournalHeader)) != sizeof(JournalHeader) ||
+		!file.flush())
+	{
+		file.close();
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to create %s") % path.toStdString()).str());
+	}
+
+	this->journalID = journalID;
+}
+
+bool StrokeJournal::Open( const QString& path, const ProjectInfo& info, StrokeStore& strokeStore )
+{
+	Close();
+	if (info.saveID == 0 || !QFile::exists(path))
+	{
+		return false;
+	}
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadWrite))
+	{
+		return false;
+	}
+
+	qint64 fileSize = file.size();
+	const uchar* p = fileSize >= sizeof(JournalHeader) ? file.map(0, fileSize) : NULL;
+	if (!p)
+	{
+		file.close();
+		return false;
+	}
+
+	// The journal is based on the file or compacted into the file
+	JournalHeader header;
+	memcpy(&header, p, sizeof(JournalHeader));
+	int compactedRecordNum = -1;
+	if (memcmp(header.magic, journalMagic, sizeof(header.magic)) == 0 && header.version == journalVersion)
+	{
+		if (header.journalID == info.saveID) compactedRecordNum = 0;
+		else if (header.journalID == info.compactedJournalID) compactedRecordNum = info.compactedRecordNum;
+	}
+
+	// Scan the records until the end or the torn record
+	qint64 offset = sizeof(JournalHeader);
+	while (compactedRecordNum >= 0 && offset + (qint64)sizeof(RecordHeader) <= fileSize)
+	{
+		RecordHeader recordHeader;
+		memcpy(&recordHeader, p + offset, sizeof(RecordHeader));
+		const uchar* payload = p + offset + sizeof(RecordHeader);
+		if (recordHeader.type < RECORD_ADD || recordHeader.type > RECORD_COMMIT ||
+			recordHeader.size < 0 || recordHeader.size > fileSize - offset - (qint64)sizeof(RecordHeader) ||
+			qChecksum((const char*)payload, recordHeader.size) != recordHeader.checksum)
+		{
+			break;
+		}
+
+		Record record;
+		record.type = recordHeader.type;
+		record.offset = offset + sizeof(RecordHeader);
+		record.size = recordHeader.size;
+		records.push_back(record);
+		if (record.type == RECORD_COMMIT)
+		{
+			committedRecordNum = records.size();
+		}
+		offset = record.offset + record.size;
+	}
+	file.unmap((uchar*)p);
+
+	if (compactedRecordNum < 0 || compactedRecordNum > committedRecordNum)
+	{
+		Close();
+		return false;
+	}
+
+	// ------------------------------------------------------------
+
+	if (offset < fileSize)
+	{
+		file.resize(offset);
+	}
+	file.seek(offset);
+	journalID = header.journalID;
+
+	Apply(compactedRecordNum, committedRecordNum, strokeStore);
+
+	// The records already in the file are removed from the journal
+	if (compactedRecordNum > 0)
+	{
+		Rebase(info.saveID, compactedRecordNum);
+	}
+	return true;
+}
+
+void StrokeJournal::Close()
+{
+	file.close();
+	journalID = 0;
+	records.clear();
+	committedRecordNum = 0;
+}
+
+void StrokeJournal::AppendAdd( const StrokeStore& strokeStore, int stroke )
+{
+	const StrokeAttribute& attr = strokeStore.GetAttribute(stroke);
+	StrokeRecord strokeRecord = MakeStrokeRecord(attr);
+	QByteArray payload((const char*)&strokeRecord, sizeof(StrokeRecord));
+	payload.reserve(sizeof(StrokeRecord) + attr.overrideNum * sizeof(OverrideRecord) + attr.pointNum * 3 * sizeof(float));
+
+	for (int i = attr.overrideBegin; i < attr.overrideBegin + attr.overrideNum; i++)
+	{
+		OverrideRecord r = MakeOverrideRecord(strokeStore.data->overrides[i]);
+		payload.append((const char*)&r, sizeof(OverrideRecord));
+	}
+
+	const std::vector<float>* positions[3] = { &strokeStore.data->positionX, &strokeStore.data->positionY, &strokeStore.data->positionZ };
+	for (int axis = 0; axis < 3; axis++)
+	{
+		payload.append((const char*)&(*positions[axis])[attr.pointBegin], attr.pointNum * sizeof(float));
+	}
+
+	Append(RECORD_ADD, payload);
+}
+
+void StrokeJournal::AppendUndo()
+{
+	Append(RECORD_UNDO, QByteArray());
+}
+
+void StrokeJournal::Commit()
+{
+	// The commit is the save of the user, so it is synced to the disk like the full save.
+	// The other records are only flushed.
+	Append(RECORD_COMMIT, QByteArray());
+	if (!SyncFile(file))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to sync %s") % file.fileName().toStdString()).str());
+	}
+	committedRecordNum = records.size();
+}
+
+void StrokeJournal::ApplyUncommitted( StrokeStore& strokeStore )
+{
+	// The records stay uncommitted until the next save
+	Apply(committedRecordNum, records.size(), strokeStore);
+}
+
+void StrokeJournal::DiscardUncommitted()
+{
+	if (GetUncommittedRecordNum() == 0)
+	{
+		return;
+	}
+
+	qint64 end = sizeof(JournalHeader);
+	if (committedRecordNum > 0)
+	{
+		end = records[committedRecordNum - 1].offset + records[committedRecordNum - 1].size;
+	}
+	records.resize(committedRecordNum);
+	if (!file.resize(end) || !file.seek(end))
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to truncate %s") % file.fileName().toStdString()).str());
+	}
+}
+
+void StrokeJournal::Rebase( long long newJournalID, int compactedRecordNum )
+{
+	// The records after the compacted ones are moved to the new journal,
+	// which replaces the current one at once
+	qint64 tailBegin = compactedRecordNum < records.size() ?
+		records[compactedRecordNum].offset - sizeof(RecordHeader) : file.size();
+	file.seek(tailBegin);
+	QByteArray tail = file.readAll();
+
+	QString path = file.fileName();
+	QString tempPath = path + ".tmp";
+	JournalHeader header;
+	memcpy(header.magic, journalMagic, sizeof(header.magic));
+	header.version = journalVersion;
+	header.journalID = newJournalID;
+
+	QFile temp(tempPath);
+	bool written =
+		temp.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+		temp.write((const char*)&header, sizeof(JournalHeader)) == sizeof(JournalHeader) &&
+		temp.write(tail) == tail.size() &&
+		SyncFile(temp);
+	temp.close();
+
+	file.close();
+	if (!written || !ReplaceFile(tempPath, path))
+	{
+		QFile::remove(tempPath);
+		Close();
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to compact %s") % path.toStdString()).str());
+	}
+
+	if (!file.open(QIODevice::ReadWrite))
+	{
+		Close();
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to open %s") % path.toStdString()).str());
+	}
+	file.seek(file.size());
+
+	qint64 shift = tailBegin - sizeof(JournalHeader);
+	records.erase(records.begin(), records.begin() + compactedRecordNum);
+	for (int i = 0; i < records.size(); i++)
+	{
+		records[i].offset -= shift;
+	}
+	committedRecordNum -= compactedRecordNum;
+	journalID = newJournalID;
+}
+
+void StrokeJournal::Append( int type, const QByteArray& payload )
+{
+	RecordHeader header;
+	header.type = type;
+	header.size = payload.size();
+	header.checksum = qChecksum(payload.constData(), payload.size());
+	header.reserved = 0;
+
+	// The records are flushed one by one to survive the crash of the application
+	qint64 offset = file.pos();
+	if (file.write((const char*)&header, sizeof(RecordHeader)) != sizeof(RecordHeader) ||
+		file.write(payload) != payload.size() ||
+		!file.flush())
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to write %s") % file.fileName().toStdString()).str());
+	}
+
+	Record record;
+	record.type = type;
+	record.offset = offset + sizeof(RecordHeader);
+	record.size = payload.size();
+	records.push_back(record);
+}
+
+void StrokeJournal::Apply( int begin, int end, StrokeStore& strokeStore )
+{
+	if (begin >= end)
+	{
+		return;
+	}
+
+	const uchar* p = file.map(0, file.size());
+	if (!p)
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Failed to map %s") % file.fileName().toStdString()).str());
+	}
+
+	// All records are validated before the store is changed,
+	// so an invalid record leaves the store as it was.
+	// The undo records must have the strokes to remove.
+	std::vector<JournalOperation> operations(end - begin);
+	int strokeNum = strokeStore.GetStrokeNum();
+	bool valid = true;
+	for (int i = begin; i < end && valid; i++)
+	{
+		JournalOperation& op = operations[i - begin];
+		valid = DecodeRecord(records[i].type, p + records[i].offset, records[i].size, op);
+		if (op.type == RECORD_ADD) strokeNum++;
+		else if (op.type == RECORD_UNDO) valid = valid && strokeNum-- > 0;
+	}
+	file.unmap((uchar*)p);
+
+	if (!valid)
+	{
+		THROW_EXCEPTION(Exception::FileError,
+			(boost::format("Invalid journal record in %s") % file.fileName().toStdString()).str());
+	}
+
+	for (int i = 0; i < operations.size(); i++)
+	{
+		const JournalOperation& op = operations[i];
+		if (op.type == RECORD_ADD)
+		{
+			strokeStore.Add(op.points, op.brushSpacing);
+		}
+		else if (op.type == RECORD_UNDO)
+		{
+			strokeStore.RemoveLast();
+		}
+	}
+}
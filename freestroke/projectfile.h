@@ -0,0 +1,124 @@
+#ifndef __PROJECT_FILE_H__
+#define __PROJECT_FILE_H__
+
+class StrokeStore;
+
+/*!
+	Project info.
+	The canvas settings saved with the strokes.
+*/
+struct ProjectInfo
+{
+
+	ProjectInfo()
+		: canvasWidth(0)
+		, canvasHeight(0)
+		, saveID(0)
+		, compactedJournalID(0)
+		, compactedRecordNum(0)
+	{
+
+	}
+
+	std::string proxyGeometryPath;
+	int canvasWidth;
+	int canvasHeight;
+
+	long long saveID;				//!< ID of the journal based on the file. Zero if the file has no journal.
+	long long compactedJournalID;	//!< ID of the journal compacted into the file.
+	int compactedRecordNum;			//!< Number of the records of the compacted journal included in the file.
+
+};
+
+/*!
+	Project file.
+	The binary project format consists of the header followed by the chunks.
+	Each chunk has a four character tag and the payload size, and is aligned to 8 bytes,
+	so the readers skip the unknown chunks of the newer versions.
+	The strokes are stored as the stroke table, the override table and
+	the contiguous point blocks in the layout of the stroke store,
+	so the file is loaded from the memory-mapped file without per-value parsing.
+	The values are stored in the little endian.
+	The file is replaced atomically on save, and the save only reads the given store,
+	so a snapshot of the store can be saved from a worker thread.
+*/
+class ProjectFile
+{
+private:
+
+	ProjectFile() {}
+	DISALLOW_COPY_AND_ASSIGN(ProjectFile);
+
+public:
+
+	//! Checks if the file is the binary project file. The text archives of the old versions are not.
+	static bool IsProjectFile(const QString& path);
+	static void Save(const QString& path, const ProjectInfo& info, const StrokeStore& strokeStore);
+	static void Load(const QString& path, ProjectInfo& info, StrokeStore& strokeStore);
+
+private:
+
+	static void Write(const QString& path, const ProjectInfo& info, const StrokeStore& strokeStore);
+
+};
+
+/*!
+	Stroke journal.
+	The append-only log of the stroke operations next to the project file.
+	Adding and undoing the strokes append the compact records,
+	and saving appends the commit record, so the save cost is proportional to the edits.
+	Opening the project replays the committed records on the strokes of the file,
+	and the records after the last commit are left from the crash or the discarded changes.
+	The journal is periodically compacted into the project file by the full save:
+	the file records the ID and the number of the compacted records,
+	so the journal is consistent with the file even if the compaction is interrupted.
+	Each record has a checksum, and the torn record at the end is removed on opening.
+*/
+class StrokeJournal
+{
+public:
+
+	StrokeJournal();
+	~StrokeJournal();
+	static QString GetPath(const QString& projectPath);
+	bool IsOpen() const { return file.isOpen(); }
+	long long GetID() const { return journalID; }
+	qint64 GetSize() const { return file.isOpen() ? file.size() : 0; }
+	int GetCommittedRecordNum() const { return committedRecordNum; }
+	int GetUncommittedRecordNum() const { return records.size() - committedRecordNum; }
+
+	void Create(const QString& path, long long journalID);
+	bool Open(const QString& path, const ProjectInfo& info, StrokeStore& strokeStore);
+	void Close();
+
+	void AppendAdd(const StrokeStore& strokeStore, int stroke);
+	void AppendUndo();
+	void Commit();
+	void ApplyUncommitted(StrokeStore& strokeStore);
+	void DiscardUncommitted();
+	void Rebase(long long newJournalID, int compactedRecordNum);
+
+private:
+
+	struct Record
+	{
+		int type;
+		qint64 offset;		//!< Offset of the payload.
+		int size;			//!< Size of the payload.
+	};
+
+	void Append(int type, const QByteArray& payload);
+	void Apply(int begin, int end, StrokeStore& strokeStore);
+
+	DISALLOW_COPY_AND_ASSIGN(StrokeJournal);
+
+private:
+
+	QFile file;
+	long long journalID;
+	std::vector<Record> records;
+	int committedRecordNum;
+
+};
+
+#endif // __PROJECT_FILE_H__
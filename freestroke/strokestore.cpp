@@ -0,0 +1,296 @@
+#include "strokestore.h"
+#include "canvas.h"
+#include "culling.h"
+
+StrokeStore::StrokeStore()
+	: data(new Data)
+	, revision(0)
+{
+
+}
+
+void StrokeStore::Detach()
+{
+	// The arrays are copied only if a copy of the store still refers to them.
+	// The other owners never modify the arrays, so the count is only decreased concurrently.
+	if (!data.unique())
+	{
+		data.reset(new Data(*data));
+	}
+}
+
+void StrokeStore::Add( const std::vector<StrokePoint>& points, float brushSpacing )
+{
+	if (points.empty())
+	{
+		THROW_EXCEPTION(Exception::InvalidArgument, "Stroke must have at least one point");
+	}
+
+	Detach();
+
+	// The attributes of the first point are used as the stroke attributes
+	StrokeAttribute attr;
+	attr.color = points[0].color;
+	attr.id = points[0].id;
+	attr.size = points[0].size;
+	attr.guid = points[0].guid;
+	attr.brushSpacing = brushSpacing;
+	attr.pointBegin = data->positionX.size();
+	attr.pointNum = points.size();
+	attr.overrideBegin = data->overrides.size();
+
+	for (int i = 0; i < points.size(); i++)
+	{
+		const StrokePoint& p = points[i];
+		data->positionX.push_back(p.position.x);
+		data->positionY.push_back(p.position.y);
+		data->positionZ.push_back(p.position.z);
+
+		if (p.color != attr.color || p.id != attr.id || p.size != attr.size || p.guid != attr.guid)
+		{
+			StrokePointOverride o;
+			o.point = i;
+			o.color = p.color;
+			o.id = p.id;
+			o.size = p.size;
+			o.guid = p.guid;
+			data->overrides.push_back(o);
+		}
+	}
+
+	attr.overrideNum = data->overrides.size() - attr.overrideBegin;
+
+	UpdateDerivedAttribute(attr);
+	data->attributes.push_back(attr);
+	revision++;
+}
+
+void StrokeStore::UpdateDerivedAttribute( StrokeAttribute& attr ) const
+{
+	// Number of the particles in the finest level
+	attr.particleNum = 0;
+	for (int j = 0, k = 1; k < attr.pointNum; j=k++)
+	{
+		int div = GetSubdivisionNum(attr, j, k);
+		if (div > 0) attr.particleNum += div - 1;
+		attr.particleNum += 2;
+	}
+
+	// The particles are interpolated between the stroke points,
+	// so the sphere enclosing the stroke points with their brush quads encloses all particles.
+	// The half diagonal of the brush quad is size / sqrt(2).
+	glm::vec3 minPos(FLT_MAX), maxPos(-FLT_MAX);
+	for (int i = attr.pointBegin; i < attr.pointBegin + attr.pointNum; i++)
+	{
+		glm::vec3 p(data->positionX[i], data->positionY[i], data->positionZ[i]);
+		minPos = glm::min(minPos, p);
+		maxPos = glm::max(maxPos, p);
+	}
+
+	attr.boundingSphereCenter = (minPos + maxPos) * 0.5f;
+	attr.boundingSphereRadius = 0.0f;
+	attr.minSize = FLT_MAX;
+	int o = attr.overrideBegin;
+	for (int i = 0; i < attr.pointNum; i++)
+	{
+		float size = attr.size;
+		if (o < attr.overrideBegin + attr.overrideNum && data->overrides[o].point == i)
+		{
+			size = data->overrides[o++].size;
+		}
+
+		int index = attr.pointBegin + i;
+		glm::vec3 p(data->positionX[index], data->positionY[index], data->positionZ[index]);
+		attr.boundingSphereRadius = glm::max(attr.boundingSphereRadius,
+			glm::distance(attr.boundingSphereCenter, p) + size * 0.7072f);
+		attr.minSize = glm::min(attr.minSize, size);
+	}
+}
+
+void StrokeStore::RemoveLast()
+{
+	if (data->attributes.empty())
+	{
+		return;
+	}
+
+	Detach();
+	const StrokeAttribute& attr = data->attributes.back();
+	data->positionX.resize(attr.pointBegin);
+	data->positionY.resize(attr.pointBegin);
+	data->positionZ.resize(attr.pointBegin);
+	data->overrides.resize(attr.overrideBegin);
+	data->attributes.pop_back();
+	revision++;
+}
+
+void StrokeStore::Clear()
+{
+	data.reset(new Data);
+	revision++;
+}
+
+glm::vec3 StrokeStore::GetPosition( int stroke, int point ) const
+{
+	int index = data->attributes[stroke].pointBegin + point;
+	return glm::vec3(data->positionX[index], data->positionY[index], data->positionZ[index]);
+}
+
+StrokePoint StrokeStore::GetPoint( int stroke, int point ) const
+{
+	const StrokeAttribute& attr = data->attributes[stroke];
+	StrokePoint p(GetPosition(stroke, point), attr.color, attr.id, attr.size, attr.guid);
+
+	if (attr.overrideNum > 0)
+	{
+		// Binary search in the overrides of the stroke
+		int begin = attr.overrideBegin;
+		int end = attr.overrideBegin + attr.overrideNum;
+		while (begin < end)
+		{
+			int mid = (begin + end) / 2;
+			if (data->overrides[mid].point < point) begin = mid + 1;
+			else end = mid;
+		}
+
+		if (begin < attr.overrideBegin + attr.overrideNum && data->overrides[begin].point == point)
+		{
+			const StrokePointOverride& o = data->overrides[begin];
+			p.color = o.color;
+			p.id = o.id;
+			p.size = o.size;
+			p.guid = o.guid;
+		}
+	}
+
+	return p;
+}
+
+void StrokeStore::GetPoints( int stroke, std::vector<StrokePoint>& points ) const
+{
+	const StrokeAttribute& attr = data->attributes[stroke];
+	points.resize(attr.pointNum);
+	for (int i = 0; i < attr.pointNum; i++)
+	{
+		points[i] = GetPoint(stroke, i);
+	}
+}
+
+BoundingSphere StrokeStore::GetBoundingSphere( int stroke ) const
+{
+	const StrokeAttribute& attr = data->attributes[stroke];
+	return BoundingSphere(attr.boundingSphereCenter, attr.boundingSphereRadius);
+}
+
+int StrokeStore::GetSubdivisionNum( const StrokeAttribute& attr, int j, int k ) const
+{
+	// Number of the interpolated particles between the stroke points j and k.
+	// Zero if the distance between the points is smaller than the brush spacing.
+	int a = attr.pointBegin + j;
+	int b = attr.pointBegin + k;
+	float dx = data->positionX[b] - data->positionX[a];
+	float dy = data->positionY[b] - data->positionY[a];
+	float dz = data->positionZ[b] - data->positionZ[a];
+	float dist2 = dx * dx + dy * dy + dz * dz;
+	if (attr.brushSpacing * attr.brushSpacing < dist2)
+	{
+		return (int)ceilf(glm::sqrt(dist2) / attr.brushSpacing);
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------
+
+int StrokeStore::GetParticleNum( int stroke, int level ) const
+{
+	int stride = 1 << level;
+	return (data->attributes[stroke].particleNum + stride - 1) / stride;
+}
+
+int StrokeStore::GenerateParticles( int stroke, int level, StrokePoint* particles ) const
+{
+	// The level l consists of every 2^l-th particle of the finest level.
+	// Each segment of the finest level has the interpolated particles followed by its two end points.
+	const StrokeAttribute& attr = data->attributes[stroke];
+	int stride = 1 << level;
+	int num = 0;
+	int segmentBegin = 0;
+
+	StrokePoint sp2 = GetPoint(stroke, 0);
+	for (int j = 0, k = 1; k < attr.pointNum; j=k++)
+	{
+		StrokePoint sp1 = sp2;
+		sp2 = GetPoint(stroke, k);
+
+		int div = GetSubdivisionNum(attr, j, k);
+		int interpolatedNum = div > 0 ? div - 1 : 0;
+		int segmentNum = interpolatedNum + 2;
+		float step = 1.0f / ((float)div + 1.0f);
+
+		// First particle of the segment on the stride
+		int m = (segmentBegin + stride - 1) / stride * stride - segmentBegin;
+		for (; m < segmentNum; m += stride)
+		{
+			if (m < interpolatedNum)
+			{
+				float t = step * (float)(m + 1);
+				particles[num++] = StrokePoint(
+					glm::mix(sp1.position, sp2.position, t),
+					glm::mix(sp1.color, sp2.color, t),
+					sp1.id,
+					sp1.size,
+					sp1.guid);
+			}
+			else if (m == interpolatedNum)
+			{
+				particles[num++] = sp1;
+			}
+			else
+			{
+				particles[num++] = sp2;
+			}
+		}
+
+		segmentBegin += segmentNum;
+	}
+
+	// A particle of the level l stands for 2^l particles of the finest level,
+	// so the opacity is raised to keep the accumulated coverage of the overlapped particles.
+	if (level > 0)
+	{
+		for (int i = 0; i < num; i++)
+		{
+			float& alpha = particles[i].color.a;
+			alpha = 1.0f - glm::pow(1.0f - glm::min(alpha, 1.0f), (float)stride);
+		}
+	}
+
+	return num;
+}
+
+int StrokeStore::SelectParticleLevel( int stroke, const glm::vec3& camPos, float pixelScale, float minDepth ) const
+{
+	// Projected particle spacing is kept at least one pixel,
+	// but the world space spacing never exceeds the brush size to avoid gaps.
+	const float minPixelSpacing = 1.0f;
+	const int maxLevel = 8;
+
+	const StrokeAttribute& attr = data->attributes[stroke];
+	if (attr.particleNum == 0)
+	{
+		return 0;
+	}
+
+	// The nearest point of the stroke determines the level
+	float depth = glm::max(glm::distance(camPos, attr.boundingSphereCenter) - attr.boundingSphereRadius, minDepth);
+	float pixelSpacing = attr.brushSpacing * pixelScale / depth;
+
+	int level = 0;
+	while (level < maxLevel &&
+		pixelSpacing * (float)(1 << level) < minPixelSpacing &&
+		attr.brushSpacing * (float)(2 << level) <= attr.minSize)
+	{
+		level++;
+	}
+	return level;
+}
@@ -0,0 +1,116 @@
+#ifndef __STROKE_STORE_H__
+#define __STROKE_STORE_H__
+
+struct StrokePoint;
+struct BoundingSphere;
+
+/*!
+	Stroke attribute.
+	The attributes shared by the points of a stroke and
+	the ranges of the stroke in the arrays of the stroke store.
+*/
+struct StrokeAttribute
+{
+
+	glm::vec4 color;		//!< Brush color. Opacity term included in the color.
+	int id;					//!< Brush ID.
+	float size;				//!< Brush size in the world space.
+	int guid;				//!< GUID assigned for each stroke.
+	float brushSpacing;		//!< Spacing of the particles.
+
+	int pointBegin;			//!< Index of the first point in the position arrays.
+	int pointNum;			//!< Number of the points.
+	int overrideBegin;		//!< Index of the first entry in the override table.
+	int overrideNum;		//!< Number of the overridden points.
+
+	int particleNum;		//!< Number of the particles in the finest level of detail.
+	float minSize;			//!< Smallest brush size of the points.
+	glm::vec3 boundingSphereCenter;
+	float boundingSphereRadius;
+
+};
+
+/*!
+	Stroke point override.
+	The attributes of a point which differ from its stroke attribute.
+*/
+struct StrokePointOverride
+{
+
+	int point;				//!< Index of the point in the stroke.
+	glm::vec4 color;
+	int id;
+	float size;
+	int guid;
+
+};
+
+/*!
+	Stroke store.
+	The class stores all strokes of the canvas.
+	The positions of the points are kept in the structure-of-arrays form in one contiguous arena,
+	and the attributes constant in a stroke are kept once per stroke.
+	Since the strokes are only added or removed from the back (undo),
+	the arena grows and shrinks like a stack.
+	The copies of the store share the arrays until either is modified (copy-on-write),
+	so a snapshot for the background save is taken in constant time.
+*/
+class StrokeStore
+{
+public:
+
+	StrokeStore();
+	int GetStrokeNum() const { return data->attributes.size(); }
+	int GetPointNum() const { return data->positionX.size(); }
+	int GetRevision() const { return revision; }
+	void Add(const std::vector<StrokePoint>& points, float brushSpacing);
+	void RemoveLast();
+	void Clear();
+
+	const StrokeAttribute& GetAttribute(int stroke) const { return data->attributes[stroke]; }
+	glm::vec3 GetPosition(int stroke, int point) const;
+	StrokePoint GetPoint(int stroke, int point) const;
+	void GetPoints(int stroke, std::vector<StrokePoint>& points) const;
+	BoundingSphere GetBoundingSphere(int stroke) const;
+
+	int GetParticleNum(int stroke, int level) const;
+	int GenerateParticles(int stroke, int level, StrokePoint* particles) const;
+	int SelectParticleLevel(int stroke, const glm::vec3& camPos, float pixelScale, float minDepth) const;
+
+private:
+
+	int GetSubdivisionNum(const StrokeAttribute& attr, int j, int k) const;
+	void UpdateDerivedAttribute(StrokeAttribute& attr) const;
+	void Detach();
+
+	// The project file and the journal read and write the arrays directly
+	friend class ProjectFile;
+	friend class StrokeJournal;
+
+private:
+
+	struct Data
+	{
+
+		// Position arena
+		std::vector<float> positionX;
+		std::vector<float> positionY;
+		std::vector<float> positionZ;
+
+		// Per-stroke attribute table
+		std::vector<StrokeAttribute> attributes;
+
+		// Per-point overrides sorted by the stroke and the point index
+		std::vector<StrokePointOverride> overrides;
+
+	};
+
+	// Shared with the copies of the store
+	boost::shared_ptr<Data> data;
+
+	// Incremented for each modification
+	int revision;
+
+};
+
+#endif // __STROKE_STORE_H__
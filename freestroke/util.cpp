@@ -1,6 +1,27 @@
 #include "util.h"
 
+namespace
+{
+
+	// Header of the brush cache file followed by the brush pixels
+	struct BrushCacheHeader
+	{
+		char magic[4];
+		int version;
+		int brushSize;
+		int brushNum;
+		int channels;
+		char key[20];		//!< SHA-1 of the names, sizes and modification times of the brush files.
+	};
+
+	const char brushCacheMagic[4] = { 'F', 'S', 'B', 'R' };
+	const int brushCacheVersion = 2;
+
+}
+
 Util::Util()
+	: brushChannels(1)
+	, brushData(NULL)
 {
 	brushSize = 128;
 }
@@ -10,30 +31,211 @@ void Util::ShowStatusMessage( QString mes )
 	emit StatusMessage(mes);
 }
 
-void Util::CreateBrushPathList()
+void Util::LoadBrushes()
 {
+	brushPathList.clear();
+	brushDecodedData.clear();
+	brushData = NULL;
+
 	QDir brushDir(QDir::current().absoluteFilePath("brushes"));
-	if (brushDir.exists())
+	if (!brushDir.exists())
 	{
-		QStringList filters;
-		//filters << "*.png";
-		QFileInfoList infoList = brushDir.entryInfoList(filters, QDir::Files, QDir::Name);
-		QListIterator<QFileInfo> it(infoList);
-		while (it.hasNext())
+		ShowStatusMessage("Brush path does not exist");
+		return;
+	}
+
+	QStringList filters;
+	//filters << "*.png";
+	QFileInfoList infoList = brushDir.entryInfoList(filters, QDir::Files, QDir::Name);
+	QListIterator<QFileInfo> it(infoList);
+	while (it.hasNext())
+	{
+		brushPathList.push_back(it.next().absoluteFilePath());
+	}
+
+	if (brushPathList.empty())
+	{
+		return;
+	}
+
+	// The cache is valid while the brush files are not changed,
+	// so the brushes are not decoded at all in the usual startup.
+	QString cachePath = QDir::current().absoluteFilePath("cache/brushes.bin");
+	QByteArray key = GetBrushCacheKey();
+	if (LoadBrushCache(cachePath, key))
+	{
+		return;
+	}
+
+	// ------------------------------------------------------------
+
+	// Decode and convert the brushes in parallel.
+	// The brushes are grey masks, so each texel is stored as the grey level and the alpha
+	// with the rows in the bottom-up order as GL expects.
+	int n = brushPathList.size();
+	int size = (int)brushSize;
+	int texelNum = size * size;
+	brushDecodedData.resize(n * texelNum * 2);
+	std::vector<int> errors(n, 0);
+	std::vector<unsigned char> greyUsed(n, 0);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < n; i++)
+	{
+		QImage image;
+		if (!image.load(brushPathList[i]))
+		{
+			errors[i] = 1;
+			continue;
+		}
+		if (image.width() != size || image.height() != size)
+		{
+			errors[i] = 2;
+			continue;
+		}
+
+		image = image.convertToFormat(QImage::Format_ARGB32);
+		unsigned char* dest = &brushDecodedData[i * texelNum * 2];
+		for (int y = 0; y < size; y++)
 		{
-			QString path = it.next().absoluteFilePath();
-			QImage image(path);
-			if (image.width() != brushSize || image.height() != brushSize)
+			const QRgb* src = (const QRgb*)image.constScanLine(size - 1 - y);
+			for (int x = 0; x < size; x++)
 			{
-				ShowStatusMessage("Invalid brush image size: " + path);
-				brushPathList.clear();
-				return;
+				unsigned char grey = (unsigned char)qGray(src[x]);
+				unsigned char alpha = (unsigned char)qAlpha(src[x]);
+				*dest++ = grey;
+				*dest++ = alpha;
+				if (grey != 0 && alpha != 0)
+				{
+					greyUsed[i] = 1;
+				}
 			}
-			brushPathList.push_back(path);
 		}
 	}
-	else
+
+	for (int i = 0; i < n; i++)
 	{
-		ShowStatusMessage("Brush path does not exist");
+		if (errors[i] != 0)
+		{
+			ShowStatusMessage((errors[i] == 1 ? "Failed to load brush image: " : "Invalid brush image size: ") + brushPathList[i]);
+			brushPathList.clear();
+			brushDecodedData.clear();
+			return;
+		}
+	}
+
+	// The grey level only matters where the alpha is not zero.
+	// If no brush uses it, only the alpha is kept.
+	brushChannels = std::find(greyUsed.begin(), greyUsed.end(), 1) != greyUsed.end() ? 2 : 1;
+	if (brushChannels == 1)
+	{
+		for (int i = 0; i < n * texelNum; i++)
+		{
+			brushDecodedData[i] = brushDecodedData[i * 2 + 1];
+		}
+		brushDecodedData.resize(n * texelNum);
+	}
+
+	brushData = &brushDecodedData[0];
+	SaveBrushCache(cachePath, key);
+}
+
+QImage Util::GetBrushImage( int index )
+{
+	int size = (int)brushSize;
+	QImage image(size, size, QImage::Format_ARGB32);
+	const unsigned char* src = brushData + index * size * size * brushChannels;
+	for (int y = 0; y < size; y++)
+	{
+		QRgb* dest = (QRgb*)image.scanLine(size - 1 - y);
+		for (int x = 0; x < size; x++, src += brushChannels)
+		{
+			int grey = brushChannels == 1 ? 0 : src[0];
+			dest[x] = qRgba(grey, grey, grey, src[brushChannels - 1]);
+		}
+	}
+	return image;
+}
+
+QByteArray Util::GetBrushCacheKey()
+{
+	// Only the file attributes are used, so the key is computed without reading the files
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	for (int i = 0; i < brushPathList.size(); i++)
+	{
+		QFileInfo info(brushPathList[i]);
+		hash.addData(info.fileName().toUtf8());
+		hash.addData(QByteArray::number(info.size()));
+		hash.addData(info.lastModified().toString(Qt::ISODate).toUtf8());
+	}
+	return hash.result();
+}
+
+bool Util::LoadBrushCache( const QString& path, const QByteArray& key )
+{
+	brushCacheFile.close();
+	brushCacheFile.setFileName(path);
+	if (!brushCacheFile.open(QIODevice::ReadOnly))
+	{
+		return false;
+	}
+
+	int n = brushPathList.size();
+	int size = (int)brushSize;
+	if (brushCacheFile.size() < sizeof(BrushCacheHeader))
+	{
+		brushCacheFile.close();
+		return false;
+	}
+
+	// The pixels are used directly from the mapped file
+	const uchar* p = brushCacheFile.map(0, brushCacheFile.size());
+	if (!p)
+	{
+		brushCacheFile.close();
+		return false;
+	}
+
+	BrushCacheHeader header;
+	memcpy(&header, p, sizeof(BrushCacheHeader));
+	if (memcmp(header.magic, brushCacheMagic, sizeof(header.magic)) != 0 ||
+		header.version != brushCacheVersion ||
+		header.brushSize != size ||
+		header.brushNum != n ||
+		(header.channels != 1 && header.channels != 2) ||
+		brushCacheFile.size() != sizeof(BrushCacheHeader) + (qint64)n * size * size * header.channels ||
+		key.size() != sizeof(header.key) ||
+		memcmp(header.key, key.constData(), sizeof(header.key)) != 0)
+	{
+		brushCacheFile.close();
+		return false;
+	}
+
+	brushChannels = header.channels;
+	brushData = p + sizeof(BrushCacheHeader);
+	return true;
+}
+
+void Util::SaveBrushCache( const QString& path, const QByteArray& key )
+{
+	// Failure of writing the cache is not an error
+	if (!QDir().mkpath(QFileInfo(path).absolutePath()))
+	{
+		return;
+	}
+
+	BrushCacheHeader header;
+	memcpy(header.magic, brushCacheMagic, sizeof(header.magic));
+	header.version = brushCacheVersion;
+	header.brushSize = (int)brushSize;
+	header.brushNum = brushPathList.size();
+	header.channels = brushChannels;
+	memcpy(header.key, key.constData(), sizeof(header.key));
+
+	QFile file(path);
+	if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		file.write((const char*)&header, sizeof(BrushCacheHeader));
+		file.write((const char*)&brushDecodedData[0], brushDecodedData.size());
 	}
 }
@@ -29,11 +29,26 @@ public:
 public:
 
 	void ShowStatusMessage(QString mes);
-	void CreateBrushPathList();
+	void LoadBrushes();
 	QString GetBrushPath(int index) { return brushPathList[index]; }
 	int GetBrushNum() { return brushPathList.size(); }
 	float GetBrushSize() { return brushSize; }
 
+	/*!
+		Get brush data.
+		@return Texels of all brushes with bottom-up rows, ready for the texture upload.
+		Each texel is the alpha (one channel) or the grey level and the alpha (two channels).
+	*/
+	const unsigned char* GetBrushData() { return brushData; }
+	int GetBrushChannels() { return brushChannels; }
+	QImage GetBrushImage(int index);
+
+private:
+
+	QByteArray GetBrushCacheKey();
+	bool LoadBrushCache(const QString& path, const QByteArray& key);
+	void SaveBrushCache(const QString& path, const QByteArray& key);
+
 signals:
 
 	void StatusMessage(QString mes);
@@ -43,6 +58,12 @@ private:
 	float brushSize;
 	std::vector<QString> brushPathList;
 
+	// Packed brush pixels either mapped from the cache file or decoded in memory
+	QFile brushCacheFile;
+	std::vector<unsigned char> brushDecodedData;
+	int brushChannels;
+	const unsigned char* brushData;
+
 };
 
 #endif // __UTIL_H__
\ No newline at end of file
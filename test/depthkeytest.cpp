@@ -0,0 +1,198 @@
+/*
+	Depth key kernel test.
+	Compares DepthKeyKernel::Compute against the scalar path,
+	since the ordering of the strokes relies on the precision of the keys.
+	Covers the counts which are not a multiple of 8 (the padded tail),
+	the large GUIDs and stroke order offsets, and a particle at the camera position.
+	Build with depthkey.cpp and exception.cpp of the application, with common.h force-included.
+	Returns non-zero if any check fails.
+*/
+#include "common.h"
+#include "depthkey.h"
+
+namespace
+{
+
+	const float tolerance = 1e-5f;
+
+	int failureNum = 0;
+
+	void Check(bool condition, const std::string& message)
+	{
+		if (!condition)
+		{
+			std::cerr << "FAILED: " << message << std::endl;
+			failureNum++;
+		}
+	}
+
+	float RandomFloat()
+	{
+		return (float)rand() / (float)RAND_MAX;
+	}
+
+	struct Particles
+	{
+		std::vector<float> x, y, z, guid;
+
+		void Add(const glm::vec3& p, float g)
+		{
+			x.push_back(p.x);
+			y.push_back(p.y);
+			z.push_back(p.z);
+			guid.push_back(g);
+		}
+
+		int Size() const { return x.size(); }
+	};
+
+	Particles RandomParticles(int n, float extent, float maxGuid)
+	{
+		Particles particles;
+		for (int i = 0; i < n; i++)
+		{
+			glm::vec3 p((RandomFloat() - 0.5f) * extent, (RandomFloat() - 0.5f) * extent, (RandomFloat() - 0.5f) * extent);
+			particles.Add(p, (float)(int)(RandomFloat() * maxGuid));
+		}
+		return particles;
+	}
+
+	// Computes the keys with the kernel. The keys are surrounded by the guards to detect the writes out of the range.
+	std::vector<float> ComputeKeys(const Particles& particles, const glm::vec3& camPos, float strokeOrderOffset)
+	{
+		const float guard = -12345.0f;
+		int n = particles.Size();
+		std::vector<float> keys(n + 16, guard);
+		if (n > 0)
+		{
+			DepthKeyKernel::Compute(
+				&particles.x[0], &particles.y[0], &particles.z[0], &particles.guid[0], n,
+				camPos, strokeOrderOffset, &keys[8]);
+		}
+		for (int i = 0; i < 8; i++)
+		{
+			Check(keys[i] == guard && keys[n + 8 + i] == guard, (boost::format("%d particles: write out of the range") % n).str());
+		}
+		return std::vector<float>(keys.begin() + 8, keys.begin() + 8 + n);
+	}
+
+	void CheckAgainstScalar(const Particles& particles, const glm::vec3& camPos, float strokeOrderOffset, const std::string& name)
+	{
+		int n = particles.Size();
+		std::vector<float> keys = ComputeKeys(particles, camPos, strokeOrderOffset);
+		if (n == 0)
+		{
+			return;
+		}
+
+		float error = DepthKeyKernel::MaxRelativeError(
+			&particles.x[0], &particles.y[0], &particles.z[0], &particles.guid[0], n,
+			camPos, strokeOrderOffset, &keys[0]);
+		Check(error <= tolerance, (boost::format("%s: relative error %e") % name % error).str());
+	}
+
+}
+
+int main()
+{
+	srand(1);
+
+	// ------------------------------------------------------------
+
+	// Counts around the multiples of 8, so that the tail is padded with 0 to 7 particles
+	{
+		glm::vec3 camPos(10.0f, 20.0f, 200.0f);
+		for (int n = 0; n <= 41; n++)
+		{
+			CheckAgainstScalar(RandomParticles(n, 100.0f, 3000.0f), camPos, 0.01f, (boost::format("%d particles") % n).str());
+		}
+		CheckAgainstScalar(RandomParticles(100003, 100.0f, 3000.0f), camPos, 0.01f, "100003 particles");
+	}
+
+	// The tail must be computed as in the blocks of 8.
+	// The same particle must get the same key regardless of its position in the array.
+	{
+		glm::vec3 camPos(-3.0f, 5.0f, 50.0f);
+		Particles particles = RandomParticles(8, 20.0f, 100.0f);
+		std::vector<float> blockKeys = ComputeKeys(particles, camPos, 0.05f);
+		for (int n = 1; n < 8; n++)
+		{
+			Particles tail;
+			for (int i = 0; i < n; i++)
+			{
+				tail.Add(glm::vec3(particles.x[i], particles.y[i], particles.z[i]), particles.guid[i]);
+			}
+			std::vector<float> tailKeys = ComputeKeys(tail, camPos, 0.05f);
+			for (int i = 0; i < n; i++)
+			{
+				Check(tailKeys[i] == blockKeys[i], (boost::format("tail of %d: key %d differs from the block") % n % i).str());
+			}
+		}
+	}
+
+	// Large GUIDs and stroke order offsets.
+	// The offset exceeds the distance from the camera, and the key passes close to zero.
+	{
+		glm::vec3 camPos(0.0f, 0.0f, 100.0f);
+		float offsets[] = { 0.0f, 0.001f, 0.1f, 1.0f, 10.0f };
+		float maxGuids[] = { 1.0f, 65535.0f, 1e6f };
+		for (int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+		{
+			for (int j = 0; j < sizeof(maxGuids) / sizeof(maxGuids[0]); j++)
+			{
+				CheckAgainstScalar(RandomParticles(1027, 100.0f, maxGuids[j]), camPos, offsets[i],
+					(boost::format("offset %g, GUIDs up to %g") % offsets[i] % maxGuids[j]).str());
+			}
+		}
+	}
+
+	// Far camera, where the squared distance is large relative to the extent of the particles
+	{
+		glm::vec3 camPos(1e4f, -2e4f, 3e4f);
+		CheckAgainstScalar(RandomParticles(1029, 100.0f, 3000.0f), camPos, 0.01f, "far camera");
+	}
+
+	// Particle at the camera position.
+	// The direction is undefined, so the key must be the closed form (strokeOrderOffset * guid)^2
+	// and must not be NaN. The other particles in the same block must not be affected.
+	{
+		glm::vec3 camPos(1.0f, 2.0f, 3.0f);
+		const float strokeOrderOffset = 0.01f;
+		Particles particles = RandomParticles(11, 10.0f, 3000.0f);
+		particles.x[5] = camPos.x;
+		particles.y[5] = camPos.y;
+		particles.z[5] = camPos.z;
+		particles.guid[5] = 1234.0f;
+		std::vector<float> keys = ComputeKeys(particles, camPos, strokeOrderOffset);
+
+		float expected = (strokeOrderOffset * 1234.0f) * (strokeOrderOffset * 1234.0f);
+		Check(keys[5] == keys[5], "particle at the camera: NaN key");
+		Check(glm::abs(keys[5] - expected) <= tolerance * expected,
+			(boost::format("particle at the camera: key %g, expected %g") % keys[5] % expected).str());
+
+		// Guid 0 at the camera is the nearest possible key
+		particles.guid[5] = 0.0f;
+		keys = ComputeKeys(particles, camPos, strokeOrderOffset);
+		Check(keys[5] >= 0.0f && keys[5] <= 1e-6f, (boost::format("particle at the camera with guid 0: key %g") % keys[5]).str());
+
+		for (int i = 0; i < particles.Size(); i++)
+		{
+			if (i == 5) continue;
+			float key;
+			DepthKeyKernel::ComputeScalar(&particles.x[i], &particles.y[i], &particles.z[i], &particles.guid[i], 1,
+				camPos, strokeOrderOffset, &key);
+			float scale = glm::max(key, glm::distance2(glm::vec3(particles.x[i], particles.y[i], particles.z[i]), camPos));
+			Check(glm::abs(keys[i] - key) <= tolerance * scale,
+				(boost::format("particle %d next to the particle at the camera") % i).str());
+		}
+	}
+
+	if (failureNum > 0)
+	{
+		std::cerr << failureNum << " check(s) failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
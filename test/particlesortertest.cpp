@@ -0,0 +1,207 @@
+/*
+	Particle sorter test.
+	Drives ParticleSorter::Sort over a sequence of frames in which the particle set
+	changes like with the culling and the level of detail: the particles are removed,
+	added and reordered while the keys move a little per frame.
+	Each result must be a permutation of the current particles in the descending order of the keys.
+	Build with particlesorter.cpp and exception.cpp of the application, with common.h force-included.
+	Returns non-zero if any check fails.
+*/
+#include "common.h"
+#include "particlesorter.h"
+
+namespace
+{
+
+	int failureNum = 0;
+
+	void Check(bool condition, const std::string& message)
+	{
+		if (!condition)
+		{
+			std::cerr << "FAILED: " << message << std::endl;
+			failureNum++;
+		}
+	}
+
+	void CheckSorted(ParticleSorter& sorter, const std::vector<float>& keys, const std::string& name)
+	{
+		const std::vector<unsigned int>& indices = sorter.GetIndices();
+		Check(indices.size() == keys.size(), name + ": size");
+		if (indices.size() != keys.size())
+		{
+			return;
+		}
+
+		std::vector<char> visited(keys.size(), 0);
+		bool permutation = true;
+		bool sorted = true;
+		for (int i = 0; i < indices.size(); i++)
+		{
+			if (indices[i] >= keys.size() || visited[indices[i]])
+			{
+				permutation = false;
+				break;
+			}
+			visited[indices[i]] = 1;
+			if (i > 0 && keys[indices[i-1]] < keys[indices[i]])
+			{
+				sorted = false;
+			}
+		}
+		Check(permutation, name + ": permutation");
+		Check(permutation && sorted, name + ": order");
+	}
+
+	// Particle with the stable ID and the key which slowly changes over the frames
+	struct Particle
+	{
+		unsigned int id;
+		float key;
+	};
+
+	void MakeFrame(const std::vector<Particle>& particles, std::vector<float>& keys, std::vector<unsigned int>& ids)
+	{
+		keys.resize(particles.size());
+		ids.resize(particles.size());
+		for (int i = 0; i < particles.size(); i++)
+		{
+			keys[i] = particles[i].key;
+			ids[i] = particles[i].id;
+		}
+	}
+
+	float RandomFloat()
+	{
+		return (float)rand() / (float)RAND_MAX;
+	}
+
+}
+
+int main()
+{
+	const unsigned int idNum = 100000;
+	const int frameNum = 60;
+
+	srand(1);
+	ParticleSorter sorter;
+	std::vector<float> keys;
+	std::vector<unsigned int> ids;
+
+	// All particles and the visible subset in the order of the generation
+	std::vector<float> allKeys(idNum);
+	for (int i = 0; i < idNum; i++)
+	{
+		allKeys[i] = RandomFloat() * 100.0f;
+	}
+
+	int incrementalNum = 0;
+	for (int frame = 0; frame < frameNum; frame++)
+	{
+		// Small motion of the keys
+		for (int i = 0; i < idNum; i++)
+		{
+			allKeys[i] += (RandomFloat() - 0.5f) * 0.01f;
+		}
+
+		// The visible range slides and changes its size, so the particles are
+		// culled from the front and added to the back, and the count changes every frame.
+		int begin = frame * 500;
+		int end = std::min((int)idNum, 50000 + frame * 700 + (frame % 3) * 1000);
+		std::vector<Particle> particles;
+		for (int i = begin; i < end; i++)
+		{
+			// Every 7th particle is culled in the odd frames
+			if (frame % 2 == 1 && i % 7 == 0) continue;
+			Particle p = { (unsigned int)i, allKeys[i] };
+			particles.push_back(p);
+		}
+
+		// The generation order differs from the previous frame in some frames
+		if (frame % 5 == 4)
+		{
+			std::reverse(particles.begin(), particles.end());
+		}
+
+		MakeFrame(particles, keys, ids);
+		sorter.Sort(keys, ids, idNum);
+		CheckSorted(sorter, keys, (boost::format("frame %d (%d particles)") % frame % keys.size()).str());
+		if (sorter.IsLastSortIncremental())
+		{
+			incrementalNum++;
+		}
+	}
+
+	// The previous order must be reused despite the changing count
+	Check(incrementalNum >= frameNum / 2, (boost::format("incremental sorts %d/%d") % incrementalNum % frameNum).str());
+
+	// ------------------------------------------------------------
+
+	// The order is not reused across an entirely different particle set,
+	// e.g. after the strokes are replaced by loading a file.
+	{
+		std::vector<Particle> particles;
+		for (int i = 0; i < 1000; i++)
+		{
+			Particle p = { (unsigned int)(idNum - 1 - i), RandomFloat() };
+			particles.push_back(p);
+		}
+		MakeFrame(particles, keys, ids);
+		sorter.Sort(keys, ids, idNum);
+		CheckSorted(sorter, keys, "new particle set");
+	}
+
+	// Shrinking ID space after the strokes are undone
+	{
+		std::vector<Particle> particles;
+		for (int i = 0; i < 500; i++)
+		{
+			Particle p = { (unsigned int)i, RandomFloat() };
+			particles.push_back(p);
+		}
+		MakeFrame(particles, keys, ids);
+		sorter.Sort(keys, ids, 500);
+		CheckSorted(sorter, keys, "shrunk ID space");
+	}
+
+	// Duplicated IDs fall back to the full sort
+	{
+		std::vector<Particle> particles;
+		for (int i = 0; i < 500; i++)
+		{
+			Particle p = { (unsigned int)(i / 2), RandomFloat() };
+			particles.push_back(p);
+		}
+		MakeFrame(particles, keys, ids);
+		sorter.Sort(keys, ids, 500);
+		CheckSorted(sorter, keys, "duplicated IDs");
+		Check(!sorter.IsLastSortIncremental(), "duplicated IDs: full sort");
+	}
+
+	// Empty frame and the frame after it
+	{
+		keys.clear();
+		ids.clear();
+		sorter.Sort(keys, ids, 0);
+		CheckSorted(sorter, keys, "empty frame");
+
+		std::vector<Particle> particles;
+		for (int i = 0; i < 100; i++)
+		{
+			Particle p = { (unsigned int)i, RandomFloat() };
+			particles.push_back(p);
+		}
+		MakeFrame(particles, keys, ids);
+		sorter.Sort(keys, ids, 100);
+		CheckSorted(sorter, keys, "after empty frame");
+	}
+
+	if (failureNum > 0)
+	{
+		std::cerr << failureNum << " check(s) failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "All checks passed (" << incrementalNum << "/" << frameNum << " incremental sorts)" << std::endl;
+	return 0;
+}